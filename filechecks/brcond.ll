@@ -0,0 +1,14 @@
+define i64 @main(i64 %x) {
+; CHECK: start main 1:
+; CHECK-NOT: icmp
+; CHECK: [[R:r[0-9]+]] = and arg1 1 64
+; CHECK-NEXT: br [[R]] .odd .even
+entry:
+  %a = and i64 %x, 1
+  %c = icmp ne i64 %a, 0
+  br i1 %c, label %odd, label %even
+odd:
+  ret i64 1
+even:
+  ret i64 2
+}
@@ -0,0 +1,57 @@
+declare noalias i8* @malloc(i64)
+declare i64 @read()
+declare void @write(i64)
+
+; The loop doubling a into b only reads what the read loop has stored in
+; the same iteration, so both run in one loop.
+define i64 @main() {
+; CHECK: start main 0:
+; CHECK-NOT: .for.body2:
+; CHECK: .for.body:
+; CHECK: call read
+; CHECK: mul {{r[0-9]+}} 2 64
+; CHECK-NOT: .for.body2:
+; CHECK: end main
+entry:
+  %n = call i64 @read()
+  %size = mul i64 %n, 8
+  %pa = call i8* @malloc(i64 %size)
+  %a = bitcast i8* %pa to i64*
+  %pb = call i8* @malloc(i64 %size)
+  %b = bitcast i8* %pb to i64*
+  br label %for.cond
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc, %for.body ]
+  %cmp = icmp ult i64 %i, %n
+  br i1 %cmp, label %for.body, label %for.end
+for.body:
+  %v = call i64 @read()
+  %pai = getelementptr inbounds i64, i64* %a, i64 %i
+  store i64 %v, i64* %pai
+  %inc = add i64 %i, 1
+  br label %for.cond
+for.end:
+  %k = add i64 %n, 3
+  br label %for.cond2
+for.cond2:
+  %j = phi i64 [ 0, %for.end ], [ %inc2, %for.body2 ]
+  %sum = phi i64 [ %k, %for.end ], [ %sum.next, %for.body2 ]
+  %cmp2 = icmp ult i64 %j, %n
+  br i1 %cmp2, label %for.body2, label %for.end2
+for.body2:
+  %paj = getelementptr inbounds i64, i64* %a, i64 %j
+  %x = load i64, i64* %paj
+  %y = mul i64 %x, 2
+  %pbj = getelementptr inbounds i64, i64* %b, i64 %j
+  store i64 %y, i64* %pbj
+  %sum.next = add i64 %sum, %y
+  %inc2 = add i64 %j, 1
+  br label %for.cond2
+for.end2:
+  call void @write(i64 %sum)
+  %last = sub i64 %n, 1
+  %pbl = getelementptr inbounds i64, i64* %b, i64 %last
+  %z = load i64, i64* %pbl
+  call void @write(i64 %z)
+  ret i64 0
+}
@@ -0,0 +1,28 @@
+@count = global i64 0
+
+declare i64 @read()
+
+define i64 @main() {
+; CHECK: start main 0:
+; CHECK: load 8 10232 0
+; CHECK-NOT: 10232
+; CHECK: .for.end:
+; CHECK: store 8 {{r[0-9]+}} 10232 0
+; CHECK: ret
+entry:
+  %n = call i64 @read()
+  br label %for.cond
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc, %for.body ]
+  %cmp = icmp slt i64 %i, %n
+  br i1 %cmp, label %for.body, label %for.end
+for.body:
+  %c = load i64, i64* @count
+  %add = add i64 %c, %i
+  store i64 %add, i64* @count
+  %inc = add i64 %i, 1
+  br label %for.cond
+for.end:
+  %r = load i64, i64* @count
+  ret i64 %r
+}
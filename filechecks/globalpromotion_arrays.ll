@@ -0,0 +1,51 @@
+@n = global i64 0
+@a = global i64* null
+@b = global i64* null
+
+declare i64 @read()
+declare noalias i8* @malloc(i64)
+declare void @write(i64)
+
+; b[i] = a[i] + n walks 80000 bytes of each of two arrays, so they are at
+; least that far apart. Reloading n, a and b costs less than the travel
+; the resets they bring can save, so none of them is kept in a register.
+define i64 @main() {
+; CHECK: start main 0:
+; CHECK: .for.body:
+; CHECK: reset heap
+; CHECK-NEXT: load 8 20480 0
+; CHECK: reset stack
+; CHECK-NEXT: load 8 10232 0
+; CHECK: .for.end:
+entry:
+  %m = call i64 @read()
+  store i64 %m, i64* @n
+  %bytes = mul i64 %m, 8
+  %p = call i8* @malloc(i64 %bytes)
+  %pa = bitcast i8* %p to i64*
+  store i64* %pa, i64** @a
+  %q = call i8* @malloc(i64 %bytes)
+  %qb = bitcast i8* %q to i64*
+  store i64* %qb, i64** @b
+  br label %for.cond
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc, %for.body ]
+  %len = load i64, i64* @n
+  %cmp = icmp slt i64 %i, 10000
+  br i1 %cmp, label %for.body, label %for.end
+for.body:
+  %a = load i64*, i64** @a
+  %aptr = getelementptr inbounds i64, i64* %a, i64 %i
+  %v = load i64, i64* %aptr
+  %w = add i64 %v, %len
+  %b = load i64*, i64** @b
+  %bptr = getelementptr inbounds i64, i64* %b, i64 %i
+  store i64 %w, i64* %bptr
+  %inc = add i64 %i, 1
+  br label %for.cond
+for.end:
+  %b0 = load i64*, i64** @b
+  %r = load i64, i64* %b0
+  call void @write(i64 %r)
+  ret i64 0
+}
@@ -0,0 +1,19 @@
+define i32 @main(i32 %x, i32 %y) {
+; CHECK: start main 2:
+; CHECK: select
+; CHECK-NOT: br
+; CHECK: end main
+entry:
+  %cmp = icmp slt i32 %x, %y
+  br i1 %cmp, label %cond.true, label %cond.false
+
+cond.true:
+  br label %cond.end
+
+cond.false:
+  br label %cond.end
+
+cond.end:
+  %cond = phi i32 [ %x, %cond.true ], [ %y, %cond.false ]
+  ret i32 %cond
+}
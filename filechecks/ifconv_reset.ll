@@ -0,0 +1,52 @@
+declare i64 @read()
+declare i8* @malloc(i64)
+declare void @write(i64)
+
+; The min of two elements of row j goes to row j + 1, through the table of
+; rows that is read before them. The phi is a stack slot while the branch
+; is there, so the head is reset before it goes back to the table; a
+; select would leave it to travel back from row j.
+define i64 @main() {
+; CHECK: start main 0:
+; CHECK: br
+; CHECK-NOT: select
+; CHECK: .cond.end:
+; CHECK: reset heap
+; CHECK: end main
+entry:
+  %p = call i8* @malloc(i64 16)
+  %t = bitcast i8* %p to i64**
+  %q = call i8* @malloc(i64 80000)
+  %r0 = bitcast i8* %q to i64*
+  %r1 = getelementptr inbounds i64, i64* %r0, i64 5000
+  %j = call i64 @read()
+  %i = call i64 @read()
+  store i64* %r0, i64** %t
+  %t1 = getelementptr inbounds i64*, i64** %t, i64 1
+  store i64* %r1, i64** %t1
+  %rowp = getelementptr inbounds i64*, i64** %t, i64 %j
+  %row = load i64*, i64** %rowp
+  %xp = getelementptr inbounds i64, i64* %row, i64 %i
+  %x = load i64, i64* %xp
+  %i1 = add i64 %i, 1
+  %yp = getelementptr inbounds i64, i64* %row, i64 %i1
+  %y = load i64, i64* %yp
+  %cmp = icmp slt i64 %x, %y
+  br i1 %cmp, label %cond.true, label %cond.false
+
+cond.true:
+  br label %cond.end
+
+cond.false:
+  br label %cond.end
+
+cond.end:
+  %cond = phi i64 [ %x, %cond.true ], [ %y, %cond.false ]
+  %j1 = add i64 %j, 1
+  %dstp = getelementptr inbounds i64*, i64** %t, i64 %j1
+  %dst = load i64*, i64** %dstp
+  %zp = getelementptr inbounds i64, i64* %dst, i64 %i
+  store i64 %cond, i64* %zp
+  call void @write(i64 %cond)
+  ret i64 0
+}
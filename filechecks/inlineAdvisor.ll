@@ -0,0 +1,81 @@
+declare i64 @read()
+declare void @write(i64)
+
+; A long chain without loops: too big for the inliner's own threshold, but
+; on SWPP the only cost of inlining it is registers, and it needs few.
+define i64 @mix(i64 %x, i64 %y) {
+  %t0 = add i64 %x, %y
+  %t1 = xor i64 %t0, %y
+  %t2 = mul i64 %t1, %y
+  %t3 = add i64 %t2, %y
+  %t4 = xor i64 %t3, %y
+  %t5 = mul i64 %t4, %y
+  %t6 = add i64 %t5, %y
+  %t7 = xor i64 %t6, %y
+  %t8 = mul i64 %t7, %y
+  %t9 = add i64 %t8, %y
+  %t10 = xor i64 %t9, %y
+  %t11 = mul i64 %t10, %y
+  %t12 = add i64 %t11, %y
+  %t13 = xor i64 %t12, %y
+  %t14 = mul i64 %t13, %y
+  %t15 = add i64 %t14, %y
+  %t16 = xor i64 %t15, %y
+  %t17 = mul i64 %t16, %y
+  %t18 = add i64 %t17, %y
+  %t19 = xor i64 %t18, %y
+  %t20 = mul i64 %t19, %y
+  %t21 = add i64 %t20, %y
+  %t22 = xor i64 %t21, %y
+  %t23 = mul i64 %t22, %y
+  %t24 = add i64 %t23, %y
+  %t25 = xor i64 %t24, %y
+  %t26 = mul i64 %t25, %y
+  %t27 = add i64 %t26, %y
+  %t28 = xor i64 %t27, %y
+  %t29 = mul i64 %t28, %y
+  %t30 = add i64 %t29, %y
+  %t31 = xor i64 %t30, %y
+  %t32 = mul i64 %t31, %y
+  %t33 = add i64 %t32, %y
+  %t34 = xor i64 %t33, %y
+  %t35 = mul i64 %t34, %y
+  %t36 = add i64 %t35, %y
+  %t37 = xor i64 %t36, %y
+  %t38 = mul i64 %t37, %y
+  %t39 = add i64 %t38, %y
+  %t40 = xor i64 %t39, %y
+  %t41 = mul i64 %t40, %y
+  %t42 = add i64 %t41, %y
+  %t43 = xor i64 %t42, %y
+  %t44 = mul i64 %t43, %y
+  %t45 = add i64 %t44, %y
+  %t46 = xor i64 %t45, %y
+  %t47 = mul i64 %t46, %y
+  %t48 = add i64 %t47, %y
+  %t49 = xor i64 %t48, %y
+  %t50 = mul i64 %t49, %y
+  %t51 = add i64 %t50, %y
+  %t52 = xor i64 %t51, %y
+  %t53 = mul i64 %t52, %y
+  %t54 = add i64 %t53, %y
+  %t55 = xor i64 %t54, %y
+  %t56 = mul i64 %t55, %y
+  %t57 = add i64 %t56, %y
+  %t58 = xor i64 %t57, %y
+  %t59 = mul i64 %t58, %y
+  ret i64 %t59
+}
+
+define i64 @main() {
+; CHECK: start main 0:
+; CHECK-NOT: call mix
+; CHECK: end main
+  %a = call i64 @read()
+  %b = call i64 @read()
+  %r1 = call i64 @mix(i64 %a, i64 %b)
+  call void @write(i64 %r1)
+  %r2 = call i64 @mix(i64 %b, i64 %a)
+  call void @write(i64 %r2)
+  ret i64 0
+}
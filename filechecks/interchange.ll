@@ -0,0 +1,43 @@
+declare i8* @malloc(i64)
+declare void @write(i64)
+
+; a[j][i] = i with j inner walks the array a row at a time; the loops
+; are swapped so that the row offset is computed outside the inner loop.
+define i64 @main() {
+; CHECK: start main 0:
+; CHECK: .for.body:
+; CHECK: mul {{r[0-9]+}} 100 64
+; CHECK: .for.body3:
+; CHECK-NOT: mul {{r[0-9]+}} 100 64
+; CHECK: store 8
+; CHECK: .for.inc.i:
+entry:
+  %p = call i8* @malloc(i64 80000)
+  %a = bitcast i8* %p to i64*
+  br label %for.cond
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc.i, %for.inc.i ]
+  %cmp.i = icmp ult i64 %i, 100
+  br i1 %cmp.i, label %for.body, label %for.end
+for.body:
+  br label %for.cond1
+for.cond1:
+  %j = phi i64 [ 0, %for.body ], [ %inc.j, %for.body3 ]
+  %cmp.j = icmp ult i64 %j, 100
+  br i1 %cmp.j, label %for.body3, label %for.inc.i
+for.body3:
+  %row = mul i64 %j, 100
+  %idx = add i64 %row, %i
+  %ptr = getelementptr inbounds i64, i64* %a, i64 %idx
+  store i64 %i, i64* %ptr
+  %inc.j = add i64 %j, 1
+  br label %for.cond1
+for.inc.i:
+  %inc.i = add i64 %i, 1
+  br label %for.cond
+for.end:
+  %last = getelementptr inbounds i64, i64* %a, i64 9999
+  %v = load i64, i64* %last
+  call void @write(i64 %v)
+  ret i64 0
+}
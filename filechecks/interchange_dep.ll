@@ -0,0 +1,46 @@
+declare i8* @malloc(i64)
+declare void @write(i64)
+
+; a[j][i] = a[j - 1][i + 1] + 1 with j inner reads what the previous
+; iteration of i wrote; the accesses never overlap within one iteration,
+; but swapping the loops would read a[j - 1][i + 1] before it is written.
+define i64 @main() {
+; CHECK: start main 0:
+; CHECK: .for.body:
+; CHECK-NOT: mul {{r[0-9]+}} 100 64
+; CHECK: .for.body3:
+; CHECK: mul {{r[0-9]+}} 100 64
+entry:
+  %p = call i8* @malloc(i64 80000)
+  %a = bitcast i8* %p to i64*
+  br label %for.cond
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc.i, %for.inc.i ]
+  %cmp.i = icmp ult i64 %i, 99
+  br i1 %cmp.i, label %for.body, label %for.end
+for.body:
+  br label %for.cond1
+for.cond1:
+  %j = phi i64 [ 1, %for.body ], [ %inc.j, %for.body3 ]
+  %cmp.j = icmp ult i64 %j, 100
+  br i1 %cmp.j, label %for.body3, label %for.inc.i
+for.body3:
+  %row = mul i64 %j, 100
+  %idx = add i64 %row, %i
+  %src = sub i64 %idx, 99
+  %sptr = getelementptr inbounds i64, i64* %a, i64 %src
+  %old = load i64, i64* %sptr
+  %new = add i64 %old, 1
+  %ptr = getelementptr inbounds i64, i64* %a, i64 %idx
+  store i64 %new, i64* %ptr
+  %inc.j = add i64 %j, 1
+  br label %for.cond1
+for.inc.i:
+  %inc.i = add i64 %i, 1
+  br label %for.cond
+for.end:
+  %last = getelementptr inbounds i64, i64* %a, i64 9900
+  %v = load i64, i64* %last
+  call void @write(i64 %v)
+  ret i64 0
+}
@@ -0,0 +1,72 @@
+declare i64 @read()
+declare void @write(i64)
+
+; Twelve values feed the loop and five more stay live across it, which is
+; more than the registers. Outlined, the loop sees the twelve as arguments
+; and the five stay behind in the caller.
+define i64 @main() {
+; CHECK: start main 0:
+; CHECK: call main_outlined0
+; CHECK: end main
+; CHECK: start main_outlined0 {{[0-9]+}}:
+; CHECK: end main_outlined0
+entry:
+  %n = call i64 @read()
+  %a0 = call i64 @read()
+  %a1 = call i64 @read()
+  %a2 = call i64 @read()
+  %a3 = call i64 @read()
+  %a4 = call i64 @read()
+  %a5 = call i64 @read()
+  %a6 = call i64 @read()
+  %a7 = call i64 @read()
+  %a8 = call i64 @read()
+  %a9 = call i64 @read()
+  %a10 = call i64 @read()
+  %a11 = call i64 @read()
+  %b0 = call i64 @read()
+  %b1 = call i64 @read()
+  %b2 = call i64 @read()
+  %b3 = call i64 @read()
+  %b4 = call i64 @read()
+  br label %loop
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i64 [ 0, %entry ], [ %acc.next, %loop ]
+  %m0 = mul i64 %a0, %i
+  %s0 = add i64 %acc, %m0
+  %m1 = mul i64 %a1, %i
+  %s1 = add i64 %s0, %m1
+  %m2 = mul i64 %a2, %i
+  %s2 = add i64 %s1, %m2
+  %m3 = mul i64 %a3, %i
+  %s3 = add i64 %s2, %m3
+  %m4 = mul i64 %a4, %i
+  %s4 = add i64 %s3, %m4
+  %m5 = mul i64 %a5, %i
+  %s5 = add i64 %s4, %m5
+  %m6 = mul i64 %a6, %i
+  %s6 = add i64 %s5, %m6
+  %m7 = mul i64 %a7, %i
+  %s7 = add i64 %s6, %m7
+  %m8 = mul i64 %a8, %i
+  %s8 = add i64 %s7, %m8
+  %m9 = mul i64 %a9, %i
+  %s9 = add i64 %s8, %m9
+  %m10 = mul i64 %a10, %i
+  %s10 = add i64 %s9, %m10
+  %m11 = mul i64 %a11, %i
+  %s11 = add i64 %s10, %m11
+  %acc.next = xor i64 %s11, %i
+  %i.next = add nsw i64 %i, 1
+  %cmp = icmp slt i64 %i.next, %n
+  br i1 %cmp, label %loop, label %exit
+exit:
+  call void @write(i64 %acc.next)
+  call void @write(i64 %b0)
+  call void @write(i64 %b1)
+  call void @write(i64 %b2)
+  call void @write(i64 %b3)
+  call void @write(i64 %b4)
+  ret i64 0
+}
@@ -0,0 +1,21 @@
+define i32 @main(i32 %x) {
+; CHECK: start main 1:
+; CHECK-NOT: br
+; CHECK: mul {{r[0-9]+}} 16843009 32
+; CHECK-NOT: br
+; CHECK: ret
+entry:
+  br label %while.cond
+while.cond:
+  %n = phi i32 [ %x, %entry ], [ %and, %while.body ]
+  %count = phi i32 [ 0, %entry ], [ %inc, %while.body ]
+  %tobool = icmp ne i32 %n, 0
+  br i1 %tobool, label %while.body, label %while.end
+while.body:
+  %sub = sub i32 %n, 1
+  %and = and i32 %n, %sub
+  %inc = add i32 %count, 1
+  br label %while.cond
+while.end:
+  ret i32 %count
+}
@@ -0,0 +1,27 @@
+; A user of two counters that both end as the popcount folds to it once,
+; and is not visited again after it is gone.
+define i32 @main(i32 %x) {
+; CHECK: start main 1:
+; CHECK-NOT: br
+; CHECK: mul {{r[0-9]+}} 16843009 32
+; CHECK-NEXT: [[R:r[0-9]+]] = udiv {{r[0-9]+}} 16777216 32
+; CHECK-NEXT: ret [[R]]
+entry:
+  br label %while.cond
+while.cond:
+  %n = phi i32 [ %x, %entry ], [ %and, %while.body ]
+  %c1 = phi i32 [ 0, %entry ], [ %inc1, %while.body ]
+  %c2 = phi i32 [ 0, %entry ], [ %inc2, %while.body ]
+  %tobool = icmp ne i32 %n, 0
+  br i1 %tobool, label %while.body, label %while.end
+while.body:
+  %sub = sub i32 %n, 1
+  %and = and i32 %n, %sub
+  %inc1 = add i32 %c1, 1
+  %inc2 = add i32 %c2, 1
+  br label %while.cond
+while.end:
+  %d = sub i32 %c1, %c2
+  %res = add i32 %d, %c1
+  ret i32 %res
+}
@@ -0,0 +1,19 @@
+define i32 @main(i32* %a, i32 %n) {
+; CHECK: start main 2:
+; CHECK-NOT: ashr
+; CHECK: end main
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [0, %entry], [%i_new, %loop]
+  %idx = sext i32 %i to i64
+  %p = getelementptr inbounds i32, i32* %a, i64 %idx
+  store i32 %i, i32* %p
+  %i_new = add nsw i32 %i, 1
+  %cond = icmp slt i32 %i_new, %n
+  br i1 %cond, label %loop, label %exit
+
+exit:
+  ret i32 0
+}
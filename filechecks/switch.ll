@@ -0,0 +1,29 @@
+define i64 @main(i64 %x) {
+; CHECK: start main 1:
+; CHECK: switch arg1 1 .a 2 .b 0 .a 3 .a 4 .a 5 .a .c
+; CHECK-NOT: icmp
+; CHECK: end main
+entry:
+  %c1 = icmp eq i64 %x, 1
+  br i1 %c1, label %a, label %next1
+
+next1:
+  %c2 = icmp eq i64 %x, 2
+  br i1 %c2, label %b, label %next2
+
+next2:
+  %c3 = icmp ult i64 %x, 6
+  br i1 %c3, label %a, label %c
+
+a:
+  %r = call i64 @read()
+  ret i64 %r
+
+b:
+  ret i64 2
+
+c:
+  ret i64 3
+}
+
+declare i64 @read()
@@ -0,0 +1,32 @@
+declare i64 @read()
+declare void @write(i64)
+
+; The recursive call feeds an add, which becomes an accumulator of the
+; loop that replaces the recursion. The loop is then inlined into main.
+define i64 @count(i64 %n) {
+entry:
+  %cmp = icmp eq i64 %n, 0
+  br i1 %cmp, label %return, label %if.end
+if.end:
+  %bit = and i64 %n, 1
+  %shr = lshr i64 %n, 1
+  %rest = call i64 @count(i64 %shr)
+  %sum = add i64 %bit, %rest
+  br label %return
+return:
+  %res = phi i64 [ 0, %entry ], [ %sum, %if.end ]
+  ret i64 %res
+}
+
+define i64 @main() {
+; CHECK: start main 0:
+; CHECK-NOT: call count
+; CHECK: end main
+entry:
+  %n = call i64 @read()
+  %c = call i64 @count(i64 %n)
+  call void @write(i64 %c)
+  %c2 = call i64 @count(i64 %c)
+  call void @write(i64 %c2)
+  ret i64 0
+}
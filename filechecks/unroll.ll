@@ -0,0 +1,20 @@
+define i64 @main(i64* %p) {
+; CHECK: start main 1:
+; CHECK-NOT: br
+; CHECK: ret
+entry:
+  br label %for.cond
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc, %for.body ]
+  %sum = phi i64 [ 0, %entry ], [ %add, %for.body ]
+  %cmp = icmp slt i64 %i, 4
+  br i1 %cmp, label %for.body, label %for.end
+for.body:
+  %arrayidx = getelementptr inbounds i64, i64* %p, i64 %i
+  %v = load i64, i64* %arrayidx
+  %add = add i64 %sum, %v
+  %inc = add i64 %i, 1
+  br label %for.cond
+for.end:
+  ret i64 %sum
+}
@@ -0,0 +1,32 @@
+#ifndef COMPILATION_CACHE_H
+#define COMPILATION_CACHE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include <string>
+
+// Assembly emitted before, in files named after a hash of what it was
+// emitted from, of the compiler that emitted it and of the options it
+// was run with. Whole modules and single functions are kept alike, under
+// keys of a different kind. The cache only speeds things up: files that
+// cannot be read or written are treated as missing.
+class CompilationCache {
+  std::string Dir;
+  std::string BuildID;
+  std::string Options;
+public:
+  CompilationCache(std::string Dir, std::string BuildID,
+                   std::string Options) :
+      Dir(Dir), BuildID(BuildID), Options(Options) {}
+  // A hash of the build, the options, Kind and each of Parts.
+  std::string getKey(llvm::StringRef Kind,
+                     llvm::ArrayRef<llvm::StringRef> Parts) const;
+  bool lookup(llvm::StringRef Key, std::string &Text) const;
+  void store(llvm::StringRef Key, llvm::StringRef Text) const;
+};
+
+// Tells builds of the compiler apart by the path, size and modification
+// time of the running executable. Symbol is any address inside it.
+std::string getBuildID(const char *Argv0, void *Symbol);
+
+#endif
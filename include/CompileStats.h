@@ -0,0 +1,63 @@
+#ifndef COMPILE_STATS_H
+#define COMPILE_STATS_H
+
+#include "llvm/ADT/Any.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/PassInstrumentation.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Wall time and growth of the peak resident set of every LLVM pass and
+// backend phase, with the function it ran on, or the module for module
+// passes. Pass managers and adaptors are left out, so no pass is counted
+// twice.
+class CompileStats {
+public:
+  struct Record {
+    // "pass" or "backend"
+    std::string Kind;
+    std::string Phase;
+    std::string Unit;
+    double Seconds;
+    long PeakRSSDeltaKB;
+  };
+
+  // Records what happens from its construction to its destruction. Does
+  // nothing if Stats is null, which is how the backend runs without
+  // -time-report or -stats-json.
+  class Timer {
+    CompileStats *Stats;
+    Record R;
+    std::chrono::steady_clock::time_point Start;
+    long StartRSS;
+  public:
+    Timer(CompileStats *Stats, llvm::StringRef Kind, llvm::StringRef Phase,
+          llvm::StringRef Unit);
+    ~Timer();
+  };
+
+  void registerCallbacks(llvm::PassInstrumentationCallbacks &PIC);
+  const std::vector<Record> &getRecords() const { return Records; }
+  void clear();
+
+private:
+  std::vector<Record> Records;
+  // The passes started and not finished yet, innermost last.
+  std::vector<std::unique_ptr<Timer>> Running;
+  void beforePass(llvm::StringRef PassID, llvm::Any IR);
+  void afterPass(llvm::StringRef PassID);
+};
+
+// What each module recorded, by its input file.
+using ModuleStats = std::vector<std::pair<std::string,
+                                          std::vector<CompileStats::Record>>>;
+
+// The time of each pass and phase over all modules, slowest first.
+void printTimeReport(llvm::raw_ostream &OS, const ModuleStats &Stats);
+llvm::json::Value toJSON(const ModuleStats &Stats);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef FunctionOutlining_H
+#define FunctionOutlining_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+class FunctionOutlining : public PassInfoMixin<FunctionOutlining> {
+ public:
+  llvm::PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef FunctionSpecialization_H
+#define FunctionSpecialization_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+class FunctionSpecialization : public PassInfoMixin<FunctionSpecialization> {
+ public:
+  llvm::PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef GlobalPromotion_H
+#define GlobalPromotion_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+class GlobalPromotion : public PassInfoMixin<GlobalPromotion> {
+ public:
+  llvm::PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+#endif
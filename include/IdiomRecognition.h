@@ -0,0 +1,14 @@
+#ifndef IdiomRecognition_H
+#define IdiomRecognition_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+class IdiomRecognition : public PassInfoMixin<IdiomRecognition> {
+ public:
+  llvm::PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+#endif
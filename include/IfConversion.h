@@ -0,0 +1,14 @@
+#ifndef IfConversion_H
+#define IfConversion_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+class IfConversion : public PassInfoMixin<IfConversion> {
+ public:
+  llvm::PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+#endif
@@ -1,12 +1,19 @@
 #ifndef LESS_SIMPLE_BACKEND_H
 #define LESS_SIMPLE_BACKEND_H
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
+#include "CompilationCache.h"
+#include "CompileStats.h"
 #include <string>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 
 #define REG_SIZE 15
@@ -18,10 +25,48 @@
 #define POS_HEAP -1
 #define POS_UNINIT -2
 
+// Where the backend left each value for the emitter: in one of the
+// registers, or folded into its users, like the casts that cost nothing,
+// GEPs with constant offsets and the addresses of stack slots. Arguments
+// stay in their argN registers.
+class RegAssignment {
+  llvm::DenseMap<const llvm::Value*, unsigned> regs;
+  llvm::DenseSet<const llvm::Value*> folded;
+public:
+  void setReg(const llvm::Value *V, unsigned reg);
+  // The register of V, 0 if it has none.
+  unsigned getReg(const llvm::Value *V) const;
+  void setFolded(const llvm::Value *V);
+  bool isFolded(const llvm::Value *V) const;
+  // Gives New what Old had, when New takes the place of Old.
+  void replace(const llvm::Value *Old, const llvm::Value *New);
+  void erase(const llvm::Value *V);
+  void clear();
+  // Moves what is known of the instructions of F to an assignment of its
+  // own, so F can be allocated apart from the other functions.
+  RegAssignment split(const llvm::Function &F);
+  // Takes over what Other knows; Other is left empty.
+  void merge(RegAssignment &Other);
+};
+
+// The SCC of each block reachable from the entry, numbered in the order
+// scc_iterator visits them.
+using SCCIndex = llvm::DenseMap<const llvm::BasicBlock*, unsigned>;
+
 class LessSimpleBackend : public llvm::PassInfoMixin<LessSimpleBackend> {
   std::string outputFile;
-  std::string tempPrefix;
+  unsigned jobs;
+  const CompilationCache *cache;
+  CompileStats *stats;
+  bool *failed;
+  RegAssignment assignment;
+  SCCIndex sccIndex;
   bool printDepromotedModule;
+  bool printSpillStats;
+  // What depromotion of the current function added, for its spill stats.
+  llvm::DenseSet<llvm::Instruction*> spillStores;
+  llvm::DenseSet<llvm::Instruction*> reloads;
+  llvm::DenseSet<llvm::Instruction*> phiCopies;
   std::map<llvm::Instruction*, llvm::Value*> stackMap;
   llvm::Function *spOffset;
   llvm::Function *spSub;
@@ -37,7 +82,15 @@ class LessSimpleBackend : public llvm::PassInfoMixin<LessSimpleBackend> {
   class StackFrame;
   Registers *regs;
   StackFrame *frame;
-  void depromoteReg(llvm::Function &F);
+  // Held while regAlloc creates instructions that use the constants and
+  // functions all functions share. Their use lists are not guarded.
+  std::mutex *contextLock = nullptr;
+  // The backend of F alone: the helpers and globals of Module, and what
+  // Module's assignment knows of F, which it no longer does.
+  LessSimpleBackend(LessSimpleBackend &Module, llvm::Function &F,
+                    std::mutex *contextLock);
+  void depromoteBeforeRegAlloc(llvm::Function &F);
+  void depromoteAfterRegAlloc(llvm::Function &F);
   int getAccessPos(llvm::Value *V);
   llvm::Function* getSpOffsetFn();
   void removeInst(llvm::Instruction *I);
@@ -55,8 +108,13 @@ class LessSimpleBackend : public llvm::PassInfoMixin<LessSimpleBackend> {
     bool dumpFlag);
   void depAlloca(llvm::AllocaInst *AI);
   void depAlloca(llvm::Function &F);
-  void depCast(llvm::CastInst *BCI);
-  void depCast(llvm::Function &F);
+  void depCast(llvm::CastInst *CI, llvm::ScalarEvolution &SE);
+  void depCast(llvm::Function &F, llvm::ScalarEvolution &SE);
+  void foldConstBrCond(llvm::Function &F);
+  void depBrCond(llvm::BranchInst *BI, llvm::ScalarEvolution &SE);
+  void depBrCond(llvm::Function &F, llvm::ScalarEvolution &SE);
+  void splitExitEdges(llvm::Function &F, llvm::DominatorTree &DT,
+                      llvm::LoopInfo &LI);
   std::set<llvm::Instruction*> depPhi(llvm::Function &F);
   void phiUpdatePatch(std::set<llvm::Instruction*> &newPhiSet);
   void depGEP(llvm::GetElementPtrInst *GEPI);
@@ -66,21 +124,38 @@ class LessSimpleBackend : public llvm::PassInfoMixin<LessSimpleBackend> {
   int insertRst(llvm::BasicBlock &BB);
   void insertRst_first(
     llvm::BasicBlock &BB,
-    std::map<llvm::BasicBlock*, int> accessPosMap);
+    const std::map<llvm::BasicBlock*, int> &accessPosMap,
+    std::map<llvm::BasicBlock*, int> &prevAccessPosMap);
   void insertRst(llvm::Function &F);
-  void regAlloc(llvm::BasicBlock &BB, std::set<llvm::BasicBlock*> &BBvisited);
+  void regAlloc(llvm::BasicBlock &BB);
   void regAlloc(llvm::Function &F);
-  void placeSpSub(llvm::Function &F);
+  int placeSpSub(llvm::Function &F);
+  std::string getSpillReport(llvm::Function &F, int frameSize);
   void buildGVMap();
   void moveGVToStack();
+  std::vector<std::string> prepareModule(llvm::Module &M);
+  std::string getFunctionKey(llvm::Function &F,
+                             llvm::ArrayRef<std::string> dummyFunctionName);
 public:
-  LessSimpleBackend(std::string outputFile, bool printDepromotedModule) :
-      outputFile(outputFile), printDepromotedModule(printDepromotedModule) {}
+  // printSpillStats prints to stderr what depromotion added to each
+  // function and loop. jobs is how many threads allocate the registers of
+  // the functions and emit their assembly. With a cache, functions emitted
+  // before are not compiled again. With stats, each phase is timed for
+  // every function. If the module is broken or the output cannot be
+  // written, the error goes to stderr and failed is set.
+  LessSimpleBackend(std::string outputFile, bool printDepromotedModule,
+                    bool printSpillStats = false, unsigned jobs = 1,
+                    const CompilationCache *cache = nullptr,
+                    CompileStats *stats = nullptr, bool *failed = nullptr) :
+      outputFile(outputFile), jobs(jobs), cache(cache), stats(stats),
+      failed(failed), printDepromotedModule(printDepromotedModule),
+      printSpillStats(printSpillStats) {}
   llvm::PreservedAnalyses run(llvm::Module &M, llvm::ModuleAnalysisManager &MAM);
   llvm::Function *getSpOffset();
   llvm::Function *getRstH();
   llvm::Function *getRstS();
-  std::string getTempPrefix();
+  const RegAssignment &getAssignment();
+  const SCCIndex &getSCCIndex();
 };
 
 unsigned getAccessSize(llvm::Type *T);
@@ -88,12 +163,24 @@ unsigned getAccessSize(llvm::Type *T);
 class NewAssemblyEmitter {
   llvm::raw_ostream *fout;
   std::vector<std::string> dummyFunctionName{};
+  const RegAssignment &assignment;
+  unsigned jobs;
 public:
-  NewAssemblyEmitter(llvm::raw_ostream *fout, std::vector<std::string> dummyFunctionName):
+  // With more than one job, functions are emitted on that many threads and
+  // written out in module order once all are done.
+  NewAssemblyEmitter(llvm::raw_ostream *fout,
+                     std::vector<std::string> dummyFunctionName,
+                     const RegAssignment &assignment, unsigned jobs = 1):
     fout(fout),
-    dummyFunctionName(dummyFunctionName)
+    dummyFunctionName(dummyFunctionName),
+    assignment(assignment),
+    jobs(jobs)
     {}
   void run(llvm::Module *M);
+  // The assembly of F alone, as run writes it.
+  std::string emit(llvm::Function &F);
+  // The assembly of each of Functions, emitted on jobs threads.
+  std::vector<std::string> emit(llvm::ArrayRef<llvm::Function*> Functions);
 };
 
 #endif
@@ -0,0 +1,14 @@
+#ifndef LoopFusion_H
+#define LoopFusion_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+class LoopFusion : public PassInfoMixin<LoopFusion> {
+ public:
+  llvm::PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+#endif
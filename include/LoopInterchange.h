@@ -0,0 +1,14 @@
+#ifndef LoopInterchange_H
+#define LoopInterchange_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+class LoopInterchange : public PassInfoMixin<LoopInterchange> {
+ public:
+  llvm::PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef LOOP_NEST_H
+#define LOOP_NEST_H
+
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/Instructions.h"
+#include "SWPPCost.h"
+#include <map>
+#include <vector>
+
+// for (IV = Start; IV Pred Bound; IV += Step) as clang emits it, before
+// rotation: the header ends with the compare of the counter and the
+// branch.
+struct CountedLoop {
+  llvm::Loop *L;
+  llvm::PHINode *IV;
+  llvm::BinaryOperator *Inc;
+  llvm::ICmpInst *Cmp;
+  llvm::Value *Start, *Bound;
+  llvm::ConstantInt *Step;
+};
+
+// Whether L is a counted loop whose range does not change while Outermost
+// runs. With OnlyCounter, the header may not carry any other value and
+// nothing but the counter may use the increment.
+bool getCountedLoop(llvm::Loop *L, llvm::Loop *Outermost, CountedLoop &CL,
+                    bool OnlyCounter = true);
+
+// The loops of a perfect, rectangular nest, outermost first: all blocks
+// but the ones of the innermost loop only branch and count, and no range
+// depends on another counter. Empty if Outermost does not start one.
+std::vector<CountedLoop> getPerfectNest(llvm::Loop *Outermost);
+
+double getTripCount(const CountedLoop &CL);
+
+// A coefficient C, or C * Sym with Sym invariant in the nest.
+struct Coef {
+  llvm::Value *Sym = nullptr;
+  int64_t C = 0;
+};
+// The bytes an address moves by per unit of each counter.
+using LinearForm = std::map<llvm::PHINode*, Coef>;
+
+struct NestAccess {
+  llvm::Instruction *I;
+  LinearForm LF;
+};
+
+// The loads and stores of the nest with their addresses. Fails if the body
+// does anything else with memory, uses an address that is not linear in
+// the counters or computes a value used after the nest.
+bool getNestAccesses(llvm::ArrayRef<CountedLoop> Levels,
+                     const llvm::DataLayout &DL,
+                     std::vector<NestAccess> &Accesses);
+
+// Marks the levels whose relative order has to stay as it is. Iterations
+// that store to the same address agree on the counters the address
+// depends on and run in the order of the others. Fails if the stores are
+// not simple enough to tell.
+bool getFixedLevels(llvm::ArrayRef<CountedLoop> Levels,
+                    llvm::ArrayRef<NestAccess> Accesses, llvm::AAResults &AA,
+                    llvm::ScalarEvolution &SE, std::vector<bool> &Fixed);
+
+#endif
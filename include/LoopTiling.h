@@ -0,0 +1,14 @@
+#ifndef LoopTiling_H
+#define LoopTiling_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+class LoopTiling : public PassInfoMixin<LoopTiling> {
+ public:
+  llvm::PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+#endif
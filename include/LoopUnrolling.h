@@ -0,0 +1,23 @@
+#ifndef LoopUnrolling_H
+#define LoopUnrolling_H
+
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+// Registers runtime unrolling keeps alive across the loop (trip count and
+// the new counter).
+#define RUNTIME_EXTRA_REGS 2
+
+// The count partial and runtime unrolling start from for the innermost
+// loop L, going by its size alone; below 2 if L is too large to unroll.
+unsigned getPartialUnrollCount(Loop *L);
+
+class LoopUnrolling : public PassInfoMixin<LoopUnrolling> {
+ public:
+  llvm::PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef RegPressureLICM_H
+#define RegPressureLICM_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+using namespace llvm;
+
+class RegPressureLICM : public PassInfoMixin<RegPressureLICM> {
+ public:
+  llvm::PreservedAnalyses run(Loop &L, LoopAnalysisManager &LAM,
+                              LoopStandardAnalysisResults &AR,
+                              LPMUpdater &U);
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef SWPP_COST_H
+#define SWPP_COST_H
+
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instruction.h"
+#include "LessSimpleBackend.h"
+#include <map>
+#include <set>
+
+// Costs of the SWPP machine, as charged by sf-interpreter.
+#define COST_MUL 0.6
+#define COST_LOGIC 0.8
+#define COST_ADD 1.2
+#define COST_ICMP 1.0
+#define COST_SELECT 1.2
+#define COST_BR 1.0
+#define COST_SWITCH 1.0
+#define COST_RET 1.0
+#define COST_CALL 2.0
+#define COST_CALL_ARG 1.0
+#define COST_MEM 2.0
+#define COST_RESET 2.0
+// A spilled value is stored once and loaded back at least once.
+#define SPILL_COST (COST_MEM * 2)
+// Moving the head by one byte; a reset is worth 5000 bytes of travel.
+#define COST_TRAVEL (COST_RESET / 5000)
+// Iterations a loop with an unknown trip count is assumed to run.
+#define EXPECTED_TRIPS 16
+
+// Static cost of I after it is lowered by LessSimpleBackend, without the
+// travel cost of memory accesses.
+double getSWPPCost(const llvm::Instruction *I);
+double getSWPPCost(const llvm::BasicBlock *BB);
+
+// Spills of a block where pressure values are live at once.
+double getSpillCost(unsigned pressure);
+
+// Whether V ends up in a register of its own. Arguments live in argN,
+// allocas are sp offsets and pointer/truncating casts reuse the register
+// of their source.
+bool needsOwnRegister(const llvm::Value *V);
+
+// The value whose register V is in: V itself, or the source of the free
+// casts it goes through.
+const llvm::Value *getRegSource(const llvm::Value *V);
+
+// Whether the emitter can use V as an operand of select. Stack offsets and
+// global addresses are only resolved at emission time.
+bool canBeSelected(const llvm::Value *V);
+
+// A liveness based estimate of how many of the REG_SIZE registers
+// LessSimpleBackend needs; anything above REG_SIZE becomes spills.
+class RegPressure {
+  std::map<const llvm::BasicBlock*, std::set<const llvm::Value*>> liveIn;
+  std::map<const llvm::BasicBlock*, std::set<const llvm::Value*>> liveOut;
+public:
+  RegPressure(llvm::Function &F);
+  unsigned getLiveInCount(const llvm::BasicBlock *BB);
+  unsigned getLiveOutCount(const llvm::BasicBlock *BB);
+  unsigned getMaxPressure(const llvm::BasicBlock *BB);
+  // Counting only the values defined in the blocks of Region, which is what
+  // is left of BB's pressure once Region is a function of its own.
+  unsigned getMaxPressure(const llvm::BasicBlock *BB,
+                          const std::set<const llvm::BasicBlock*> &Region);
+  unsigned getMaxPressure();
+  // Values that stay in registers while I runs, such as the ones a call
+  // has to leave alone.
+  unsigned getLiveAcross(const llvm::Instruction *I);
+  bool isLiveOut(const llvm::Value *V, const llvm::BasicBlock *BB);
+};
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef SWPPInlineAdvisor_H
+#define SWPPInlineAdvisor_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+class SWPPInlineAdvisor : public PassInfoMixin<SWPPInlineAdvisor> {
+ public:
+  llvm::PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef SwitchOptimization_H
+#define SwitchOptimization_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+class SwitchOptimization : public PassInfoMixin<SwitchOptimization> {
+ public:
+  llvm::PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+#endif
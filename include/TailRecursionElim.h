@@ -0,0 +1,14 @@
+#ifndef TailRecursionElim_H
+#define TailRecursionElim_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace llvm;
+
+class TailRecursionElim : public PassInfoMixin<TailRecursionElim> {
+ public:
+  llvm::PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+#endif
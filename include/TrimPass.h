@@ -4,8 +4,15 @@
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/raw_ostream.h"
+#include <set>
 using namespace llvm;
 
+// The functions Main calls, directly or not, Main included. BeforeScan
+// sees each of them before its calls are followed, in time to read its
+// body if that has not been read yet.
+std::set<Function *> getReachableFunctions(
+    Function &Main, function_ref<void(Function &)> BeforeScan);
+
 class TrimPass : public PassInfoMixin<TrimPass> {
  public:
   llvm::PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
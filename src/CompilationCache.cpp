@@ -0,0 +1,73 @@
+#include "CompilationCache.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+using namespace std;
+
+string CompilationCache::getKey(StringRef Kind,
+                                ArrayRef<StringRef> Parts) const {
+  MD5 Hash;
+  // Each part goes in with its length, so no two lists of parts run
+  // together into the same bytes.
+  auto add = [&](StringRef Part) {
+    Hash.update(to_string(Part.size()) + ":");
+    Hash.update(Part);
+  };
+  add(BuildID);
+  add(Options);
+  add(Kind);
+  for (StringRef Part : Parts)
+    add(Part);
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  return Result.digest().str().str();
+}
+
+bool CompilationCache::lookup(StringRef Key, string &Text) const {
+  SmallString<128> Path(Dir);
+  sys::path::append(Path, Key + ".s");
+  auto MB = MemoryBuffer::getFile(Path);
+  if (!MB)
+    return false;
+  Text = (*MB)->getBuffer().str();
+  return true;
+}
+
+// Written to a file of its own first and then renamed, so a compiler
+// running at the same time never reads half of it.
+void CompilationCache::store(StringRef Key, StringRef Text) const {
+  if (sys::fs::create_directories(Dir))
+    return;
+  SmallString<128> TempPath(Dir);
+  sys::path::append(TempPath, Key + "-%%%%%%%%.tmp");
+  int FD;
+  if (sys::fs::createUniqueFile(TempPath, FD, TempPath))
+    return;
+  {
+    raw_fd_ostream OS(FD, true);
+    OS << Text;
+    OS.close();
+    if (OS.has_error()) {
+      OS.clear_error();
+      sys::fs::remove(TempPath);
+      return;
+    }
+  }
+  SmallString<128> Path(Dir);
+  sys::path::append(Path, Key + ".s");
+  if (sys::fs::rename(TempPath, Path))
+    sys::fs::remove(TempPath);
+}
+
+string getBuildID(const char *Argv0, void *Symbol) {
+  string Path = sys::fs::getMainExecutable(Argv0, Symbol);
+  sys::fs::file_status Status;
+  if (sys::fs::status(Path, Status))
+    return Path;
+  return Path + ":" + to_string(Status.getSize()) + ":" +
+         to_string(Status.getLastModificationTime().time_since_epoch().count());
+}
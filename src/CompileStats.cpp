@@ -0,0 +1,143 @@
+#include "CompileStats.h"
+#include "llvm/Analysis/CGSCCPassManager.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Format.h"
+#include <map>
+#include <sys/resource.h>
+
+using namespace llvm;
+using namespace std;
+
+// The peak resident set of the process so far, in KB.
+static long getPeakRSS() {
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage))
+    return 0;
+#ifdef __APPLE__
+  return Usage.ru_maxrss / 1024;
+#else
+  return Usage.ru_maxrss;
+#endif
+}
+
+CompileStats::Timer::Timer(CompileStats *Stats, StringRef Kind,
+                           StringRef Phase, StringRef Unit) :
+    Stats(Stats) {
+  if (!Stats)
+    return;
+  R = {Kind.str(), Phase.str(), Unit.str(), 0, 0};
+  StartRSS = getPeakRSS();
+  Start = chrono::steady_clock::now();
+}
+
+CompileStats::Timer::~Timer() {
+  if (!Stats)
+    return;
+  chrono::duration<double> Elapsed = chrono::steady_clock::now() - Start;
+  R.Seconds = Elapsed.count();
+  R.PeakRSSDeltaKB = getPeakRSS() - StartRSS;
+  Stats->Records.push_back(move(R));
+}
+
+static bool isPassManager(StringRef PassID) {
+  return PassID.contains("PassManager") || PassID.contains("PassAdaptor");
+}
+
+// The function IR is, or the module for module passes and the functions
+// of the SCC for CGSCC passes.
+static string getUnitName(Any IR) {
+  if (any_isa<const Function *>(IR))
+    return any_cast<const Function *>(IR)->getName().str();
+  if (any_isa<const Loop *>(IR))
+    return any_cast<const Loop *>(IR)->getHeader()->getParent()->getName().str();
+  if (any_isa<const LazyCallGraph::SCC *>(IR))
+    return any_cast<const LazyCallGraph::SCC *>(IR)->getName();
+  if (any_isa<const Module *>(IR))
+    return any_cast<const Module *>(IR)->getName().str();
+  return "";
+}
+
+void CompileStats::beforePass(StringRef PassID, Any IR) {
+  if (isPassManager(PassID))
+    return;
+  Running.push_back(make_unique<Timer>(this, "pass", PassID, getUnitName(IR)));
+}
+
+// The IR may be gone by now, which is why the unit is named before.
+void CompileStats::afterPass(StringRef PassID) {
+  if (isPassManager(PassID) || Running.empty())
+    return;
+  Running.pop_back();
+}
+
+void CompileStats::registerCallbacks(PassInstrumentationCallbacks &PIC) {
+  PIC.registerBeforePassCallback([this](StringRef PassID, Any IR) {
+    beforePass(PassID, IR);
+    return true;
+  });
+  PIC.registerAfterPassCallback(
+      [this](StringRef PassID, Any IR) { afterPass(PassID); });
+  PIC.registerAfterPassInvalidatedCallback(
+      [this](StringRef PassID) { afterPass(PassID); });
+}
+
+void CompileStats::clear() {
+  Records.clear();
+  Running.clear();
+}
+
+void printTimeReport(raw_ostream &OS, const ModuleStats &Stats) {
+  for (StringRef Kind : {"pass", "backend"}) {
+    // seconds, runs and the largest growth of the peak RSS of each phase
+    map<string, tuple<double, unsigned, long>> Totals;
+    double Total = 0;
+    for (auto &[Input, Records] : Stats)
+      for (const CompileStats::Record &R : Records) {
+        if (R.Kind != Kind)
+          continue;
+        auto &[Seconds, Runs, PeakRSSDelta] = Totals[R.Phase];
+        Seconds += R.Seconds;
+        Runs++;
+        PeakRSSDelta = max(PeakRSSDelta, R.PeakRSSDeltaKB);
+        Total += R.Seconds;
+      }
+    vector<pair<string, tuple<double, unsigned, long>>> Sorted(Totals.begin(),
+                                                               Totals.end());
+    stable_sort(Sorted.begin(), Sorted.end(), [](auto &A, auto &B) {
+      return get<0>(A.second) > get<0>(B.second);
+    });
+
+    OS << "===" << string(70, '-') << "===\n";
+    OS << (Kind == "pass" ? "  LLVM pass" : "  Backend phase")
+       << " times, total " << format("%.4f", Total) << " s\n";
+    OS << "===" << string(70, '-') << "===\n";
+    OS << "   Wall Time         Runs  Peak RSS +KB  Name\n";
+    for (auto &[Phase, Totals] : Sorted) {
+      auto [Seconds, Runs, PeakRSSDelta] = Totals;
+      OS << format("%9.4f (%5.1f%%) %6u %13ld  ", Seconds,
+                   Total > 0 ? Seconds / Total * 100 : 0.0, Runs,
+                   PeakRSSDelta)
+         << Phase << "\n";
+    }
+    OS << "\n";
+  }
+}
+
+json::Value toJSON(const ModuleStats &Stats) {
+  json::Array Modules;
+  for (auto &[Input, Records] : Stats) {
+    json::Array Phases;
+    for (const CompileStats::Record &R : Records)
+      Phases.push_back(json::Object{{"kind", R.Kind},
+                                    {"phase", R.Phase},
+                                    {"unit", R.Unit},
+                                    {"seconds", R.Seconds},
+                                    {"peak_rss_delta_kb",
+                                     (int64_t)R.PeakRSSDeltaKB}});
+    Modules.push_back(
+        json::Object{{"input", Input}, {"phases", move(Phases)}});
+  }
+  return json::Object{{"modules", move(Modules)}};
+}
@@ -0,0 +1,128 @@
+#include "FunctionOutlining.h"
+#include "SWPPCost.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include <cmath>
+
+using namespace llvm;
+using namespace std;
+
+// Arguments a function can take on SWPP.
+#define MAX_ARGS 16
+// Entering the outlined function: call and ret, moving sp down and back up.
+#define OUTLINE_CALL_COST (COST_CALL + COST_RET + COST_ADD * 2)
+// Loops taken out of one function.
+#define MAX_OUTLINED 4
+
+// Function names in SWPP assembly cannot have the dots LLVM would add.
+static string getOutlinedName(Function &F) {
+  Module &M = *F.getParent();
+  for (unsigned Idx = 0;; ++Idx) {
+    string Name = F.getName().str() + "_outlined" + to_string(Idx);
+    if (!M.getFunction(Name))
+      return Name;
+  }
+}
+
+// What outlining L saves: the spills of its blocks that go away once only
+// the values it computes itself take registers, minus the call and the
+// outputs it hands back through memory, each time L is entered.
+static double getOutliningGain(Loop *L, LoopInfo &LI, RegPressure &RP,
+                               unsigned ins, unsigned outs) {
+  set<const BasicBlock*> Region(L->block_begin(), L->block_end());
+  double gain = 0;
+  for (BasicBlock *BB : L->blocks()) {
+    double freq = pow(EXPECTED_TRIPS, LI.getLoopDepth(BB));
+    gain += freq * (getSpillCost(RP.getMaxPressure(BB)) -
+                    getSpillCost(RP.getMaxPressure(BB, Region)));
+  }
+  double entryFreq = pow(EXPECTED_TRIPS, L->getLoopDepth() - 1);
+  return gain - entryFreq * (OUTLINE_CALL_COST +
+                             (ins + outs) * COST_CALL_ARG +
+                             outs * SPILL_COST);
+}
+
+// Picks the loop of F whose outlining saves the most and extracts it.
+// Returns the new function, or null if no loop pays for its call.
+static Function *outlineBestLoop(Function &F, OptimizationRemarkEmitter &ORE) {
+  DominatorTree DT(F);
+  LoopInfo LI(DT);
+  RegPressure RP(F);
+  if (LI.empty() || RP.getMaxPressure() <= REG_SIZE)
+    return nullptr;
+
+  Loop *Best = nullptr;
+  double bestGain = 0;
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    // A single entry and a single way out, so the call simply replaces
+    // the loop.
+    if (!L->getLoopPreheader() || !L->getExitBlock())
+      continue;
+    CodeExtractor CE(DT, *L);
+    if (!CE.isEligible())
+      continue;
+    SetVector<Value*> Inputs, Outputs, Allocas;
+    CE.findInputsOutputs(Inputs, Outputs, Allocas);
+    if (Inputs.size() + Outputs.size() > MAX_ARGS)
+      continue;
+    double gain = getOutliningGain(L, LI, RP, Inputs.size(), Outputs.size());
+    if (gain <= bestGain) {
+      ORE.emit([&]() {
+        return OptimizationRemarkAnalysis("function-outlining",
+                                          "NotProfitable", L->getStartLoc(),
+                                          L->getHeader())
+               << L->getHeader()->getName() << ": outlining saves "
+               << ore::NV("Gain", (int)gain) << " with "
+               << ore::NV("Inputs", (unsigned)Inputs.size()) << " inputs and "
+               << ore::NV("Outputs", (unsigned)Outputs.size()) << " outputs";
+      });
+      continue;
+    }
+    Best = L;
+    bestGain = gain;
+  }
+  if (!Best)
+    return nullptr;
+
+  ORE.emit([&]() {
+    return OptimizationRemark("function-outlining", "Outlined",
+                              Best->getStartLoc(), Best->getHeader())
+           << Best->getHeader()->getName()
+           << ": outlined, estimated to save "
+           << ore::NV("Gain", (unsigned)bestGain);
+  });
+  CodeExtractorAnalysisCache CEAC(F);
+  Function *NewF = CodeExtractor(DT, *Best).extractCodeRegion(CEAC);
+  if (!NewF)
+    return nullptr;
+  NewF->setName(getOutlinedName(F));
+  return NewF;
+}
+
+// Moves loops that need more than the REG_SIZE registers into functions
+// of their own. A callee starts with all registers free and sees the
+// values of its caller only as arguments, so a loop that spills because
+// of values live across it, or computed before it, stops spilling at the
+// cost of one call each time it is entered.
+PreservedAnalyses FunctionOutlining::run(Module &M,
+                                         ModuleAnalysisManager &MAM) {
+  vector<Function*> Worklist;
+  for (Function &F : M)
+    if (!F.isDeclaration())
+      Worklist.push_back(&F);
+
+  bool changed = false;
+  for (Function *F : Worklist) {
+    OptimizationRemarkEmitter ORE(F);
+    for (unsigned Count = 0; Count < MAX_OUTLINED; ++Count) {
+      if (!outlineBestLoop(*F, ORE))
+        break;
+      changed = true;
+    }
+  }
+  if (!changed)
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
@@ -0,0 +1,193 @@
+#include "FunctionSpecialization.h"
+#include "SWPPCost.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include <cmath>
+
+using namespace llvm;
+using namespace std;
+
+// Copies made of one function.
+#define MAX_SPECIALIZATIONS 4
+// Largest function that is copied.
+#define MAX_SPECIALIZE_SIZE 512
+
+// The constant arguments of a call: which ones and their values.
+using ArgConstants = vector<pair<unsigned, ConstantInt*>>;
+
+static ArgConstants getArgConstants(CallBase *CB) {
+  ArgConstants Consts;
+  for (unsigned Idx = 0; Idx < CB->arg_size(); ++Idx)
+    if (auto *C = dyn_cast<ConstantInt>(CB->getArgOperand(Idx)))
+      Consts.push_back({Idx, C});
+  return Consts;
+}
+
+// Runs F once, with each block run as often as its loops suggest.
+static double getRunCost(Function &F) {
+  DominatorTree DT(F);
+  LoopInfo LI(DT);
+  double cost = 0;
+  for (BasicBlock &BB : F)
+    cost += pow(EXPECTED_TRIPS, LI.getLoopDepth(&BB)) * getSWPPCost(&BB);
+  return cost;
+}
+
+static unsigned getSize(Function &F) {
+  unsigned size = 0;
+  for (BasicBlock &BB : F)
+    size += BB.size();
+  return size;
+}
+
+// Folds what the constant arguments decide: instructions that simplify,
+// branches on known conditions and the blocks they no longer reach.
+static void simplifyClone(Function &F) {
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (BasicBlock &BB : F)
+      changed |= ConstantFoldTerminator(&BB, true);
+    changed |= removeUnreachableBlocks(F);
+    for (Instruction &I : make_early_inc_range(instructions(F))) {
+      Value *V = SimplifyInstruction(&I, SimplifyQuery(DL, &I));
+      if (V && V != &I) {
+        I.replaceAllUsesWith(V);
+        changed = true;
+      }
+      if (isInstructionTriviallyDead(&I)) {
+        I.eraseFromParent();
+        changed = true;
+      }
+    }
+  }
+}
+
+// Function names in SWPP assembly cannot have the dots LLVM would add.
+static string getSpecializedName(Function &F) {
+  Module &M = *F.getParent();
+  for (unsigned Idx = 0;; ++Idx) {
+    string Name = F.getName().str() + "_spec" + to_string(Idx);
+    if (!M.getFunction(Name))
+      return Name;
+  }
+}
+
+// Calls Clone instead of F, leaving out the arguments it has as constants.
+static void redirectCall(CallBase *CB, Function *Clone,
+                         const ArgConstants &Consts) {
+  vector<Value*> Args;
+  auto It = Consts.begin();
+  for (unsigned Idx = 0; Idx < CB->arg_size(); ++Idx) {
+    if (It != Consts.end() && It->first == Idx) {
+      ++It;
+      continue;
+    }
+    Args.push_back(CB->getArgOperand(Idx));
+  }
+  CallInst *NewCall = CallInst::Create(Clone, Args, "", CB);
+  NewCall->takeName(CB);
+  NewCall->setCallingConv(CB->getCallingConv());
+  CB->replaceAllUsesWith(NewCall);
+  CB->eraseFromParent();
+}
+
+// Clones functions for the constant arguments they are called with. The
+// constants are folded into the copy, which no longer takes them: each
+// call saves the arguments and whatever the constants decide inside, such
+// as the branches on them and the arithmetic they feed. Code size costs
+// nothing on SWPP, so a copy is kept whenever it runs cheaper; the calls
+// that would use a copy are ranked by how often they run.
+PreservedAnalyses FunctionSpecialization::run(Module &M,
+                                              ModuleAnalysisManager &MAM) {
+  // Calls with constant arguments, grouped by callee and constants, and
+  // how often each group runs.
+  map<pair<Function*, ArgConstants>, vector<CallBase*>> Groups;
+  map<pair<Function*, ArgConstants>, double> freqs;
+  for (Function &Caller : M) {
+    if (Caller.isDeclaration())
+      continue;
+    DominatorTree DT(Caller);
+    LoopInfo LI(DT);
+    for (Instruction &I : instructions(Caller)) {
+      auto *CB = dyn_cast<CallInst>(&I);
+      Function *Callee = CB ? CB->getCalledFunction() : nullptr;
+      if (!Callee || Callee->isDeclaration() || Callee->isVarArg() ||
+          Callee->getName() == "main" ||
+          Callee->getFunctionType() != CB->getFunctionType() ||
+          getSize(*Callee) > MAX_SPECIALIZE_SIZE)
+        continue;
+      ArgConstants Consts = getArgConstants(CB);
+      if (Consts.empty())
+        continue;
+      Groups[{Callee, Consts}].push_back(CB);
+      freqs[{Callee, Consts}] +=
+          pow(EXPECTED_TRIPS, LI.getLoopDepth(CB->getParent()));
+    }
+  }
+
+  vector<pair<Function*, ArgConstants>> Order;
+  for (auto &[Key, _] : Groups)
+    Order.push_back(Key);
+  stable_sort(Order.begin(), Order.end(), [&](auto &A, auto &B) {
+    return freqs[A] > freqs[B];
+  });
+
+  bool changed = false;
+  map<Function*, unsigned> specialized;
+  map<Function*, double> runCosts;
+  for (auto &Key : Order) {
+    auto &[F, Consts] = Key;
+    if (specialized[F] >= MAX_SPECIALIZATIONS)
+      continue;
+    if (!runCosts.count(F))
+      runCosts[F] = getRunCost(*F);
+
+    ValueToValueMapTy VMap;
+    for (auto &[Idx, C] : Consts)
+      VMap[F->getArg(Idx)] = C;
+    Function *Clone = CloneFunction(F, VMap);
+    simplifyClone(*Clone);
+    double saved = runCosts[F] - getRunCost(*Clone);
+    double gain = freqs[Key] * (saved + Consts.size() * COST_CALL_ARG);
+
+    OptimizationRemarkEmitter ORE(F);
+    if (saved <= 0) {
+      ORE.emit([&]() {
+        return OptimizationRemarkAnalysis("function-specialization",
+                                          "NotProfitable", F)
+               << F->getName() << ": constant arguments fold nothing";
+      });
+      Clone->eraseFromParent();
+      continue;
+    }
+    Clone->setName(getSpecializedName(*F));
+    Clone->setLinkage(GlobalValue::InternalLinkage);
+    ORE.emit([&]() {
+      return OptimizationRemark("function-specialization", "Specialized", F)
+             << F->getName() << ": specialized as " << Clone->getName()
+             << " for " << ore::NV("Calls", (unsigned)Groups[Key].size())
+             << " calls, estimated to save " << ore::NV("Gain", (int)gain);
+    });
+
+    // Recursive calls of the copy with the same constants stay in it.
+    vector<CallBase*> Calls = Groups[Key];
+    for (Instruction &I : instructions(Clone))
+      if (auto *CB = dyn_cast<CallInst>(&I))
+        if (CB->getCalledFunction() == F && getArgConstants(CB) == Consts)
+          Calls.push_back(CB);
+    for (CallBase *CB : Calls)
+      redirectCall(CB, Clone, Consts);
+    specialized[F]++;
+    changed = true;
+  }
+  if (!changed)
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
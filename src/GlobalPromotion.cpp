@@ -0,0 +1,265 @@
+#include "GlobalPromotion.h"
+#include "SWPPCost.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include <algorithm>
+#include <map>
+
+using namespace llvm;
+using namespace std;
+
+// Globals whose address never escapes: every use loads the global or
+// stores a value to it. Nothing but those loads and stores can touch them.
+static bool isPromotable(GlobalVariable &GV) {
+  Type *Ty = GV.getValueType();
+  if (!Ty->isIntegerTy() && !Ty->isPointerTy())
+    return false;
+  for (User *U : GV.users()) {
+    if (auto *LI = dyn_cast<LoadInst>(U)) {
+      if (!LI->isSimple() || LI->getType() != Ty)
+        return false;
+    } else if (auto *SI = dyn_cast<StoreInst>(U)) {
+      if (!SI->isSimple() || SI->getValueOperand() == &GV ||
+          SI->getValueOperand()->getType() != Ty)
+        return false;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Which promotable globals a call may read (Ref) or write (Mod), through
+// any chain of calls. Unknown is set for indirect calls, which may reach
+// anything. Declarations are taken to touch none of them: the only
+// external functions on SWPP are read, write, malloc and free.
+struct GlobalModRef {
+  set<GlobalVariable*> Mod, Ref;
+  bool Unknown = false;
+};
+
+static map<Function*, GlobalModRef> computeModRef(Module &M) {
+  map<Function*, GlobalModRef> info;
+  map<Function*, set<Function*>> callees;
+  for (Function &F : M) {
+    GlobalModRef &R = info[&F];
+    for (Instruction &I : instructions(F)) {
+      if (auto *LI = dyn_cast<LoadInst>(&I)) {
+        if (auto *GV = dyn_cast<GlobalVariable>(LI->getPointerOperand()))
+          R.Ref.insert(GV);
+      } else if (auto *SI = dyn_cast<StoreInst>(&I)) {
+        if (auto *GV = dyn_cast<GlobalVariable>(SI->getPointerOperand()))
+          R.Mod.insert(GV);
+      } else if (auto *CB = dyn_cast<CallBase>(&I)) {
+        if (Function *Callee = CB->getCalledFunction())
+          callees[&F].insert(Callee);
+        else
+          R.Unknown = true;
+      }
+    }
+  }
+
+  // Propagate up the call graph until nothing changes.
+  bool updated = true;
+  while (updated) {
+    updated = false;
+    for (auto &[F, Called] : callees) {
+      GlobalModRef &R = info[F];
+      size_t before = R.Mod.size() + R.Ref.size() + R.Unknown;
+      for (Function *Callee : Called) {
+        GlobalModRef &C = info[Callee];
+        R.Mod.insert(C.Mod.begin(), C.Mod.end());
+        R.Ref.insert(C.Ref.begin(), C.Ref.end());
+        R.Unknown |= C.Unknown;
+      }
+      updated |= R.Mod.size() + R.Ref.size() + R.Unknown != before;
+    }
+  }
+  return info;
+}
+
+static bool mayMod(CallBase *CB, GlobalVariable *GV,
+                   map<Function*, GlobalModRef> &info) {
+  Function *Callee = CB->getCalledFunction();
+  if (!Callee)
+    return true;
+  GlobalModRef &R = info[Callee];
+  return R.Unknown || R.Mod.count(GV);
+}
+
+static bool mayModOrRef(CallBase *CB, GlobalVariable *GV,
+                        map<Function*, GlobalModRef> &info) {
+  Function *Callee = CB->getCalledFunction();
+  return mayMod(CB, GV, info) || info[Callee].Ref.count(GV);
+}
+
+// The travel per iteration of L that the resets between its arrays could
+// save. Each array is walked by the loop, so two of them are at least the
+// shorter walk apart, and without a reset the head covers that at every
+// switch from one to another. Accesses that do not step along L give no
+// such bound.
+static double getArrayTravel(Loop *L, ScalarEvolution &SE,
+                             const DataLayout &DL) {
+  unsigned trips = SE.getSmallConstantTripCount(L);
+  map<Value*, double> walked;
+  for (BasicBlock *BB : L->blocks())
+    for (Instruction &I : *BB) {
+      Value *Ptr = getLoadStorePointerOperand(&I);
+      if (!Ptr)
+        continue;
+      Value *Obj = GetUnderlyingObject(Ptr, DL);
+      if (isa<GlobalVariable>(Obj) || isa<AllocaInst>(Obj))
+        continue;
+      // The offset into the array, as its start may be reloaded each
+      // iteration from a global that is yet to be promoted.
+      double bytes = 0;
+      auto *AR = dyn_cast<SCEVAddRecExpr>(
+          SE.getMinusSCEV(SE.getSCEV(Ptr), SE.getSCEV(Obj)));
+      if (AR && AR->getLoop() == L)
+        if (auto *Step = dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE)))
+          bytes = abs(Step->getAPInt().getSExtValue()) *
+                  (trips ? trips : EXPECTED_TRIPS);
+      auto It = walked.find(Obj);
+      walked[Obj] = It == walked.end() ? bytes : min(It->second, bytes);
+    }
+  if (walked.size() < 2)
+    return 0;
+  double shortest = min_element(walked.begin(), walked.end(),
+                                [](auto &A, auto &B) {
+                                  return A.second < B.second;
+                                })->second;
+  return walked.size() * shortest * COST_TRAVEL;
+}
+
+// Keeps GV in a register while L runs. Its loads and stores in L go to a
+// new alloca, later promoted by mem2reg, that is filled in the preheader.
+// Memory is brought up to date only where someone else could look: before
+// calls that use GV and at the loop exits, and the register is reloaded
+// after calls that may write GV.
+static AllocaInst *promoteInLoop(Loop *L, GlobalVariable *GV,
+                                 vector<Instruction*> &accesses,
+                                 vector<CallBase*> &calls,
+                                 map<Function*, GlobalModRef> &info) {
+  Function &F = *L->getHeader()->getParent();
+  Type *Ty = GV->getValueType();
+  auto *Slot = new AllocaInst(Ty, 0, GV->getName() + ".promoted",
+                              &*F.getEntryBlock().getFirstInsertionPt());
+  Instruction *PreTerm = L->getLoopPreheader()->getTerminator();
+  new StoreInst(new LoadInst(Ty, GV, GV->getName(), PreTerm), Slot, PreTerm);
+
+  bool stored = false;
+  for (Instruction *I : accesses) {
+    stored |= isa<StoreInst>(I);
+    I->setOperand(isa<StoreInst>(I) ? 1 : 0, Slot);
+  }
+
+  auto writeBack = [&](Instruction *Before) {
+    new StoreInst(new LoadInst(Ty, Slot, GV->getName(), Before), GV, Before);
+  };
+  for (CallBase *CB : calls) {
+    if (stored)
+      writeBack(CB);
+    if (mayMod(CB, GV, info)) {
+      Instruction *After = CB->getNextNode();
+      new StoreInst(new LoadInst(Ty, GV, GV->getName(), After), Slot, After);
+    }
+  }
+  if (stored) {
+    SmallVector<BasicBlock*, 4> exits;
+    L->getUniqueExitBlocks(exits);
+    for (BasicBlock *Exit : exits)
+      writeBack(&*Exit->getFirstInsertionPt());
+  }
+  return Slot;
+}
+
+// Promotes global scalars to registers across the loops that use them.
+// The global area is memory like any other: each reload pays the load and
+// the head travel to get there, often with a reset in between.
+PreservedAnalyses GlobalPromotion::run(Function &F,
+                                       FunctionAnalysisManager &FAM) {
+  LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+  if (LI.empty())
+    return PreservedAnalyses::all();
+
+  vector<GlobalVariable*> globals;
+  for (GlobalVariable &GV : F.getParent()->globals())
+    if (isPromotable(GV))
+      globals.push_back(&GV);
+  if (globals.empty())
+    return PreservedAnalyses::all();
+
+  map<Function*, GlobalModRef> info = computeModRef(*F.getParent());
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  ScalarEvolution &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+  // Worked out before any loop changes.
+  map<Loop*, double> arrayTravel;
+  for (Loop *L : LI.getLoopsInPreorder())
+    arrayTravel[L] = getArrayTravel(L, SE, DL);
+  RegPressure RP(F);
+  // Registers already taken by globals promoted in a loop, which are live
+  // in all of its blocks.
+  map<BasicBlock*, unsigned> promotedLive;
+  vector<AllocaInst*> slots;
+
+  // Outer loops first: once a global lives in a register across a loop,
+  // the loops inside it no longer touch it.
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    if (!L->getLoopPreheader() || !L->hasDedicatedExits())
+      continue;
+    for (GlobalVariable *GV : globals) {
+      vector<Instruction*> accesses;
+      vector<CallBase*> calls;
+      bool unsafe = false;
+      for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+          if (isa<LoadInst>(I) || isa<StoreInst>(I)) {
+            if (getLoadStorePointerOperand(&I) == GV)
+              accesses.push_back(&I);
+          } else if (auto *CB = dyn_cast<CallBase>(&I)) {
+            if (isa<IntrinsicInst>(CB) || !mayModOrRef(CB, GV, info))
+              continue;
+            // The reload would have to go after the terminator.
+            if (CB->isTerminator())
+              unsafe = true;
+            calls.push_back(CB);
+          }
+        }
+      }
+      // Every call that uses GV costs a store back and maybe a reload
+      // in each iteration; that has to be cheaper than the accesses saved.
+      if (unsafe || accesses.empty() || calls.size() >= accesses.size())
+        continue;
+      // Each reload is a switch to the stack or the global area, and the
+      // backend resets the head on the way back. Keep them when those
+      // resets may save more travel than the reloads cost.
+      if (accesses.size() * (COST_MEM + COST_RESET) <= arrayTravel[L])
+        continue;
+      bool fits = all_of(L->blocks(), [&](BasicBlock *BB) {
+        return RP.getMaxPressure(BB) + promotedLive[BB] + 1 <= REG_SIZE;
+      });
+      if (!fits)
+        continue;
+
+      slots.push_back(promoteInLoop(L, GV, accesses, calls, info));
+      for (BasicBlock *BB : L->blocks())
+        promotedLive[BB]++;
+    }
+  }
+  if (slots.empty())
+    return PreservedAnalyses::all();
+
+  DominatorTree &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  AssumptionCache &AC = FAM.getResult<AssumptionAnalysis>(F);
+  PromoteMemToReg(slots, DT, &AC);
+  return PreservedAnalyses::none();
+}
@@ -0,0 +1,417 @@
+#include "IdiomRecognition.h"
+#include "SWPPCost.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+using namespace llvm::PatternMatch;
+using namespace std;
+
+// A bit loop of a W-bit value is assumed to run W / EXPECTED_TRIPS_DIV
+// iterations when it is weighed against the straight-line code.
+#define EXPECTED_TRIPS_DIV 8
+
+// What the trip count of a recognized loop is, as a function of its source
+// value.
+enum TripKind { POPCOUNT, BITLEN, CTLZ, CTTZ };
+
+// V >> S. Like ArithmeticOptimization, use udiv, which is cheaper than
+// lshr on SWPP.
+static Value *createShr(IRBuilder<> &B, Value *V, unsigned S) {
+  unsigned W = V->getType()->getIntegerBitWidth();
+  return B.CreateUDiv(V, B.getInt(APInt::getOneBitSet(W, S)));
+}
+
+// Whether V is X >> 1, in either of its forms.
+static bool isHalfOf(Value *V, Value *X) {
+  return match(V, m_LShr(m_Specific(X), m_One())) ||
+         match(V, m_UDiv(m_Specific(X), m_SpecificInt(2)));
+}
+
+// SWAR popcount; the multiplication sums the byte counts into the top byte.
+static Value *createPopcount(IRBuilder<> &B, Value *V) {
+  Type *Ty = V->getType();
+  unsigned W = Ty->getIntegerBitWidth();
+  auto splat = [&](uint8_t byte) {
+    return ConstantInt::get(Ty, APInt::getSplat(W, APInt(8, byte)));
+  };
+  V = B.CreateSub(V, B.CreateAnd(createShr(B, V, 1), splat(0x55)));
+  V = B.CreateAdd(B.CreateAnd(V, splat(0x33)),
+                  B.CreateAnd(createShr(B, V, 2), splat(0x33)));
+  V = B.CreateAnd(B.CreateAdd(V, createShr(B, V, 4)), splat(0x0f));
+  if (W > 8)
+    V = createShr(B, B.CreateMul(V, splat(0x01)), W - 8);
+  return V;
+}
+
+// Sets every bit below the highest set bit of V.
+static Value *createSmear(IRBuilder<> &B, Value *V) {
+  unsigned W = V->getType()->getIntegerBitWidth();
+  for (unsigned s = 1; s < W; s *= 2)
+    V = B.CreateOr(V, createShr(B, V, s));
+  return V;
+}
+
+static Value *createTripCount(IRBuilder<> &B, TripKind Kind, Value *Src) {
+  unsigned W = Src->getType()->getIntegerBitWidth();
+  switch (Kind) {
+  case POPCOUNT:
+    return createPopcount(B, Src);
+  case BITLEN:
+    return createPopcount(B, createSmear(B, Src));
+  case CTLZ:
+    return B.CreateSub(ConstantInt::get(Src->getType(), W),
+                       createPopcount(B, createSmear(B, Src)));
+  case CTTZ:
+    // the bits below the lowest set bit, or all of them for 0
+    return createPopcount(B, B.CreateAnd(B.CreateNot(Src),
+                                         B.CreateSub(Src, B.getIntN(W, 1))));
+  }
+  return nullptr;
+}
+
+// One iteration of the driver of a POPCOUNT or BITLEN loop.
+static Value *createStep(IRBuilder<> &B, TripKind Kind, Value *V) {
+  if (Kind == BITLEN)
+    return createShr(B, V, 1);
+  return B.CreateAnd(V, B.CreateSub(V, ConstantInt::get(V->getType(), 1)));
+}
+
+// Init + Step * Trips, the value a counter leaves the loop with.
+static Value *createCounterExit(IRBuilder<> &B, Value *Init, ConstantInt *Step,
+                                Value *Trips) {
+  Trips = B.CreateZExtOrTrunc(Trips, Init->getType());
+  if (Step->isMinusOne())
+    return B.CreateSub(Init, Trips);
+  Value *Delta = Step->isOne() ? Trips : B.CreateMul(Trips, Step);
+  auto *C = dyn_cast<ConstantInt>(Init);
+  if (C && C->isZero())
+    return Delta;
+  return B.CreateAdd(Init, Delta);
+}
+
+static bool isUsedOutside(Instruction *I, Loop *L) {
+  for (User *U : I->users())
+    if (!L->contains(cast<Instruction>(U)))
+      return true;
+  return false;
+}
+
+// The successor of the conditional branch BI that is taken when V != 0 for
+// the condition `icmp eq/ne V, 0`.
+static BasicBlock *getNonZeroSucc(BranchInst *BI, Value *&V) {
+  ICmpInst::Predicate Pred;
+  if (!match(BI->getCondition(), m_ICmp(Pred, m_Value(V), m_Zero())))
+    return nullptr;
+  if (Pred == ICmpInst::ICMP_NE)
+    return BI->getSuccessor(0);
+  if (Pred == ICmpInst::ICMP_EQ)
+    return BI->getSuccessor(1);
+  return nullptr;
+}
+
+// The successor of the conditional branch BI that is taken while the
+// counter I, walking down from W-1 (ctlz) or up from 0 (cttz), is in range.
+static BasicBlock *getInRangeSucc(BranchInst *BI, PHINode *I, TripKind &Kind,
+                                  unsigned W) {
+  ICmpInst::Predicate Pred;
+  ConstantInt *C;
+  if (!match(BI->getCondition(),
+             m_ICmp(Pred, m_Specific(I), m_ConstantInt(C))))
+    return nullptr;
+  BasicBlock *InRange = BI->getSuccessor(0);
+  int64_t Bound = C->getSExtValue();
+  if ((Pred == ICmpInst::ICMP_SGE && Bound == 0) ||
+      (Pred == ICmpInst::ICMP_SGT && Bound == -1)) {
+    Kind = CTLZ;
+    return InRange;
+  }
+  if ((Pred == ICmpInst::ICMP_SLT || Pred == ICmpInst::ICMP_ULT ||
+       Pred == ICmpInst::ICMP_NE) && Bound == W) {
+    Kind = CTTZ;
+    return InRange;
+  }
+  if ((Pred == ICmpInst::ICMP_SLE || Pred == ICmpInst::ICMP_ULE) &&
+      Bound == W - 1) {
+    Kind = CTTZ;
+    return InRange;
+  }
+  return nullptr;
+}
+
+// A recognized loop: it runs Trips(Kind, Src) iterations. Driver (if any)
+// is the phi whose bits are consumed until it becomes 0.
+struct BitLoop {
+  TripKind Kind;
+  Value *Src = nullptr;
+  PHINode *Driver = nullptr;
+  // whether Src is Driver stepped once, i.e. the header tests the next
+  // value of Driver
+  bool SteppedSrc = false;
+  set<BasicBlock*> Exiting;
+};
+
+// while (x) { ...; x >>= 1; }, while (x) { ...; x &= x - 1; } and the
+// log2 form while (x >>= 1) { ... }.
+static bool matchDriverLoop(Loop *L, BitLoop &BL) {
+  BasicBlock *H = L->getHeader(), *Latch = L->getLoopLatch();
+  BasicBlock *PH = L->getLoopPreheader();
+  auto *BI = dyn_cast<BranchInst>(H->getTerminator());
+  Value *Y;
+  if (!BI || BI->isUnconditional() || !getNonZeroSucc(BI, Y) ||
+      !L->contains(getNonZeroSucc(BI, Y)))
+    return false;
+
+  PHINode *X = dyn_cast<PHINode>(Y);
+  bool stepped = !X;
+  if (!X) {
+    // the header computes the next value of the driver and tests it
+    auto *YI = dyn_cast<Instruction>(Y);
+    if (!YI || YI->getParent() != H)
+      return false;
+    for (PHINode &PN : H->phis())
+      if (PN.getIncomingValueForBlock(Latch) == Y)
+        X = &PN;
+    if (!X)
+      return false;
+  }
+  if (X->getParent() != H || !X->getType()->isIntegerTy() ||
+      X->getType()->getIntegerBitWidth() % 8 != 0)
+    return false;
+
+  Value *Next = X->getIncomingValueForBlock(Latch);
+  if (isHalfOf(Next, X))
+    BL.Kind = BITLEN;
+  else if (match(Next, m_c_And(m_Specific(X),
+                                m_Add(m_Specific(X), m_AllOnes()))) ||
+           match(Next, m_c_And(m_Specific(X), m_Sub(m_Specific(X), m_One()))))
+    BL.Kind = POPCOUNT;
+  else
+    return false;
+
+  BL.Driver = X;
+  BL.Src = X->getIncomingValueForBlock(PH);
+  BL.SteppedSrc = stepped;
+  BL.Exiting.insert(H);
+  return true;
+}
+
+// for (i = W-1; i >= 0; i--) { if (x & (1 << i)) break; ... } and its
+// upward cttz twin. The body test may also be written (x >> i) & 1.
+static bool matchScanLoop(Loop *L, BitLoop &BL) {
+  BasicBlock *H = L->getHeader(), *Latch = L->getLoopLatch();
+  BasicBlock *PH = L->getLoopPreheader();
+  auto *BI = dyn_cast<BranchInst>(H->getTerminator());
+  if (!BI || BI->isUnconditional())
+    return false;
+  BasicBlock *Body = nullptr;
+  for (BasicBlock *Succ : BI->successors())
+    if (L->contains(Succ))
+      Body = Succ;
+  if (!Body || Body->getSinglePredecessor() != H)
+    return false;
+  auto *TestBI = dyn_cast<BranchInst>(Body->getTerminator());
+  Value *Bit;
+  if (!TestBI || TestBI->isUnconditional() || !getNonZeroSucc(TestBI, Bit) ||
+      L->contains(getNonZeroSucc(TestBI, Bit)))
+    return false;
+
+  Value *X;
+  PHINode *I = nullptr;
+  for (PHINode &PN : H->phis()) {
+    if (match(Bit, m_c_And(m_Value(X), m_Shl(m_One(), m_Specific(&PN)))) ||
+        match(Bit, m_And(m_LShr(m_Value(X), m_Specific(&PN)), m_One()))) {
+      I = &PN;
+      break;
+    }
+  }
+  if (!I || !L->isLoopInvariant(X) || X->getType() != I->getType() ||
+      X->getType()->getIntegerBitWidth() % 8 != 0)
+    return false;
+
+  unsigned W = X->getType()->getIntegerBitWidth();
+  if (getInRangeSucc(BI, I, BL.Kind, W) != Body)
+    return false;
+  auto *Init = dyn_cast<ConstantInt>(I->getIncomingValueForBlock(PH));
+  Value *Next = I->getIncomingValueForBlock(Latch);
+  if (!Init)
+    return false;
+  if (BL.Kind == CTLZ &&
+      !(Init->getZExtValue() == W - 1 &&
+        match(Next, m_Add(m_Specific(I), m_AllOnes()))))
+    return false;
+  if (BL.Kind == CTTZ &&
+      !(Init->isZero() && match(Next, m_Add(m_Specific(I), m_One()))))
+    return false;
+
+  BL.Src = X;
+  BL.Exiting.insert(H);
+  BL.Exiting.insert(Body);
+  return true;
+}
+
+// Block every exit of L ends up in, skipping exit blocks that only branch
+// on. Those are added to Forwarders, they die with the loop.
+static BasicBlock *getExitDest(Loop *L, vector<BasicBlock*> &Forwarders) {
+  SmallVector<BasicBlock*, 4> Exits;
+  L->getUniqueExitBlocks(Exits);
+  BasicBlock *Dest = nullptr;
+  for (BasicBlock *E : Exits) {
+    BasicBlock *Target = E;
+    bool onlyFromLoop = true;
+    for (BasicBlock *Pred : predecessors(E))
+      onlyFromLoop &= L->contains(Pred);
+    if (E->size() == 1 && E->getSingleSuccessor() && onlyFromLoop) {
+      Target = E->getSingleSuccessor();
+      Forwarders.push_back(E);
+    }
+    if (Dest && Dest != Target)
+      return nullptr;
+    Dest = Target;
+  }
+  if (!Dest || !Dest->phis().empty())
+    return nullptr;
+  return Dest;
+}
+
+// Replaces a bit-by-bit loop with straight-line code computing what it
+// leaves behind.
+static bool recognizeLoop(Loop *L) {
+  BasicBlock *H = L->getHeader(), *Latch = L->getLoopLatch();
+  BasicBlock *PH = L->getLoopPreheader();
+  if (!PH || !Latch || !L->getSubLoops().empty())
+    return false;
+
+  BitLoop BL;
+  if (!matchDriverLoop(L, BL) && !matchScanLoop(L, BL))
+    return false;
+
+  // Only the header phis may be seen from outside, and the loop must not do
+  // anything but compute them.
+  SmallVector<BasicBlock*, 4> Exiting;
+  L->getExitingBlocks(Exiting);
+  if (set<BasicBlock*>(Exiting.begin(), Exiting.end()) != BL.Exiting)
+    return false;
+  double iterCost = 0;
+  for (BasicBlock *BB : L->blocks()) {
+    for (Instruction &I : *BB) {
+      if (I.mayHaveSideEffects() || I.mayReadFromMemory())
+        return false;
+      if (!(isa<PHINode>(I) && BB == H) && isUsedOutside(&I, L))
+        return false;
+      iterCost += getSWPPCost(&I);
+    }
+  }
+  vector<BasicBlock*> Forwarders;
+  BasicBlock *Dest = getExitDest(L, Forwarders);
+  if (!Dest)
+    return false;
+
+  // Build the replacement in a detached block to weigh it first.
+  LLVMContext &Context = H->getContext();
+  BasicBlock *Tmp = BasicBlock::Create(Context);
+  IRBuilder<> B(Tmp);
+  Value *Src = BL.Src;
+  if (BL.SteppedSrc)
+    Src = createStep(B, BL.Kind, Src);
+  Value *Trips = nullptr;
+  auto getTrips = [&]() {
+    if (!Trips)
+      Trips = createTripCount(B, BL.Kind, Src);
+    return Trips;
+  };
+
+  vector<pair<PHINode*, Value*>> exitVals;
+  bool ok = true;
+  for (PHINode &PN : H->phis()) {
+    if (!isUsedOutside(&PN, L))
+      continue;
+    Value *Init = PN.getIncomingValueForBlock(PH);
+    Value *Next = PN.getIncomingValueForBlock(Latch);
+    ConstantInt *Step;
+    if (&PN == BL.Driver && !BL.SteppedSrc) {
+      exitVals.push_back({&PN, Constant::getNullValue(PN.getType())});
+    } else if (match(Next, m_c_Add(m_Specific(&PN), m_ConstantInt(Step)))) {
+      exitVals.push_back({&PN, createCounterExit(B, Init, Step, getTrips())});
+    } else if (BL.Kind == BITLEN && BL.Driver && !BL.SteppedSrc &&
+               match(Next, m_c_Add(m_Specific(&PN),
+                                   m_c_And(m_Specific(BL.Driver), m_One())))) {
+      auto *One = cast<ConstantInt>(ConstantInt::get(PN.getType(), 1));
+      exitVals.push_back(
+          {&PN, createCounterExit(B, Init, One, createPopcount(B, Src))});
+    } else {
+      ok = false;
+      break;
+    }
+  }
+
+  // Expect a few iterations; a loop that sees fewer bits than that was
+  // cheap anyway.
+  unsigned W = Src->getType()->getIntegerBitWidth();
+  double loopCost = iterCost * max(1u, W / EXPECTED_TRIPS_DIV);
+  if (!ok || getSWPPCost(Tmp) >= loopCost) {
+    Tmp->dropAllReferences();
+    delete Tmp;
+    return false;
+  }
+
+  Instruction *PHTerm = PH->getTerminator();
+  PH->getInstList().splice(PHTerm->getIterator(), Tmp->getInstList());
+  delete Tmp;
+  // The code after the loop often undoes part of the computation, e.g.
+  // 32 - ctlz(x), let it fold. A user of two of the phis is folded once.
+  SmallSetVector<Instruction*, 8> outsideUsers;
+  for (auto &[PN, V] : exitVals) {
+    for (auto UI = PN->use_begin(); UI != PN->use_end();) {
+      Use &U = *UI++;
+      auto *UserI = cast<Instruction>(U.getUser());
+      if (!L->contains(UserI)) {
+        U.set(V);
+        outsideUsers.insert(UserI);
+      }
+    }
+  }
+  const DataLayout &DL = H->getModule()->getDataLayout();
+  for (Instruction *UserI : outsideUsers) {
+    if (Value *S = SimplifyInstruction(UserI, DL)) {
+      UserI->replaceAllUsesWith(S);
+      UserI->eraseFromParent();
+    }
+  }
+  vector<WeakVH> results;
+  for (auto &[PN, V] : exitVals)
+    results.push_back(V);
+  for (WeakVH &V : results)
+    if (V)
+      RecursivelyDeleteTriviallyDeadInstructions(V);
+  BranchInst::Create(Dest, PHTerm);
+  PHTerm->eraseFromParent();
+
+  vector<BasicBlock*> Dead(L->blocks().begin(), L->blocks().end());
+  Dead.insert(Dead.end(), Forwarders.begin(), Forwarders.end());
+  DeleteDeadBlocks(Dead);
+  MergeBlockIntoPredecessor(Dest);
+  return true;
+}
+
+PreservedAnalyses IdiomRecognition::run(Function &F,
+                                        FunctionAnalysisManager &FAM) {
+  LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+  vector<Loop*> innermost;
+  for (Loop *L : LI.getLoopsInPreorder())
+    if (L->getSubLoops().empty())
+      innermost.push_back(L);
+
+  bool changed = false;
+  for (Loop *L : innermost)
+    changed |= recognizeLoop(L);
+  if (!changed)
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
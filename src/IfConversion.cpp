@@ -0,0 +1,197 @@
+#include "IfConversion.h"
+#include "SWPPCost.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+using namespace std;
+
+// Arms with more instructions than this are never speculated.
+#define MAX_SPECULATE 8
+
+// An arm of an if is a block between the branching block and the merging
+// block that can run unconditionally: no memory access, no call, nothing
+// that may trap.
+static bool isSpeculatableArm(BasicBlock *Arm, BasicBlock *Head,
+                              BasicBlock *Tail) {
+  if (Arm == Head || Arm == Tail || Arm->getSinglePredecessor() != Head)
+    return false;
+  auto *BI = dyn_cast<BranchInst>(Arm->getTerminator());
+  if (!BI || BI->isConditional() || BI->getSuccessor(0) != Tail)
+    return false;
+  unsigned count = 0;
+  for (Instruction &I : *Arm) {
+    if (&I == BI)
+      break;
+    if (isa<PHINode>(I) || I.mayReadOrWriteMemory() ||
+        !isSafeToSpeculativelyExecute(&I))
+      return false;
+    if (++count > MAX_SPECULATE)
+      return false;
+  }
+  return true;
+}
+
+// The heap object I accesses, or nullptr when I is not a load or store or
+// its object may be on the stack: allocas are, and so are the globals that
+// hold no pointer, which the backend moves there while they fit.
+static const Value *getHeapObject(const Instruction &I) {
+  const Value *Ptr = getLoadStorePointerOperand(&I);
+  if (!Ptr)
+    return nullptr;
+  const DataLayout &DL = I.getModule()->getDataLayout();
+  const Value *Obj = GetUnderlyingObject(Ptr, DL);
+  if (isa<AllocaInst>(Obj))
+    return nullptr;
+  if (auto *GV = dyn_cast<GlobalVariable>(Obj))
+    return GV->getValueType()->isPointerTy() ? Obj : nullptr;
+  return Obj;
+}
+
+// Whether the first access of Tail goes back to a heap object that Head
+// left for another one. The phis of Tail are stack slots while the branch
+// is there, so the backend resets the head on its way back to the heap;
+// the selects leave it to travel all the way back instead.
+static bool returnsToHeapObject(BasicBlock *Head, BasicBlock *Tail) {
+  set<const Value*> Left;
+  const Value *Last = nullptr;
+  for (Instruction &I : *Head) {
+    if (isa<CallInst>(I)) {
+      Left.clear();
+      Last = nullptr;
+    } else if (I.mayReadOrWriteMemory()) {
+      if (Last)
+        Left.insert(Last);
+      Last = getHeapObject(I);
+    }
+  }
+  if (!Last)
+    return false;
+  for (Instruction &I : *Tail) {
+    if (isa<CallInst>(I))
+      return false;
+    if (I.mayReadOrWriteMemory()) {
+      const Value *First = getHeapObject(I);
+      return First && First != Last && Left.count(First);
+    }
+  }
+  return false;
+}
+
+static double getArmCost(BasicBlock *Arm) {
+  return Arm ? getSWPPCost(Arm) : 0;
+}
+
+static unsigned getArmSize(BasicBlock *Arm) {
+  return Arm ? Arm->size() - 1 : 0;
+}
+
+// Turns the if starting at Head into selects when it is cheaper than the
+// branch and does not push Head past the register budget.
+static bool convertIf(BasicBlock *Head, RegPressure &RP) {
+  auto *BI = dyn_cast<BranchInst>(Head->getTerminator());
+  if (!BI || BI->isUnconditional() || isa<Constant>(BI->getCondition()))
+    return false;
+  BasicBlock *TSucc = BI->getSuccessor(0), *FSucc = BI->getSuccessor(1);
+  if (TSucc == FSucc)
+    return false;
+
+  // Arms are nullptr when the edge goes straight to Tail.
+  BasicBlock *TArm = nullptr, *FArm = nullptr, *Tail = nullptr;
+  BasicBlock *TTail = TSucc->getSingleSuccessor();
+  BasicBlock *FTail = FSucc->getSingleSuccessor();
+  if (TTail && TTail == FTail && isSpeculatableArm(TSucc, Head, TTail) &&
+      isSpeculatableArm(FSucc, Head, TTail)) {
+    TArm = TSucc, FArm = FSucc, Tail = TTail;
+  } else if (TTail == FSucc && isSpeculatableArm(TSucc, Head, FSucc)) {
+    TArm = TSucc, Tail = FSucc;
+  } else if (FTail == TSucc && isSpeculatableArm(FSucc, Head, TSucc)) {
+    FArm = FSucc, Tail = TSucc;
+  } else {
+    return false;
+  }
+  if (Tail == Head)
+    return false;
+
+  BasicBlock *TSrc = TArm ? TArm : Head, *FSrc = FArm ? FArm : Head;
+  unsigned selectCount = 0;
+  for (PHINode &PN : Tail->phis()) {
+    Value *TV = PN.getIncomingValueForBlock(TSrc);
+    Value *FV = PN.getIncomingValueForBlock(FSrc);
+    if (TV == FV)
+      continue;
+    if (!canBeSelected(TV) || !canBeSelected(FV))
+      return false;
+    selectCount++;
+  }
+
+  // Only Head and the arms reach Tail: after the conversion the phis die
+  // and Tail is merged into Head.
+  bool mergesTail = pred_size(Tail) == 2;
+  unsigned phiCount = distance(Tail->phis().begin(), Tail->phis().end());
+
+  double branchCost = COST_BR +
+    0.5 * (getArmCost(TArm) + (TArm ? COST_BR : 0)) +
+    0.5 * (getArmCost(FArm) + (FArm ? COST_BR : 0)) +
+    (mergesTail ? phiCount * COST_MEM * 2 : 0);
+  double selectCost = getArmCost(TArm) + getArmCost(FArm) +
+    selectCount * COST_SELECT + (mergesTail ? 0 : COST_BR);
+  if (selectCost > branchCost)
+    return false;
+  // A reset costs as much as 5000 bytes of travel, and the way back is as
+  // long as the way there, which often is more.
+  if (mergesTail && phiCount && returnsToHeapObject(Head, Tail))
+    return false;
+
+  unsigned newValues = getArmSize(TArm) + getArmSize(FArm) + selectCount;
+  if (RP.getLiveOutCount(Head) + newValues > REG_SIZE)
+    return false;
+
+  Value *Cond = BI->getCondition();
+  for (BasicBlock *Arm : {TArm, FArm}) {
+    if (!Arm)
+      continue;
+    while (Arm->size() > 1)
+      Arm->front().moveBefore(BI);
+  }
+  IRBuilder<> Builder(BI);
+  for (PHINode &PN : Tail->phis()) {
+    Value *TV = PN.getIncomingValueForBlock(TSrc);
+    Value *FV = PN.getIncomingValueForBlock(FSrc);
+    Value *NewV = TV == FV ? TV : Builder.CreateSelect(Cond, TV, FV);
+    int HeadIdx = PN.getBasicBlockIndex(Head);
+    if (HeadIdx >= 0)
+      PN.setIncomingValue(HeadIdx, NewV);
+    else
+      PN.addIncoming(NewV, Head);
+  }
+  BranchInst::Create(Tail, BI);
+  BI->eraseFromParent();
+  for (BasicBlock *Arm : {TArm, FArm})
+    if (Arm)
+      DeleteDeadBlock(Arm);
+  RecursivelyDeleteTriviallyDeadInstructions(Cond);
+  MergeBlockIntoPredecessor(Tail);
+  return true;
+}
+
+PreservedAnalyses IfConversion::run(Function &F, FunctionAnalysisManager &FAM) {
+  bool changed = false;
+  bool converted = true;
+  while (converted) {
+    converted = false;
+    RegPressure RP(F);
+    for (BasicBlock &BB : F) {
+      if (convertIf(&BB, RP)) {
+        converted = changed = true;
+        break;
+      }
+    }
+  }
+  if (!changed)
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
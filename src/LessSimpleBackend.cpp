@@ -1,26 +1,48 @@
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/Analysis/TargetFolder.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/SCCIterator.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/AssemblyAnnotationWriter.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/InstVisitor.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/KnownBits.h"
 #include "llvm/Support/raw_os_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <climits>
+#include <cmath>
 #include <string>
 #include <sstream>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include "LessSimpleBackend.h"
+#include "SWPPCost.h"
 
 using namespace llvm;
 using namespace std;
 
-static Value *unCast(CastInst *CI, string tempPrefix, bool piercing=false){
-    if((!piercing) && (!CI->getName().startswith(tempPrefix))){return CI;}
+static Value *unCast(CastInst *CI, const RegAssignment &RA, bool piercing=false){
+    if((!piercing) && (!RA.isFolded(CI))){return CI;}
     Value *operandV = CI->getOperand(0);
     if(CastInst *operandCI = dyn_cast<CastInst>(operandV)){
-        return unCast(operandCI, tempPrefix);
+        return unCast(operandCI, RA);
     }else{return operandV;}
 }
 
@@ -54,28 +76,61 @@ static bool containsUseOf(Instruction *user, Instruction *usee){
     }
     return false;
 }
+// Depth first from BB, so a long chain of blocks gets its own stack instead
+// of the C++ one. Blocks of an SCC below useSCC cannot reach a use and are
+// left out.
 static int usedAfterDFS(
     Instruction *I, BasicBlock *BB,
-    set<BasicBlock*> &visitedBlockSet, Instruction* trueForm){
-    if(visitedBlockSet.count(BB)){return 0;}
-    int distance = 1;
-    for(Instruction &instOfBB : BB->getInstList()){
-        if(&instOfBB==trueForm){return 0;}
-        if(containsUseOf(&instOfBB, I)){return distance;}
-        distance ++;
-    }
-    vector<int> distanceList;
-    visitedBlockSet.insert(BB);
-    for(int i = 0; i < BB->getTerminator()->getNumSuccessors(); i++){
-        if(int dis = usedAfterDFS(I, BB->getTerminator()->getSuccessor(i), visitedBlockSet, trueForm)){
-            distanceList.push_back(distance+dis);
-        }
-    }
-    if(distanceList.size()==0){return 0;}
-    std::sort(distanceList.begin(), distanceList.end());
-    return distanceList[0];
+    set<BasicBlock*> &visitedBlockSet, Instruction* trueForm,
+    const SCCIndex &sccIndex, unsigned useSCC){
+    // a block whose successors are being searched, with the nearest use
+    // found behind them so far
+    struct Frame{
+        BasicBlock *BB;
+        unsigned nextSucc;
+        int distance;
+        int nearest;
+    };
+    vector<Frame> stack;
+    // returns the distance of a use in B, or pushes B to search on
+    auto search = [&](BasicBlock *B){
+        if(visitedBlockSet.count(B)){return 0;}
+        auto idx = sccIndex.find(B);
+        if(idx != sccIndex.end() && idx->second < useSCC){return 0;}
+        int distance = 1;
+        for(Instruction &instOfBB : B->getInstList()){
+            if(&instOfBB==trueForm){return 0;}
+            if(containsUseOf(&instOfBB, I)){return distance;}
+            distance ++;
+        }
+        visitedBlockSet.insert(B);
+        stack.push_back({B, 0, distance, 0});
+        return 0;
+    };
+    auto addNearest = [](Frame &frame, int dis){
+        if(!dis){return;}
+        if(!frame.nearest || frame.distance+dis < frame.nearest){
+            frame.nearest = frame.distance+dis;
+        }
+    };
+    int dis = search(BB);
+    while(!stack.empty()){
+        Frame &top = stack.back();
+        Instruction *term = top.BB->getTerminator();
+        if(top.nextSucc == term->getNumSuccessors()){
+            dis = top.nearest;
+            stack.pop_back();
+            if(stack.empty()){break;}
+            addNearest(stack.back(), dis);
+            continue;
+        }
+        // a use found right away leaves the stack as it was
+        addNearest(top, search(term->getSuccessor(top.nextSucc++)));
+    }
+    return dis;
 }
-static int _usedAfter(Instruction *I, Instruction *I_current, string tempPrefix, Instruction *trueForm){
+static int _usedAfter(Instruction *I, Instruction *I_current, Instruction *trueForm,
+    const SCCIndex &sccIndex, unsigned useSCC){
     Instruction *localTerm = I_current->getParent()->getTerminator();
     Instruction *walkerInst = I_current;
     int distance = 1;
@@ -88,7 +143,8 @@ static int _usedAfter(Instruction *I, Instruction *I_current, string tempPrefix,
     set<BasicBlock*> visitedBlockSet;
     vector<int> distanceList;
     for(int i = 0; i < localTerm->getNumSuccessors(); i++){
-        if(int dis = usedAfterDFS(I, localTerm->getSuccessor(i), visitedBlockSet, trueForm)){
+        if(int dis = usedAfterDFS(I, localTerm->getSuccessor(i), visitedBlockSet, trueForm,
+                                   sccIndex, useSCC)){
             distanceList.push_back(dis+distance);
         }
     }
@@ -96,24 +152,49 @@ static int _usedAfter(Instruction *I, Instruction *I_current, string tempPrefix,
     std::sort(distanceList.begin(), distanceList.end());
     return distanceList[0];
 }
-static int usedAfter(Instruction *I, Instruction *I_current, string tempPrefix, bool selfFlag=true){
+// The lowest SCC a use of I or of the casts in searchList is in, 0 if
+// one of them is in a block the index does not know.
+static unsigned getUseSCC(Instruction *I, const vector<Instruction*> &searchList,
+    const SCCIndex &sccIndex){
+    unsigned useSCC = UINT_MAX;
+    auto addUsers = [&](Instruction *V){
+        for(User *user : V->users()){
+            auto idx = sccIndex.find(cast<Instruction>(user)->getParent());
+            useSCC = idx == sccIndex.end() ? 0 : min(useSCC, idx->second);
+            if(!useSCC){return;}
+        }
+    };
+    addUsers(I);
+    for(Instruction *searchI : searchList){addUsers(searchI);}
+    return useSCC;
+}
+static int usedAfter(Instruction *I, Instruction *I_current, const RegAssignment &RA,
+    const SCCIndex &sccIndex, bool selfFlag=true){
     if (I == nullptr) { return 0; }
     vector<Instruction*> searchList;
     vector<int> distanceList;
     // searchList.push_back(I);
-    for(User *user : I->users()){
-        if(CastInst *CI = dyn_cast<CastInst>(user)){
-            if(CI->getName().startswith(tempPrefix)){
-                searchList.push_back(CI);
+    // temp casts share the register of their source, chains included
+    vector<Instruction*> castWorkList = {I};
+    while(!castWorkList.empty()){
+        Instruction *castSrc = castWorkList.back();
+        castWorkList.pop_back();
+        for(User *user : castSrc->users()){
+            if(CastInst *CI = dyn_cast<CastInst>(user)){
+                if(RA.isFolded(CI)){
+                    searchList.push_back(CI);
+                    castWorkList.push_back(CI);
+                }
             }
         }
     }
     Instruction *trueForm = selfFlag? I : nullptr;
-    if(int dis = _usedAfter(I, I_current, tempPrefix, trueForm)){
+    unsigned useSCC = getUseSCC(I, searchList, sccIndex);
+    if(int dis = _usedAfter(I, I_current, trueForm, sccIndex, useSCC)){
         distanceList.push_back(dis);
     }
     for(Instruction *searchI : searchList){
-        if(int dis = _usedAfter(searchI, I_current, tempPrefix, trueForm)){
+        if(int dis = _usedAfter(searchI, I_current, trueForm, sccIndex, useSCC)){
             distanceList.push_back(dis);
         }
     }
@@ -139,26 +220,32 @@ static unsigned int align(unsigned int num, int align=8){
 }
 
 // A simple namer. :)
-// Borrowed from SimpleBackend
+// Borrowed from SimpleBackend. Only the blocks need names, the registers
+// of the values are kept in the RegAssignment.
 class InstNamer : public InstVisitor<InstNamer> {
 public:
   void visitFunction(Function &F) {
-    for (auto &Arg : F.args())
-      if (!Arg.hasName())
-        Arg.setName("arg");
-
     for (BasicBlock &BB : F) {
       if (!BB.hasName()){
           BB.setName(&F.getEntryBlock() == &BB ? ".entry" : ".bb");
       }else if(!BB.getName().startswith(".")){
           BB.setName("."+BB.getName());
       }
+    }
+  }
+};
 
-      for (Instruction &I : BB){
-        if (!I.hasName() && !I.getType()->isVoidTy()){
-          I.setName("tmp");
-        }
-      }
+// Comments each instruction of the depromoted module with what the emitter
+// makes of it: the register it is in, or folded into its users.
+class RegAnnotator : public AssemblyAnnotationWriter {
+  const RegAssignment &assignment;
+public:
+  RegAnnotator(const RegAssignment &assignment): assignment(assignment){}
+  void printInfoComment(const Value &V, formatted_raw_ostream &OS) override {
+    if (assignment.isFolded(&V)){
+        OS << " ; folded";
+    }else if (unsigned reg = assignment.getReg(&V)){
+        OS << " ; r" << reg;
     }
   }
 };
@@ -181,36 +268,127 @@ public:
   }
 };
 
+// The slots of the stack frame and the gaps left between them. Gaps are
+// kept both by where they start, to merge them with the slots freed next
+// to them, and for each alignment by the room left once aligned, for the
+// smallest one a value fits in.
+// A slot is freed at the first spill after its last use. Each slot waits
+// on the next use found for it and is only searched again once a spill
+// passes that use, or comes in another block.
 class LessSimpleBackend::StackFrame{
-    vector<pair<Instruction*, int>> frame;
+    // offset and size of each slot in use
+    DenseMap<Instruction*, pair<int, int>> slots;
+    map<int, int> gaps;
+    // room and start of the gaps, by the alignment the room is counted for
+    map<int, set<pair<int, int>>> gapsByAlignment;
+    // where the last slot in use ends; the frame is free from there on
+    int frameEnd = 0;
+    // the slots put since the last spill
+    vector<Instruction*> unchecked;
+    // the slots used next at an instruction of checkedBlock, and those only
+    // used after it
+    DenseMap<Instruction*, vector<Instruction*>> usedAt;
+    vector<Instruction*> usedAfterBlock;
+    BasicBlock *checkedBlock = nullptr;
+    Instruction *checkedPoint = nullptr;
     Function *F;
     LessSimpleBackend *Backend;
     int maxStackSize = 0;
-    void mergeEmpty(){
-        for(int i = 1; i < frame.size(); i++){
-            auto content = frame[i];
-            if(content.first == nullptr &&
-                frame[i-1].first == nullptr){
-                frame[i] = pair(nullptr, content.second+frame[i-1].second);
-                frame[i-1] = pair(nullptr, 0);
-            }
+    static int getRoom(int begin, int end, int alignment){
+        return end - (int)align(begin, alignment);
+    }
+    void addGap(int begin, int end){
+        if(begin >= end){return;}
+        gaps[begin] = end;
+        for(auto &[alignment, gapSet] : gapsByAlignment){
+            gapSet.insert({getRoom(begin, end, alignment), begin});
+        }
+    }
+    map<int, int>::iterator removeGap(map<int, int>::iterator gap){
+        for(auto &[alignment, gapSet] : gapsByAlignment){
+            gapSet.erase({getRoom(gap->first, gap->second, alignment), gap->first});
         }
-        for(auto content = frame.begin(); content != frame.end(); content++){
-            if(content->second == 0){
-                frame.erase(content);
+        return gaps.erase(gap);
+    }
+    set<pair<int, int>> &getGapsByAlignment(int alignment){
+        auto [gapSet, inserted] = gapsByAlignment.try_emplace(alignment);
+        if(inserted){
+            for(auto [begin, end] : gaps){
+                gapSet->second.insert({getRoom(begin, end, alignment), begin});
             }
         }
+        return gapSet->second;
+    }
+    void freeSlot(Instruction *I){
+        auto [begin, size] = slots.lookup(I);
+        int end = begin + size;
+        slots.erase(I);
+        auto next = gaps.lower_bound(begin);
+        if(next != gaps.end() && next->first == end){
+            end = next->second;
+            next = removeGap(next);
+        }
+        if(next != gaps.begin() && prev(next)->second == begin){
+            begin = prev(next)->first;
+            removeGap(prev(next));
+        }
+        if(end == frameEnd){
+            frameEnd = begin;
+        }else{
+            addGap(begin, end);
+        }
+    }
+    // Frees I if it is not used after I_current, or else waits for the use.
+    void checkSlot(Instruction *I, Instruction *I_current){
+        int dis = usedAfter(I, I_current, Backend->getAssignment(),
+                            Backend->getSCCIndex(), false);
+        if(!dis){
+            freeSlot(I);
+            return;
+        }
+        // the search counts I_current as 1 and goes past the block only
+        // after its last instruction but the terminator
+        Instruction *use = I_current;
+        for(int i = 1; i < dis && !use->isTerminator(); i++){
+            use = use->getNextNode();
+        }
+        if(use->isTerminator()){
+            usedAfterBlock.push_back(I);
+        }else{
+            usedAt[use].push_back(I);
+        }
     }
     void tryDumpRedundant(Instruction *I_current){
-        for(int i = 0; i < frame.size(); i++){
-            if(frame[i].first == nullptr){
-                continue;
+        vector<Instruction*> toCheck;
+        toCheck.swap(unchecked);
+        Instruction *walker = nullptr;
+        if(I_current->getParent() == checkedBlock){
+            walker = checkedPoint;
+        }
+        for(; walker && walker != I_current; walker = walker->getNextNode()){
+            auto waiting = usedAt.find(walker);
+            if(waiting != usedAt.end()){
+                toCheck.insert(toCheck.end(), waiting->second.begin(),
+                               waiting->second.end());
+                usedAt.erase(waiting);
             }
-            if(!usedAfter(frame[i].first, I_current, Backend->getTempPrefix(), false)){
-                frame[i].first = nullptr;
+        }
+        // in another block, or back in this one, every slot is searched again
+        if(!walker){
+            for(auto &waiting : usedAt){
+                toCheck.insert(toCheck.end(), waiting.second.begin(),
+                               waiting.second.end());
             }
+            toCheck.insert(toCheck.end(), usedAfterBlock.begin(),
+                           usedAfterBlock.end());
+            usedAt.clear();
+            usedAfterBlock.clear();
+        }
+        checkedBlock = I_current->getParent();
+        checkedPoint = I_current;
+        for(Instruction *I : toCheck){
+            checkSlot(I, I_current);
         }
-        mergeEmpty();
     }
 public:
     StackFrame(Function *F_in, LessSimpleBackend *Backend):
@@ -221,9 +399,7 @@ public:
     }
     int putOnStack(Instruction* I, Instruction *I_current, bool dumpFlag=true, int size=-1, int alignment=-1){
         int offset = findOnStack(I);
-        if(offset < 0){
-            offset = 0;
-        }else{
+        if(offset >= 0){
             return offset;
         }
         if(dumpFlag){
@@ -235,80 +411,60 @@ public:
         if(alignment <= 0){
             alignment = size;
         }
-        bool onStackFlag = false;
-        for(int i = 0; i < frame.size(); i++){
-            int comPos = align(offset, alignment);
-            auto content = frame[i];
-            if(content.first==nullptr){
-                int emptyBegin = comPos;
-                int emptyEnd = offset + content.second;
-                int emptySize = emptyEnd - emptyBegin;
-                if(emptySize >= size){
-                    frame[i] = pair(I, size);
-                    if(emptySize > size){
-                        frame.insert(frame.begin()+i+1, pair(nullptr, emptySize-size));
-                    }
-                    if(emptyBegin > offset){
-                        frame.insert(frame.begin()+i, pair(nullptr, emptyBegin-offset));
-                    }
-                    onStackFlag = true;
-                    offset = emptyBegin;
-                    break;
-                }
-            }
-            offset += content.second;
-        }
-        if(!onStackFlag){
-            int comPos = align(offset, alignment);
-            auto new_content = pair(I, size);
-            if(comPos > offset){
-                frame.push_back(pair(nullptr, comPos-offset));
-                offset = comPos;
-            }
-            frame.push_back(new_content);
-        }
+        // The gap with the least room the slot fits in, or else the end.
+        offset = align(frameEnd, alignment);
+        set<pair<int, int>> &gapSet = getGapsByAlignment(alignment);
+        auto gap = gapSet.lower_bound({size, INT_MIN});
+        if(gap != gapSet.end()){
+            auto fit = gaps.find(gap->second);
+            auto [begin, end] = *fit;
+            int comPos = align(begin, alignment);
+            removeGap(fit);
+            addGap(begin, comPos);
+            addGap(comPos + size, end);
+            offset = comPos;
+        }
+        if(offset >= frameEnd){
+            addGap(frameEnd, offset);
+            frameEnd = offset + size;
+        }
+        slots[I] = {offset, size};
+        unchecked.push_back(I);
         if(maxStackSize < offset + size){
             maxStackSize = offset + size;
         }
         return offset;
     }
     int findOnStack(Instruction* I){
-        int offset = 0;
-        for(int i = 0; i < frame.size(); i++){
-            if(frame[i].first == I){
-                return offset;
-            }
-            offset += frame[i].second;
-        }
-        return -1;
-    }
-    void printFrame(){
-        int offset = 0;
-        for(auto iter : frame){
-            string eleName = "nullptr";
-            if(iter.first!=nullptr){
-                eleName = iter.first->getName();
-            }
-            outs()<<to_string(offset)<<": "<<eleName+" "<<"\n";
-            offset += iter.second;
-        }
+        auto slot = slots.find(I);
+        return slot == slots.end() ? -1 : slot->second.first;
     }
     void replaceWith(Instruction *oldInst, Instruction *newInst){
-        for(int i = 0; i < frame.size(); i++){
-            if(frame[i].first == oldInst){
-                frame[i].first = newInst;
-                return;
-            }
+        auto slot = slots.find(oldInst);
+        if(slot == slots.end()){return;}
+        auto pos = slot->second;
+        slots.erase(slot);
+        slots[newInst] = pos;
+        // depAlloca replaces the alloca it has just put
+        replace(unchecked.begin(), unchecked.end(), oldInst, newInst);
+        if(checkedPoint == oldInst){
+            checkedPoint = newInst;
         }
     }
 };
 
 class LessSimpleBackend::Registers{
-    vector<Instruction*> regs;
-    vector<bool> syncFlags;
+    array<Instruction*, REG_SIZE_ALL> regs;
+    bitset<REG_SIZE_ALL> syncFlags;
     Function *F;
     LessSimpleBackend *Backend;
 public:
+    // What the registers hold and whether their stack slots hold the same.
+    // regAlloc keeps one for the end of every block.
+    struct State{
+        array<Instruction*, REG_SIZE_ALL> regs;
+        bitset<REG_SIZE_ALL> syncFlags;
+    };
     Instruction* getInst(int regPos){
         assert(regPos>0 && regPos<=REG_SIZE_ALL);
         return regs[regPos-1];
@@ -323,7 +479,8 @@ public:
             if(regs[i]==nullptr){
                 continue;
             }
-            if(!usedAfter(regs[i], I_current, Backend->getTempPrefix())){
+            if(!usedAfter(regs[i], I_current, Backend->getAssignment(),
+                          Backend->getSCCIndex())){
                 regs[i] = nullptr;
                 syncFlags[i] = true;
             }
@@ -340,7 +497,8 @@ public:
 
         std::vector<std::tuple<int, bool, int>> v;
         for (auto i : possibleRegNumSet) {
-            int d = usedAfter(regs[i-1], I_current, Backend->getTempPrefix());
+            int d = usedAfter(regs[i-1], I_current, Backend->getAssignment(),
+                              Backend->getSCCIndex());
             if (!d) { return i; }
             bool t = syncFlags[i-1];
             std::tuple<int, bool, int> tup = make_tuple(i, t, d);
@@ -369,10 +527,9 @@ public:
         Instruction *InsertBefore, int regNum){
         IRBuilder<> Builder(InsertBefore);
         Value *loadOperand = Backend->stackMap[IOnStack];
-        Instruction *newInst = Builder.CreateLoad(
-            loadOperand,
-            genRegName(IOnStack, regNum)
-        );
+        Instruction *newInst = Builder.CreateLoad(loadOperand, "");
+        Backend->assignment.setReg(newInst, regNum);
+        Backend->reloads.insert(newInst);
         regs[regNum-1] = IOnStack;
         syncFlags[regNum-1] = true;
         return newInst;
@@ -388,36 +545,35 @@ public:
         }
         IRBuilder<> Builder(InsertBefore);
         if(Backend->stackMap.count(IOnReg)==0){
+            // the alloca takes a use of the shared constant 1
+            lock_guard<mutex> lock(*Backend->contextLock);
             IRBuilder<> entryBuilder(InsertBefore->getFunction()->getEntryBlock().getFirstNonPHI());
             AllocaInst *loadOperand = entryBuilder.CreateAlloca(
-                IOnReg->getType(),
-                nullptr,
-                Backend->tempPrefix+"_ltf_"+IOnReg->getName()
+                IOnReg->getType()
             );
+            Backend->assignment.setFolded(loadOperand);
             Backend->stackMap[IOnReg] = loadOperand;
         }
-        Builder.CreateStore(
+        Backend->spillStores.insert(Builder.CreateStore(
             IOnReg,
             Backend->stackMap[IOnReg]
-        );
+        ));
         syncFlags[regNum-1] = true;
         regs[regNum-1] = nullptr;
     }
-    string genRegName(Instruction *I, int regNum){
-        return "r"+to_string(regNum)+"_"+I->getName().str();
-    }
     Registers(Function *F, LessSimpleBackend *Backend):
-        F(F),Backend(Backend),regs(vector<Instruction*>(REG_SIZE_ALL))
-        ,syncFlags(vector<bool>(REG_SIZE_ALL)){
+        F(F),Backend(Backend){
         for(int i = 0; i < regs.size(); i++){
             regs[i] = nullptr;
             syncFlags[i] = true;
         }
     }
-    Registers(tuple<Function*, LessSimpleBackend*, vector<Instruction*>, vector<bool>> save):
-        F(get<0>(save)),Backend(get<1>(save)),regs(get<2>(save)),syncFlags(get<3>(save)){}
-    tuple<Function*, LessSimpleBackend*, vector<Instruction*>, vector<bool>> getSave(){
-        return make_tuple<>(F, Backend, regs, syncFlags);
+    State getState(){
+        return {regs, syncFlags};
+    }
+    void setState(const State &state){
+        regs = state.regs;
+        syncFlags = state.syncFlags;
     }
     int findOnRegs(Instruction* I){
         for(int i = 0; i < REG_SIZE; i++){
@@ -439,10 +595,10 @@ public:
             outs()<<"r"<<i+1<<": "<<regName<<"\n";
         }
     }
-    vector<Instruction*> getRegs(){
+    array<Instruction*, REG_SIZE_ALL> getRegs(){
         return regs;
     }
-    vector<bool> getSyncFlags(){
+    bitset<REG_SIZE_ALL> getSyncFlags(){
         return syncFlags;
     }
 };
@@ -456,29 +612,69 @@ static string getUniqueFnName(string nameBase, Module &M){
     return nameBase;
 }
 
-static string getUniquePrefix(string nameBase, Module &M){
-    for(Function &F : M){
-        for(BasicBlock &BB : F){
-            for(Instruction &I : BB){
-                if(I.getName().startswith(nameBase)){
-                    return getUniquePrefix("_"+nameBase, M);
-                }
-            }
+void RegAssignment::setReg(const Value *V, unsigned reg){
+    regs[V] = reg;
+}
+
+unsigned RegAssignment::getReg(const Value *V) const{
+    auto it = regs.find(V);
+    return it == regs.end() ? 0 : it->second;
+}
+
+void RegAssignment::setFolded(const Value *V){
+    folded.insert(V);
+}
+
+bool RegAssignment::isFolded(const Value *V) const{
+    return folded.count(V);
+}
+
+void RegAssignment::replace(const Value *Old, const Value *New){
+    if(unsigned reg = getReg(Old)){
+        setReg(New, reg);
+    }
+    if(isFolded(Old)){
+        setFolded(New);
+    }
+    erase(Old);
+}
+
+void RegAssignment::erase(const Value *V){
+    regs.erase(V);
+    folded.erase(V);
+}
+
+void RegAssignment::clear(){
+    regs.clear();
+    folded.clear();
+}
+
+RegAssignment RegAssignment::split(const Function &F){
+    RegAssignment Part;
+    for(const BasicBlock &BB : F){
+        for(const Instruction &I : BB){
+            if(unsigned reg = getReg(&I)){Part.setReg(&I, reg);}
+            if(isFolded(&I)){Part.setFolded(&I);}
+            erase(&I);
         }
     }
-    return nameBase;
+    return Part;
 }
 
-static void renameArg(Argument &arg, int num){
-    arg.setName("__arg" + to_string(num)+"__");
+void RegAssignment::merge(RegAssignment &Other){
+    for(auto &[V, reg] : Other.regs){regs[V] = reg;}
+    folded.insert(Other.folded.begin(), Other.folded.end());
+    Other.clear();
 }
 
 Function *LessSimpleBackend::getSpOffset(){return spOffset;}
 Function *LessSimpleBackend::getRstH(){return rstH;}
 Function *LessSimpleBackend::getRstS(){return rstS;}
-string LessSimpleBackend::getTempPrefix(){return tempPrefix;}
+const RegAssignment &LessSimpleBackend::getAssignment(){return assignment;}
+const SCCIndex &LessSimpleBackend::getSCCIndex(){return sccIndex;}
 
 void LessSimpleBackend::removeInst(Instruction *I){
+    assignment.erase(I);
     I->removeFromParent();
     I->deleteValue();
 }
@@ -495,10 +691,10 @@ void LessSimpleBackend::loadOperands(
         for(int i = 0; i < I->getNumOperands(); i++){
             Value* operand = I->getOperand(i);
             if(CastInst *CI = dyn_cast<CastInst>(operand)){
-                operand = unCast(CI, tempPrefix);
+                operand = unCast(CI, assignment);
             }
             if(Instruction* operand_I = dyn_cast<Instruction>(operand)){
-                if(!operand_I->getName().startswith(tempPrefix)){
+                if(!assignment.isFolded(operand_I)){
                     relatedInstList.push_back(operand_I);
                     relatedInstMap[operand_I] = I->getOperand(i);
                 }
@@ -508,21 +704,22 @@ void LessSimpleBackend::loadOperands(
             int regNum = regs->findOnRegs(relatedInst);
             if(regNum > 0){
                 operandOnRegs.push_back(regNum);
-                if(!relatedInst->getName().startswith("r"+to_string(regNum)+"_")){
+                if(assignment.getReg(relatedInst) != regNum){
+                    lock_guard<mutex> lock(*contextLock);
                     IRBuilder<> Builder(I);
                     Instruction *regSwArg = relatedInst;
                     if(relatedInst->getType()!=Type::getInt64Ty(I->getContext())){
                         regSwArg = getCastInst(relatedInst, Type::getInt64Ty(I->getContext()), I);
-                        regSwArg->setName(tempPrefix+relatedInst->getName()+"_cast");
+                        assignment.setFolded(regSwArg);
                     }
                     CallInst *relocatedReg = Builder.CreateCall(
-                        regSwitch, {regSwArg},
-                        regs->genRegName(relatedInst, regNum)
+                        regSwitch, {regSwArg}
                     );
+                    assignment.setReg(relocatedReg, regNum);
                     Instruction *newOperand = relocatedReg;
                     if(relocatedReg->getType()!=relatedInstMap[relatedInst]->getType()){
                         newOperand = getCastInst(relocatedReg, relatedInstMap[relatedInst]->getType(), I);
-                        newOperand->setName(tempPrefix+relocatedReg->getName()+"_cast");
+                        assignment.setFolded(newOperand);
                     }
                     I->replaceUsesOfWith(relatedInstMap[relatedInst], newOperand);
                 }
@@ -550,33 +747,50 @@ void LessSimpleBackend::loadOperands(
             Value *oldOperand = relatedInstMap[IOnStack];
             if(newInst->getType() != oldOperand->getType()){
                 newInst = getCastInst(newInst, oldOperand->getType(), I);
-                newInst->setName(tempPrefix+oldOperand->getName()+"_cast");
+                assignment.setFolded(newInst);
             }
             I->replaceUsesOfWith(oldOperand, newInst);
             operandOnRegs.push_back(victimRegNum);
         }
 }
 
-static bool isUsedByItsTerminator(Instruction *I, string tempPrefix){
+static bool isUsedByItsTerminator(Instruction *I, const RegAssignment &RA){
     Instruction *term = I->getParent()->getTerminator();
     for(int i = 0; i < term->getNumOperands(); i++){
         Value *operandV = term->getOperand(i);
-        if(auto*CI = dyn_cast<CastInst>(operandV)){operandV=unCast(CI, tempPrefix);}
+        if(auto*CI = dyn_cast<CastInst>(operandV)){operandV=unCast(CI, RA);}
         if(I == operandV){return true;}
     }
     return false;
 }
 
+// Whether anything in I's block other than the terminator uses I, directly
+// or through the backend's casts.
+static bool isUsedBeforeItsTerminator(Instruction *I, const RegAssignment &RA){
+    for(User *U : I->users()){
+        Instruction *UI = dyn_cast<Instruction>(U);
+        if(!UI || UI->getParent() != I->getParent() || UI->isTerminator()){
+            continue;
+        }
+        if(!isa<CastInst>(UI) || !RA.isFolded(UI) ||
+            isUsedBeforeItsTerminator(UI, RA)){
+            return true;
+        }
+    }
+    return false;
+}
+
 bool LessSimpleBackend::putOnRegs(
     Instruction *I, vector<pair<Instruction*, int>> &evicRegs,
     vector<int> &operandOnRegs){
-    if((!I->hasName()) || I->getName().startswith(tempPrefix)){
+    if(I->getType()->isVoidTy() || assignment.isFolded(I)){
         return false;
     }
     vector<int> emptyOperandOnRegs;
     int victimRegNum;
     bool dumpFlag = false;
-    if(isUsedByItsTerminator(I, tempPrefix)){
+    if(isUsedByItsTerminator(I, assignment) &&
+        !isUsedBeforeItsTerminator(I, assignment)){
         victimRegNum = BR_REG;
     }else{
         if(dyn_cast<GetElementPtrInst>(I) || dyn_cast<SExtInst>(I)){
@@ -592,7 +806,7 @@ bool LessSimpleBackend::putOnRegs(
         }
     }
     regs->setInst(I, victimRegNum);
-    I->setName(regs->genRegName(I, victimRegNum));
+    assignment.setReg(I, victimRegNum);
     if(victimRegNum != BR_REG){
         regs->setInst(I, victimRegNum);
     }else if(I->isUsedOutsideOfBlock(I->getParent())){
@@ -606,15 +820,15 @@ void LessSimpleBackend::depAlloca(AllocaInst *AI){
     IRBuilder<> Builder(AI);
     Instruction *posOnStack = Builder.CreateCall(
         spOffset,
-        {ConstantInt::getSigned(IntegerType::getInt64Ty(AI->getContext()), offset)},
-        AI->getName()
+        {ConstantInt::getSigned(IntegerType::getInt64Ty(AI->getContext()), offset)}
     );
+    assignment.replace(AI, posOnStack);
     if(posOnStack->getType()!=AI->getType()){
         posOnStack = dyn_cast<Instruction>(Builder.CreateBitCast(
             posOnStack,
-            AI->getType(),
-            tempPrefix+AI->getName()+"_cast"
+            AI->getType()
         ));
+        assignment.setFolded(posOnStack);
     }
     AI->replaceAllUsesWith(posOnStack);
     frame->replaceWith(AI, posOnStack);
@@ -635,24 +849,22 @@ void LessSimpleBackend::depAlloca(Function &F){
     }
 }
 
-void LessSimpleBackend::regAlloc(BasicBlock &BB, set<BasicBlock*> &BBvisited){
-    if(BBvisited.count(&BB)){return;}
-    else{BBvisited.insert(&BB);}
-    vector<Instruction*> initRegs = regs->getRegs();
+void LessSimpleBackend::regAlloc(BasicBlock &BB){
+    auto initRegs = regs->getRegs();
     for(Instruction &I : BB){
-        if(I.getName().startswith(tempPrefix)){continue;}
+        if(assignment.isFolded(&I)){continue;}
         vector<pair<Instruction*, int>> evicRegs;
         vector<int> operandOnRegs;
         loadOperands(&I, evicRegs, operandOnRegs);
         putOnRegs(&I, evicRegs, operandOnRegs);
     }
-    vector<Instruction*> finalRegs = regs->getRegs();
+    auto finalRegs = regs->getRegs();
     for(int i = 0; i < REG_SIZE; i++){
         if(initRegs[i] != nullptr &&
             initRegs[i] != finalRegs[i] &&
-            usedAfter(initRegs[i], BB.getTerminator(), tempPrefix)){
+            usedAfter(initRegs[i], BB.getTerminator(), assignment, sccIndex)){
             if(finalRegs[i]!=nullptr &&
-                usedAfter(finalRegs[i], BB.getTerminator(), tempPrefix) &&
+                usedAfter(finalRegs[i], BB.getTerminator(), assignment, sccIndex) &&
                 stackMap.count(finalRegs[i])==0){
                 regs->storeToFrame(finalRegs[i], frame, BB.getTerminator(), i+1);
             }
@@ -665,7 +877,7 @@ void LessSimpleBackend::regAlloc(BasicBlock &BB, set<BasicBlock*> &BBvisited){
     for(int i = 0; i < BB.getTerminator()->getNumOperands(); i++){
         if(Instruction *br_cond = dyn_cast<Instruction>(BB.getTerminator()->getOperand(i))){
             if(CastInst *brcCI = dyn_cast<CastInst>(br_cond)){
-                br_cond = dyn_cast<Instruction>(unCast(brcCI, tempPrefix));
+                br_cond = dyn_cast<Instruction>(unCast(brcCI, assignment));
             }
             if(regs->findOnRegs(br_cond) > 0){break;}
             if(regs->getInst(BR_REG) != br_cond){
@@ -675,57 +887,125 @@ void LessSimpleBackend::regAlloc(BasicBlock &BB, set<BasicBlock*> &BBvisited){
             }
         }
     }
-
-    Registers *originalRegs = this->regs;
-    auto save = regs->getSave();
-    for(int i = 0; i < BB.getTerminator()->getNumSuccessors(); i++){
-        this->regs = new Registers(save);
-        regAlloc(*BB.getTerminator()->getSuccessor(i), BBvisited);
-        delete(this->regs);
-        this->regs = originalRegs;
-    }
 }
 
+// Blocks are allocated depth first from the entry, each starting with the
+// registers the block it was reached from left behind. The worklist holds
+// the blocks to go to with the index of that state, and a state is kept
+// once per block, so huge functions neither recurse nor copy much.
 void LessSimpleBackend::regAlloc(Function &F){
-    BasicBlock &BBE = F.getEntryBlock();
+    // SCCs come sinks first, so a block only reaches blocks of an SCC
+    // numbered as low as its own or lower. This keeps the search for the
+    // next use of a value from walking the rest of the function.
+    sccIndex.clear();
+    unsigned idx = 0;
+    for(auto SCC = scc_begin(&F); !SCC.isAtEnd(); ++SCC, ++idx){
+        for(BasicBlock *BB : *SCC){sccIndex[BB] = idx;}
+    }
+    vector<Registers::State> endStates = {regs->getState()};
+    vector<pair<BasicBlock*, unsigned>> worklist = {{&F.getEntryBlock(), 0}};
     set<BasicBlock*> BBvisited;
-    regAlloc(BBE, BBvisited);
+    while(!worklist.empty()){
+        auto [BB, stateIdx] = worklist.back();
+        worklist.pop_back();
+        if(!BBvisited.insert(BB).second){continue;}
+        regs->setState(endStates[stateIdx]);
+        regAlloc(*BB);
+        endStates.push_back(regs->getState());
+        // the first successor goes first, as it did when this recursed
+        Instruction *term = BB->getTerminator();
+        for(int i = term->getNumSuccessors()-1; i >= 0; i--){
+            worklist.push_back({term->getSuccessor(i), endStates.size()-1});
+        }
+    }
 }
 
-static int zeroPromiseLen(Value* V){
+static bool isNoopExt(CastInst *CI, ScalarEvolution &SE, unsigned depth=0);
+
+// Returns how many leading bits of the 64-bit register holding V are known
+// to be zero once V is emitted.
+static int zeroPromiseLen(Value* V, ScalarEvolution &SE, unsigned depth=0){
+    const DataLayout &DL = SE.getDataLayout();
+    if(!V->getType()->isIntegerTy() || depth > 6){return 0;}
+    int width = V->getType()->getIntegerBitWidth();
     if(dyn_cast<llvm::BinaryOperator>(V) ||
         dyn_cast<LoadInst>(V) ||
         dyn_cast<CmpInst>(V) ||
         dyn_cast<PHINode>(V)){
-        return 64-getAccessSize(V->getType());
+        KnownBits known = computeKnownBits(V, DL);
+        return 64-width+known.countMinLeadingZeros();
     }else if(ConstantInt *C = dyn_cast<ConstantInt>(V)){
-        int64_t content = C->getZExtValue();
-        int result = 64;
-        for(int i = 0; i < 64; i++){
-            if(content==0){return result;}
-            content = content>>1;
-            result--;
-        }
-        return result;
+        return 64-width+C->getValue().countLeadingZeros();
+    }else if(SelectInst *SI = dyn_cast<SelectInst>(V)){
+        return std::min(zeroPromiseLen(SI->getTrueValue(), SE, depth+1),
+                        zeroPromiseLen(SI->getFalseValue(), SE, depth+1));
+    }else if(ZExtInst *ZI = dyn_cast<ZExtInst>(V)){
+        int srcWidth = ZI->getSrcTy()->getIntegerBitWidth();
+        return std::max(64-srcWidth,
+                        zeroPromiseLen(ZI->getOperand(0), SE, depth+1));
+    }else if(SExtInst *SI = dyn_cast<SExtInst>(V)){
+        if(isNoopExt(SI, SE, depth+1)){
+            return zeroPromiseLen(SI->getOperand(0), SE, depth+1);
+        }
+        return 64-width;
+    }else if(TruncInst *TI = dyn_cast<TruncInst>(V)){
+        // trunc is a no-op, the register still holds the wider value
+        return zeroPromiseLen(TI->getOperand(0), SE, depth+1);
     }
     return 0;
 }
 
-void LessSimpleBackend::depCast(CastInst *CI){
-    if(dyn_cast<SExtInst>(CI)){return;}
-    if(dyn_cast<ZExtInst>(CI)){
-        Value *sourceV = CI->getOperand(0);
-        if(CastInst *sourceCI = dyn_cast<CastInst>(sourceV)){
-            sourceV = unCast(sourceCI, tempPrefix);
-        }
-        int zeroPromise = zeroPromiseLen(sourceV);
-        int zeroPromiseNeeded = 64 - getAccessSize(CI->getSrcTy());
-        if(zeroPromise < zeroPromiseNeeded){return;}
+static bool isKnownNonNegative(Value *V, ScalarEvolution &SE,
+    set<PHINode*> &assumed){
+    if(computeKnownBits(V, SE.getDataLayout()).isNonNegative()){return true;}
+    // loop indices usually need the range of the induction variable
+    if(SE.isSCEVable(V->getType()) &&
+        SE.isKnownNonNegative(SE.getSCEV(V))){return true;}
+    // Unrolled loops step their index through a chain of nsw adds, which
+    // SCEV does not see through. Prove it by induction instead: a phi is
+    // non-negative if all its incoming values are, given that it is.
+    if(assumed.size() > 8){return false;}
+    if(PHINode *PI = dyn_cast<PHINode>(V)){
+        if(!assumed.insert(PI).second){return true;}
+        for(Value *inValue : PI->incoming_values()){
+            if(!isKnownNonNegative(inValue, SE, assumed)){return false;}
+        }
+        return true;
+    }
+    BinaryOperator *BO = dyn_cast<BinaryOperator>(V);
+    if(BO && BO->getOpcode() == Instruction::Add && BO->hasNoSignedWrap()){
+        return isKnownNonNegative(BO->getOperand(0), SE, assumed) &&
+            isKnownNonNegative(BO->getOperand(1), SE, assumed);
+    }
+    return false;
+}
+
+static bool isKnownNonNegative(Value *V, ScalarEvolution &SE){
+    set<PHINode*> assumed;
+    return isKnownNonNegative(V, SE, assumed);
+}
+
+// zext needs its source to be zero above the source width, sext additionally
+// needs the sign bit of the source to be zero. Otherwise the extension has to
+// be emitted as and / mul+ashr.
+static bool isNoopExt(CastInst *CI, ScalarEvolution &SE, unsigned depth){
+    Value *sourceV = CI->getOperand(0);
+    int zeroPromiseNeeded = 64 - CI->getSrcTy()->getIntegerBitWidth();
+    if(zeroPromiseLen(sourceV, SE, depth) < zeroPromiseNeeded){return false;}
+    if(dyn_cast<SExtInst>(CI)){
+        return isKnownNonNegative(sourceV, SE);
+    }
+    return true;
+}
+
+void LessSimpleBackend::depCast(CastInst *CI, ScalarEvolution &SE){
+    if(dyn_cast<SExtInst>(CI) || dyn_cast<ZExtInst>(CI)){
+        if(!isNoopExt(CI, SE)){return;}
     }
-    CI->setName(tempPrefix+CI->getName());
+    assignment.setFolded(CI);
 }
 
-void LessSimpleBackend::depCast(Function &F){
+void LessSimpleBackend::depCast(Function &F, ScalarEvolution &SE){
     vector<CastInst*> BCIList;
     for(BasicBlock &BB : F){
         for(Instruction &I : BB){
@@ -735,7 +1015,123 @@ void LessSimpleBackend::depCast(Function &F){
         }
     }
     for(CastInst *BCI : BCIList){
-        depCast(BCI);
+        depCast(BCI, SE);
+    }
+}
+
+// br jumps to its first target when the condition register is not zero, so
+// "icmp ne %v, 0" is not needed when %v has no garbage in its upper bits.
+// The branch then tests %v through a trunc, which depCast makes free.
+void LessSimpleBackend::depBrCond(BranchInst *BI, ScalarEvolution &SE){
+    Value *brCond = BI->getCondition();
+    if(!dyn_cast<ICmpInst>(brCond) && !dyn_cast<Constant>(brCond) &&
+        zeroPromiseLen(brCond, SE) < 63){
+        // e.g. a truncated i1, only its lowest bit counts
+        BI->setCondition(new ICmpInst(BI, ICmpInst::ICMP_NE, brCond,
+            ConstantInt::getFalse(BI->getContext()), "brcond"));
+        return;
+    }
+    ICmpInst *II = dyn_cast<ICmpInst>(brCond);
+    if(II == nullptr || !II->hasOneUse() || !II->isEquality()){return;}
+    Value *V = II->getOperand(0);
+    Value *zero = II->getOperand(1);
+    if(dyn_cast<Constant>(V)){std::swap(V, zero);}
+    ConstantInt *C = dyn_cast<ConstantInt>(zero);
+    if(C == nullptr || !C->isZero() || !V->getType()->isIntegerTy()){return;}
+    // a value in BR_REG cannot be used by anything but the terminator
+    if(!V->hasOneUse() || dyn_cast<Instruction>(V) == nullptr){return;}
+    int zeroPromiseNeeded = 64 - V->getType()->getIntegerBitWidth();
+    if(zeroPromiseLen(V, SE) < zeroPromiseNeeded){return;}
+    Value *cond = V;
+    if(!V->getType()->isIntegerTy(1)){
+        cond = new TruncInst(V, Type::getInt1Ty(BI->getContext()),
+                             V->getName()+"_brcond", BI);
+    }
+    if(II->getPredicate() == ICmpInst::ICMP_EQ){
+        BI->swapSuccessors();
+    }
+    BI->setCondition(cond);
+    removeInst(II);
+}
+
+// A branch on a constant or undef has no register to test, so it jumps
+// straight to the target the condition picks, the first one for undef.
+// Blocks nobody jumps to any more are deleted, as regAlloc never visits
+// them and their values would have no registers.
+void LessSimpleBackend::foldConstBrCond(Function &F){
+    vector<BranchInst*> BIList;
+    for(BasicBlock &BB : F){
+        BranchInst *BI = dyn_cast<BranchInst>(BB.getTerminator());
+        if(BI && BI->isConditional() &&
+            (isa<ConstantInt>(BI->getCondition()) ||
+             isa<UndefValue>(BI->getCondition()))){
+            BIList.push_back(BI);
+        }
+    }
+    if(BIList.empty()){return;}
+    for(BranchInst *BI : BIList){
+        ConstantInt *C = dyn_cast<ConstantInt>(BI->getCondition());
+        BasicBlock *taken = BI->getSuccessor(C && C->isZero() ? 1 : 0);
+        BasicBlock *notTaken = BI->getSuccessor(C && C->isZero() ? 0 : 1);
+        if(notTaken != taken){
+            notTaken->removePredecessor(BI->getParent());
+        }
+        BranchInst::Create(taken, BI);
+        removeInst(BI);
+    }
+    df_iterator_default_set<BasicBlock*> reachable;
+    for(BasicBlock *BB : depth_first_ext(&F, reachable)){(void)BB;}
+    vector<BasicBlock*> deadBlocks;
+    for(BasicBlock &BB : F){
+        if(reachable.count(&BB)){continue;}
+        for(Instruction &I : BB){
+            assignment.erase(&I);
+        }
+        deadBlocks.push_back(&BB);
+    }
+    DeleteDeadBlocks(deadBlocks);
+}
+
+void LessSimpleBackend::depBrCond(Function &F, ScalarEvolution &SE){
+    vector<BranchInst*> BIList;
+    for(BasicBlock &BB : F){
+        if(BranchInst *BI = dyn_cast<BranchInst>(BB.getTerminator())){
+            if(BI->isConditional()){
+                BIList.push_back(BI);
+            }
+        }
+    }
+    for(BranchInst *BI : BIList){
+        depBrCond(BI, SE);
+    }
+}
+
+// depPhi stores each incoming value at the end of its incoming block. On a
+// loop exit that block runs every iteration, so give the exit edge a block
+// of its own where the store runs once. An exit with no other predecessor
+// is left alone: SplitEdge would split it above its phis, which would then
+// name an incoming block that is no longer a predecessor.
+void LessSimpleBackend::splitExitEdges(Function &F, DominatorTree &DT,
+    LoopInfo &LI){
+    vector<pair<BasicBlock*, BasicBlock*>> edges;
+    for(BasicBlock &BB : F){
+        if(BB.phis().empty() || BB.getSinglePredecessor()){continue;}
+        for(BasicBlock *pred : predecessors(&BB)){
+            Loop *L = LI.getLoopFor(pred);
+            BranchInst *BI = dyn_cast<BranchInst>(pred->getTerminator());
+            if(L == nullptr || L->contains(&BB) ||
+                BI == nullptr || BI->isUnconditional()){continue;}
+            edges.push_back({pred, &BB});
+        }
+    }
+    for(auto &[from, to] : edges){
+        // LoopInfo is updated here rather than by SplitEdge, which would
+        // also merge the other exits of the loop into one block, with a
+        // phi of its own stored to in the loop again.
+        BasicBlock *newBB = SplitEdge(from, to, &DT);
+        Loop *L = LI.getLoopFor(from);
+        while(L != nullptr && !L->contains(to)){L = L->getParentLoop();}
+        if(L != nullptr){L->addBasicBlockToLoop(newBB, LI);}
     }
 }
 
@@ -752,25 +1148,33 @@ set<Instruction*> LessSimpleBackend::depPhi(Function &F){
         }
     }
     for(PHINode *PI : phiList){
+        // LCSSA phis and the like are plain copies, and a slot would be
+        // stored to in every iteration of the loop they leave
+        if(PI->getNumIncomingValues() == 1){
+            PI->replaceAllUsesWith(PI->getIncomingValue(0));
+            removeInst(PI);
+            continue;
+        }
         IRBuilder<> entryBuilder(F.getEntryBlock().getFirstNonPHI());
         IRBuilder<> Builder(PI);
-        AllocaInst *phiPos = entryBuilder.CreateAlloca(
-            PI->getType(),
-            nullptr,
-            tempPrefix+"pos_"+PI->getName()
-        );
+        AllocaInst *phiPos = entryBuilder.CreateAlloca(PI->getType());
+        assignment.setFolded(phiPos);
         LoadInst *newPI = Builder.CreateLoad(
             phiPos,
             PI->getName()
         );
+        phiCopies.insert(newPI);
         for(int i = 0; i < PI->getNumIncomingValues(); i++){
             Value* inValue = PI->getIncomingValue(i);
             BasicBlock* inBlock = PI->getIncomingBlock(i);
+            // e.g. the runtime unroller's remainder phis, nothing to store
+            if(dyn_cast<UndefValue>(inValue)){continue;}
             IRBuilder<> blockBuilder(inBlock->getTerminator());
             Instruction *storePI = blockBuilder.CreateStore(
                 inValue,
                 phiPos
             );
+            phiCopies.insert(storePI);
         }
         PI->replaceAllUsesWith(newPI);
         removeInst(PI);
@@ -793,18 +1197,20 @@ void LessSimpleBackend::phiUpdatePatch(set<Instruction*> &newPhiSet){
 void LessSimpleBackend::depGEP(GetElementPtrInst *GEPI){
     Value *ptr = GEPI->getOperand(0);
     if(CastInst *CI = dyn_cast<CastInst>(ptr)){
-        ptr = unCast(CI, tempPrefix);}
+        ptr = unCast(CI, assignment);}
     if(dyn_cast<AllocaInst>(ptr) ||
         dyn_cast<Constant>(ptr)){
-        if(ptr->hasName() && !(ptr->getName().startswith(tempPrefix))){return;}
+        // only the backend's own slots and constant addresses fold
+        if(isa<AllocaInst>(ptr) ? !assignment.isFolded(ptr) :
+            isa<GlobalValue>(ptr)){return;}
         for(int i = 1; i < GEPI->getNumOperands(); i++){
             Value *operandV = GEPI->getOperand(i);
             if(CastInst *CI = dyn_cast<CastInst>(operandV)){
-                operandV = unCast(CI, tempPrefix);}
+                operandV = unCast(CI, assignment);}
             if(Constant *C = dyn_cast<Constant>(operandV)){
             }else{return; }
         }
-        GEPI->setName(tempPrefix + GEPI->getName());
+        assignment.setFolded(GEPI);
     }
 }
 
@@ -822,7 +1228,7 @@ void LessSimpleBackend::depGEP(Function &F){
     }
 }
 
-void LessSimpleBackend::placeSpSub(Function &F){
+int LessSimpleBackend::placeSpSub(Function &F){
     BasicBlock &entryBlock = F.getEntryBlock();
     Instruction *entryInst = entryBlock.getFirstNonPHI();
     IRBuilder<> Builder(entryInst);
@@ -835,7 +1241,85 @@ void LessSimpleBackend::placeSpSub(Function &F){
         spSub,
         {ConstantInt::getSigned(IntegerType::getInt64Ty(F.getContext()), maxStackUsage)}
     );
+    return maxStackUsage;
+}
+
+namespace {
+// What depromotion added to some blocks: stores of values evicted from
+// their registers, loads of them back, values used from another register
+// than the one they were given, resets of the heads and the stores and
+// loads through which phis pass their values. Each is counted once in the
+// code and once weighted by how often its block is expected to run.
+struct SpillCounts{
+    enum Kind{Spill, Reload, RegSwitch, Reset, PhiCopy, NumKinds};
+    array<unsigned, NumKinds> count{};
+    array<double, NumKinds> weighted{};
+    void add(Kind kind, double freq){
+        count[kind]++;
+        weighted[kind] += freq;
+    }
+    void add(const SpillCounts &C){
+        for(int kind = 0; kind < NumKinds; kind++){
+            count[kind] += C.count[kind];
+            weighted[kind] += C.weighted[kind];
+        }
+    }
+};
+}
 
+// A table of the spill counts of F, then of each of its loops, nested
+// ones indented under the loops around them.
+string LessSimpleBackend::getSpillReport(Function &F, int frameSize){
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    DenseMap<BasicBlock*, SpillCounts> blockCounts;
+    SpillCounts total;
+    for(BasicBlock &BB : F){
+        double freq = pow(EXPECTED_TRIPS, LI.getLoopDepth(&BB));
+        SpillCounts &C = blockCounts[&BB];
+        for(Instruction &I : BB){
+            Function *callee = nullptr;
+            if(CallInst *CI = dyn_cast<CallInst>(&I)){
+                callee = CI->getCalledFunction();
+            }
+            if(spillStores.count(&I)){C.add(SpillCounts::Spill, freq);}
+            else if(reloads.count(&I)){C.add(SpillCounts::Reload, freq);}
+            else if(phiCopies.count(&I)){C.add(SpillCounts::PhiCopy, freq);}
+            else if(callee == regSwitch){C.add(SpillCounts::RegSwitch, freq);}
+            else if(callee && (callee == rstH || callee == rstS)){
+                C.add(SpillCounts::Reset, freq);
+            }
+        }
+        total.add(C);
+    }
+
+    string report;
+    raw_string_ostream OS(report);
+    OS << "; Spills of " << F.getName() << ", frame of " << frameSize
+       << " bytes, each count also weighted by expected runs\n";
+    OS << ";   " << left_justify("", 30);
+    for(StringRef kind : {"spills", "reloads", "reg switches", "resets",
+                          "phi copies"}){
+        OS << " " << right_justify(kind, 20);
+    }
+    OS << "\n";
+    auto printRow = [&](StringRef name, unsigned depth, const SpillCounts &C){
+        OS << ";   " << left_justify(string(depth*2, ' ') + name.str(), 30);
+        for(int kind = 0; kind < SpillCounts::NumKinds; kind++){
+            OS << format(" %7u %12.0f", C.count[kind], C.weighted[kind]);
+        }
+        OS << "\n";
+    };
+    printRow(F.getName(), 0, total);
+    for(Loop *L : LI.getLoopsInPreorder()){
+        SpillCounts C;
+        for(BasicBlock *BB : L->blocks()){
+            C.add(blockCounts[BB]);
+        }
+        printRow(L->getHeader()->getName(), L->getLoopDepth(), C);
+    }
+    OS.flush();
+    return report;
 }
 
 void LessSimpleBackend::depGV(){
@@ -852,9 +1336,10 @@ void LessSimpleBackend::depGV(){
             IntToPtrInst *ITPI = new IntToPtrInst(
                 ConstantInt::getSigned(IntegerType::getInt64Ty(userInst->getContext()), pos),
                 GV->getType(),
-                tempPrefix+"depGV_"+GV->getName(),
+                "",
                 userInst
             );
+            assignment.setFolded(ITPI);
             userInst->replaceUsesOfWith(GV, ITPI);
         }
     }
@@ -866,7 +1351,7 @@ int LessSimpleBackend::getAccessPos(Value *V){
     }else if(LoadInst *LI = dyn_cast<LoadInst>(V)){
         return getAccessPos(LI->getOperand(0));
     }else if(CastInst *CastI = dyn_cast<CastInst>(V)){
-        return getAccessPos(unCast(CastI, tempPrefix, true));
+        return getAccessPos(unCast(CastI, assignment, true));
     }else if(GetElementPtrInst *GEPI = dyn_cast<GetElementPtrInst>(V)){
         return getAccessPos(GEPI->getOperand(0));
     }else if(ConstantInt *CInt = dyn_cast<ConstantInt>(V)){
@@ -911,27 +1396,69 @@ int LessSimpleBackend::insertRst(BasicBlock &BB){
     return accessPos;
 }
 
-static int getPrevAccessPos(BasicBlock *BB, map<BasicBlock*, int> accessPosMap){
-    int accessPos = POS_UNINIT;
-    for(BasicBlock *predBlock : predecessors(BB)){
-        int prevAccessPos_temp = accessPosMap[predBlock];
-        if(prevAccessPos_temp == POS_UNINIT){
-            prevAccessPos_temp = getPrevAccessPos(predBlock, accessPosMap);
-        }
-        if(accessPos == POS_UNINIT){
-            accessPos = prevAccessPos_temp;
-        }
-        if(prevAccessPos_temp == POS_UNKNOWN ||
-            prevAccessPos_temp != accessPos){
-            return POS_UNKNOWN;
+// Where the last access before BB is when all its predecessors agree on it,
+// POS_UNKNOWN otherwise. A predecessor without accesses passes on what comes
+// into it, so this walks back through chains of such blocks; it does so
+// with its own stack, and remembers each block it has worked out in
+// prevAccessPosMap. A cycle of blocks without accesses counts as unknown.
+static int getPrevAccessPos(BasicBlock *BB,
+    const map<BasicBlock*, int> &accessPosMap,
+    map<BasicBlock*, int> &prevAccessPosMap){
+    auto known = prevAccessPosMap.find(BB);
+    if(known != prevAccessPosMap.end()){return known->second;}
+    struct Frame{
+        BasicBlock *BB;
+        pred_iterator nextPred;
+        int accessPos;
+    };
+    vector<Frame> stack = {{BB, pred_begin(BB), POS_UNINIT}};
+    prevAccessPosMap[BB] = POS_UNKNOWN;
+    // the result of the predecessor popped last, for the frame below it
+    int finished = POS_UNINIT;
+    while(true){
+        Frame &top = stack.back();
+        int result = POS_UNINIT;
+        if(finished == POS_UNINIT && top.nextPred == pred_end(top.BB)){
+            result = top.accessPos == POS_UNINIT ? POS_UNKNOWN : top.accessPos;
+        }else{
+            int prevAccessPos_temp = finished;
+            finished = POS_UNINIT;
+            if(prevAccessPos_temp == POS_UNINIT){
+                BasicBlock *predBlock = *top.nextPred;
+                auto it = accessPosMap.find(predBlock);
+                prevAccessPos_temp =
+                    it == accessPosMap.end() ? POS_UNKNOWN : it->second;
+                if(prevAccessPos_temp == POS_UNINIT){
+                    auto known = prevAccessPosMap.find(predBlock);
+                    if(known == prevAccessPosMap.end()){
+                        prevAccessPosMap[predBlock] = POS_UNKNOWN;
+                        stack.push_back({predBlock, pred_begin(predBlock), POS_UNINIT});
+                        continue;
+                    }
+                    prevAccessPos_temp = known->second;
+                }
+            }
+            ++top.nextPred;
+            if(top.accessPos == POS_UNINIT){
+                top.accessPos = prevAccessPos_temp;
+            }
+            if(prevAccessPos_temp == POS_UNKNOWN ||
+                prevAccessPos_temp != top.accessPos){
+                result = POS_UNKNOWN;
+            }
         }
+        if(result == POS_UNINIT){continue;}
+        prevAccessPosMap[top.BB] = result;
+        stack.pop_back();
+        if(stack.empty()){return result;}
+        finished = result;
     }
-    if(accessPos == POS_UNINIT){return POS_UNKNOWN;}
-    return accessPos;
 }
 
-void LessSimpleBackend::insertRst_first(BasicBlock &BB, map<BasicBlock*, int> accessPosMap){
-    int prevAccessPos = getPrevAccessPos(&BB, accessPosMap);
+void LessSimpleBackend::insertRst_first(BasicBlock &BB,
+    const map<BasicBlock*, int> &accessPosMap,
+    map<BasicBlock*, int> &prevAccessPosMap){
+    int prevAccessPos = getPrevAccessPos(&BB, accessPosMap, prevAccessPosMap);
     if(prevAccessPos == POS_UNKNOWN){return;}
     for(Instruction &I : BB){
         int currentAccess = POS_UNINIT;
@@ -960,8 +1487,9 @@ void LessSimpleBackend::insertRst(Function &F){
         int lastAccess = insertRst(BB);
         accessPosMap[&BB] = lastAccess;
     }
+    map<BasicBlock*, int> prevAccessPosMap;
     for(BasicBlock &BB : F){
-        insertRst_first(BB, accessPosMap);
+        insertRst_first(BB, accessPosMap, prevAccessPosMap);
     }
 }
 
@@ -984,7 +1512,7 @@ static Instruction* delayAllocaDFS(AllocaInst *AI, set<BasicBlock*> visitedBB, B
     return result;
 }
 
-static void _delayAlloca(AllocaInst *AI){
+static AllocaInst *_delayAlloca(AllocaInst *AI){
     set<BasicBlock*> visitedBB;
     Instruction *latestSafePos = delayAllocaDFS(AI, visitedBB);
     IRBuilder<> Builder(latestSafePos);
@@ -994,8 +1522,7 @@ static void _delayAlloca(AllocaInst *AI){
         AI->getName()
     );
     AI->replaceAllUsesWith(newAlloca);
-    AI->removeFromParent();
-    AI->deleteValue();
+    return newAlloca;
 }
 
 void LessSimpleBackend::delayAlloca(Function &F){
@@ -1003,31 +1530,70 @@ void LessSimpleBackend::delayAlloca(Function &F){
     for(BasicBlock &BB : F){
         for(Instruction &I : BB){
             if(AllocaInst *AI = dyn_cast<AllocaInst>(&I)){
-                if(AI->getName().startswith(tempPrefix)){
+                if(assignment.isFolded(AI)){
                     allocaInstList.push_back(AI);
                 }
             }
         }
     }
     for(AllocaInst *AI : allocaInstList){
-        _delayAlloca(AI);
+        assignment.replace(AI, _delayAlloca(AI));
+        removeInst(AI);
     }
 }
 
-void LessSimpleBackend::depromoteReg(Function &F){
-    for(int i = 1; i <= F.arg_size(); i++){
-        renameArg(*F.getArg(i-1), i);
-    }
+LessSimpleBackend::LessSimpleBackend(LessSimpleBackend &Module, Function &F,
+    mutex *contextLock):
+    jobs(1), cache(nullptr), stats(Module.stats), failed(nullptr),
+    assignment(Module.assignment.split(F)), printDepromotedModule(false),
+    printSpillStats(Module.printSpillStats), spOffset(Module.spOffset),
+    spSub(Module.spSub), rstH(Module.rstH), rstS(Module.rstS),
+    malloc(Module.malloc), main(Module.main), regSwitch(Module.regSwitch),
+    globalVarOnStackSize(Module.globalVarOnStackSize), regs(nullptr),
+    frame(nullptr), contextLock(contextLock) {}
+
+// Scalar evolution and the changes to the CFG take constants and value
+// handles from the LLVMContext, so this runs for one function at a time.
+void LessSimpleBackend::depromoteBeforeRegAlloc(Function &F){
     regs = new LessSimpleBackend::Registers(&F, this);
     frame = new LessSimpleBackend::StackFrame(&F, this);
-    depCast(F);
-    auto newPhiSet = depPhi(F);
-    depGEP(F);
-    regAlloc(F);
-    delayAlloca(F);
-    depAlloca(F);
-    insertRst(F);
-    placeSpSub(F);
+    auto phase = [&](StringRef name, auto run){
+        CompileStats::Timer T(stats, "backend", name, F.getName());
+        run();
+    };
+    // This changes the CFG the analyses below are built on.
+    phase("foldConstBrCond", [&]{ foldConstBrCond(F); });
+    DominatorTree DT(F);
+    LoopInfo LI(DT);
+    AssumptionCache AC(F);
+    TargetLibraryInfoImpl TLII(Triple(F.getParent()->getTargetTriple()));
+    TargetLibraryInfo TLI(TLII);
+    ScalarEvolution SE(F, TLI, AC, DT, LI);
+    phase("depBrCond", [&]{ depBrCond(F, SE); });
+    phase("depCast", [&]{ depCast(F, SE); });
+    phase("splitExitEdges", [&]{ splitExitEdges(F, DT, LI); });
+    phase("depPhi", [&]{ depPhi(F); });
+    phase("depGEP", [&]{ depGEP(F); });
+}
+
+// The stack slots, resets and frame take constants and calls of the helpers
+// too, so this is also done one function at a time.
+void LessSimpleBackend::depromoteAfterRegAlloc(Function &F){
+    auto phase = [&](StringRef name, auto run){
+        CompileStats::Timer T(stats, "backend", name, F.getName());
+        run();
+    };
+    phase("delayAlloca", [&]{ delayAlloca(F); });
+    phase("depAlloca", [&]{ depAlloca(F); });
+    phase("insertRst", [&]{ insertRst(F); });
+    int frameSize = 0;
+    phase("placeSpSub", [&]{ frameSize = placeSpSub(F); });
+    if(printSpillStats){
+        errs() << getSpillReport(F, frameSize);
+    }
+    spillStores.clear();
+    reloads.clear();
+    phiCopies.clear();
     delete(regs);
     delete(frame);
 }
@@ -1101,9 +1667,10 @@ void LessSimpleBackend::moveGVToStack() {
                     IntegerType::getInt64Ty(userInst->getContext()),
                     globalVarOnStackMap[GVPair.first]),
                 GVPair.first->getType(),
-                tempPrefix+"stackGV_"+GVPair.first->getName(),
+                "",
                 userInst
             );
+            assignment.setFolded(ITPI);
             userInst->replaceUsesOfWith(GVPair.first, ITPI);
         }
 
@@ -1141,16 +1708,37 @@ void LessSimpleBackend::buildGVMap(){
 
 }
 
-PreservedAnalyses LessSimpleBackend::run(Module &M, ModuleAnalysisManager &MAM){
-    if (verifyModule(M, &errs(), nullptr)){exit(1);}
+// The inliner and the code extractor mark where allocas are in use. SWPP
+// has nothing to emit for that.
+static void removeLifetimeMarkers(Module &M){
+    vector<Instruction*> markers;
+    for(Function &F : M){
+        for(BasicBlock &BB : F){
+            for(Instruction &I : BB){
+                if(I.isLifetimeStartOrEnd()){
+                    markers.push_back(&I);
+                }
+            }
+        }
+    }
+    for(Instruction *I : markers){
+        I->eraseFromParent();
+    }
+}
 
-    // First, name all instructions / arguments / etc.
+// What the functions share, done once before any of them: the block names,
+// the functions standing for the SWPP-only instructions and the globals.
+// Returns the names of those functions for the emitter.
+vector<string> LessSimpleBackend::prepareModule(Module &M){
+    // First, name all blocks.
+    assignment.clear();
     InstNamer Namer;
     Namer.visit(M);
 
     // Second, convert known constant expressions to instructions.
     ConstExprToInsts CEI;
     CEI.visit(M);
+    removeLifetimeMarkers(M);
 
     string rstHName = getUniqueFnName("__resetHeap", M);
     string rstSName = getUniqueFnName("__resetStack", M);
@@ -1167,8 +1755,6 @@ PreservedAnalyses LessSimpleBackend::run(Module &M, ModuleAnalysisManager &MAM){
     FunctionType *spSubTy = FunctionType::get(VoidTy, {I64Ty}, false);
     FunctionType *regSwitchTy = FunctionType::get(I64Ty, {I64Ty}, false);
 
-    tempPrefix = getUniquePrefix("temp_p_", M);
-
     rstH = Function::Create(rstTy, Function::ExternalLinkage, rstHName, M);
     rstS = Function::Create(rstTy, Function::ExternalLinkage, rstSName, M);
     spOffset = Function::Create(spOffsetTy, Function::ExternalLinkage, spOffsetName, M);
@@ -1195,33 +1781,171 @@ PreservedAnalyses LessSimpleBackend::run(Module &M, ModuleAnalysisManager &MAM){
     buildGVMap();
     depGV();
 
+    return { rstHName, rstSName, spOffsetName, spSubName, regSwitchName };
+}
+
+// What the backend makes of F depends on F as prepareModule left it, the
+// casts it folded there, the names of the functions standing for SWPP
+// instructions and, for main, the globals kept on its stack. Callees are
+// only called by name, which the IR of F already has.
+string LessSimpleBackend::getFunctionKey(Function &F,
+    ArrayRef<string> dummyFunctionName){
+    string IR;
+    raw_string_ostream IROS(IR);
+    F.print(IROS);
+    IROS.flush();
+    string folded;
+    for(BasicBlock &BB : F){
+        for(Instruction &I : BB){
+            folded += assignment.isFolded(&I) ? '1' : '0';
+        }
+    }
+    string names;
+    for(const string &name : dummyFunctionName){
+        names += name + " ";
+    }
+    string stackSize = &F == main ? to_string(globalVarOnStackSize) : "";
+    return cache->getKey("function", {IR, folded, names, stackSize});
+}
+
+PreservedAnalyses LessSimpleBackend::run(Module &M, ModuleAnalysisManager &MAM){
+    if (verifyModule(M, &errs(), nullptr)){
+        if(failed){*failed = true;}
+        return PreservedAnalyses::all();
+    }
+
+    vector<string> dummyFunctionName;
+    {
+        CompileStats::Timer T(stats, "backend", "prepareModule", M.getName());
+        dummyFunctionName = prepareModule(M);
+    }
+
+    // Functions found in the cache are left as they are; the depromoted
+    // module and the spill stats are only complete without it.
+    map<Function*, string> keys;
+    map<Function*, string> cachedBodies;
+    if(cache && !printDepromotedModule && !printSpillStats){
+        for(Function &F : M.getFunctionList()){
+            if(F.isDeclaration()){continue;}
+            keys[&F] = getFunctionKey(F, dummyFunctionName);
+            string body;
+            if(cache->lookup(keys[&F], body)){
+                cachedBodies[&F] = body;
+            }
+        }
+    }
+
+    // Each function is depromoted by a backend of its own. Register
+    // allocation, where most of the time goes, only reads the rest of the
+    // module, so it runs on jobs threads; what comes before and after it
+    // changes what the LLVMContext keeps and goes one function at a time.
+    vector<Function*> depromoted;
     for(Function &F : M.getFunctionList()){
-        if(!F.isDeclaration()){
-            depromoteReg(F);
+        if(!F.isDeclaration() && !cachedBodies.count(&F)){
+            depromoted.push_back(&F);
         }
     }
+    mutex contextMutex;
+    vector<unique_ptr<LessSimpleBackend>> shards;
+    for(Function *F : depromoted){
+        shards.push_back(unique_ptr<LessSimpleBackend>(
+            new LessSimpleBackend(*this, *F, &contextMutex)));
+        shards.back()->depromoteBeforeRegAlloc(*F);
+    }
+    unsigned numThreads = min<size_t>(jobs, depromoted.size());
+    if(numThreads <= 1){
+        for(size_t i = 0; i < depromoted.size(); i++){
+            CompileStats::Timer T(stats, "backend", "regAlloc",
+                                  depromoted[i]->getName());
+            shards[i]->regAlloc(*depromoted[i]);
+        }
+    }else{
+        // Timed for the module as a whole, like emission on threads.
+        CompileStats::Timer T(stats, "backend", "regAlloc", M.getName());
+        atomic<size_t> next(0);
+        auto work = [&](){
+            for(size_t i = next++; i < depromoted.size(); i = next++){
+                shards[i]->regAlloc(*depromoted[i]);
+            }
+        };
+        vector<thread> threads;
+        for(unsigned i = 1; i < numThreads; i++){
+            threads.emplace_back(work);
+        }
+        work();
+        for(thread &t : threads){
+            t.join();
+        }
+    }
+    for(size_t i = 0; i < depromoted.size(); i++){
+        shards[i]->depromoteAfterRegAlloc(*depromoted[i]);
+        assignment.merge(shards[i]->assignment);
+    }
+    shards.clear();
 
     if(printDepromotedModule){
-        outs() << M;
+        RegAnnotator Annotator(assignment);
+        M.print(outs(), &Annotator);
     }
 
 
-    // Now, let's emit assembly!
-    vector<std::string> dummyFunctionName = {
-        rstHName, rstSName, spOffsetName, spSubName, regSwitchName, tempPrefix };
+    // Now, let's emit assembly! The emitter only reads the module, so that
+    // can be spread over jobs threads.
     error_code EC;
-    raw_ostream *os =
-        outputFile == "-" ? &outs() : new raw_fd_ostream(outputFile, EC);
+    unique_ptr<raw_fd_ostream> file;
+    if(outputFile != "-"){
+        file = make_unique<raw_fd_ostream>(outputFile, EC);
+    }
+    raw_ostream *os = file ? file.get() : &outs();
 
     if (EC) {
         errs() << "Cannot open file: " << outputFile << "\n";
-        exit(1);
+        if(failed){*failed = true;}
+        return PreservedAnalyses::all();
     }
 
-    NewAssemblyEmitter Emitter(os, dummyFunctionName);
-    Emitter.run(&M);
-
-    if (os != &outs()) delete os;
+    NewAssemblyEmitter Emitter(os, dummyFunctionName, assignment, jobs);
+    if(keys.empty() && !stats){
+        Emitter.run(&M);
+    }else{
+        // Functions are timed one by one only if they are emitted one at a
+        // time; on threads, emission is timed for the module as a whole.
+        vector<Function*> uncached;
+        for(Function &F : M.getFunctionList()){
+            if(!F.isDeclaration() && !cachedBodies.count(&F)){
+                uncached.push_back(&F);
+            }
+        }
+        map<Function*, string> bodies;
+        if(jobs > 1){
+            CompileStats::Timer T(stats, "backend", "emission", M.getName());
+            vector<string> emitted = Emitter.emit(uncached);
+            for(size_t i = 0; i < uncached.size(); i++){
+                bodies[uncached[i]] = move(emitted[i]);
+            }
+        }else{
+            for(Function *F : uncached){
+                CompileStats::Timer T(stats, "backend", "emission", F->getName());
+                bodies[F] = Emitter.emit(*F);
+            }
+        }
+        for(Function *F : uncached){
+            if(keys.count(F)){cache->store(keys[F], bodies[F]);}
+        }
+        for(Function &F : M.getFunctionList()){
+            if(F.isDeclaration()){continue;}
+            *os << (cachedBodies.count(&F) ? cachedBodies[&F] : bodies[&F]);
+        }
+    }
 
+    if(file){
+        file->close();
+        if(file->has_error()){
+            errs() << "Cannot write file: " << outputFile << ": "
+                   << file->error().message() << "\n";
+            file->clear_error();
+            if(failed){*failed = true;}
+        }
+    }
     return PreservedAnalyses::all();
 }
@@ -0,0 +1,216 @@
+#include "LoopFusion.h"
+#include "LoopNest.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+
+using namespace llvm;
+using namespace std;
+
+// Straight-line blocks allowed between the two loops.
+#define MAX_BLOCKS_BETWEEN 4
+
+// The blocks control goes through from the exit of L1 to the header of
+// the next loop, if they only branch and compute values that can as well
+// be computed before L1.
+static Loop *getNextLoop(Loop *L1, LoopInfo &LI,
+                         vector<BasicBlock*> &Between) {
+  BasicBlock *BB = L1->getExitBlock();
+  while (BB && Between.size() < MAX_BLOCKS_BETWEEN) {
+    if (Loop *L2 = LI.getLoopFor(BB)) {
+      if (L2->getHeader() != BB || L2->getParentLoop() != L1->getParentLoop()
+          || Between.empty())
+        return nullptr;
+      return L2;
+    }
+    auto *Br = dyn_cast<BranchInst>(BB->getTerminator());
+    if (!BB->getSinglePredecessor() || !Br || Br->isConditional())
+      return nullptr;
+    for (Instruction &I : *BB)
+      if (isa<PHINode>(I) || I.mayReadOrWriteMemory() ||
+          I.mayHaveSideEffects())
+        return nullptr;
+    Between.push_back(BB);
+    BB = Br->getSuccessor(0);
+  }
+  return nullptr;
+}
+
+// Calls to the library only do I/O or hand out new memory; anything else
+// may touch any memory.
+static bool isIOCall(CallBase *CB) {
+  Function *Callee = CB->getCalledFunction();
+  return Callee && Callee->isDeclaration() && Callee->getName() != "free";
+}
+
+// Whether running the iterations of L2 right after the same iterations of
+// L1 keeps the meaning: nothing L2 does at iteration i may depend on, or
+// be overwritten by, what L1 does at a later iteration.
+static const char *getFusionBlocker(const CountedLoop &CL1,
+                                    const CountedLoop &CL2, AAResults &AA,
+                                    ScalarEvolution &SE) {
+  vector<Instruction*> Mem[2];
+  bool hasCalls[2] = {false, false}, hasUnknownCalls[2] = {false, false};
+  const CountedLoop *CLs[2] = {&CL1, &CL2};
+  for (int Idx = 0; Idx < 2; ++Idx) {
+    for (BasicBlock *BB : CLs[Idx]->L->blocks()) {
+      for (Instruction &I : *BB) {
+        if (auto *CB = dyn_cast<CallBase>(&I)) {
+          hasCalls[Idx] = true;
+          hasUnknownCalls[Idx] |= !isIOCall(CB);
+        } else if (isa<LoadInst>(I) || isa<StoreInst>(I)) {
+          Mem[Idx].push_back(&I);
+        } else if (I.mayReadOrWriteMemory()) {
+          hasUnknownCalls[Idx] = true;
+        }
+      }
+    }
+  }
+  if (hasCalls[0] && hasCalls[1])
+    return "both loops call functions";
+  if ((hasUnknownCalls[0] && (!Mem[1].empty() || hasCalls[1])) ||
+      (hasUnknownCalls[1] && (!Mem[0].empty() || hasCalls[0])))
+    return "a call may touch the memory of the other loop";
+
+  for (Instruction *A1 : Mem[0]) {
+    for (Instruction *A2 : Mem[1]) {
+      if (!isa<StoreInst>(A1) && !isa<StoreInst>(A2))
+        continue;
+      if (AA.isNoAlias(MemoryLocation::get(A1), MemoryLocation::get(A2)))
+        continue;
+      // Both addresses move by the same stride, and L2 only gets to an
+      // element after L1 is done with it.
+      auto *R1 = dyn_cast<SCEVAddRecExpr>(
+          SE.getSCEV(getLoadStorePointerOperand(A1)));
+      auto *R2 = dyn_cast<SCEVAddRecExpr>(
+          SE.getSCEV(getLoadStorePointerOperand(A2)));
+      if (!R1 || !R2 || !R1->isAffine() || !R2->isAffine() ||
+          R1->getLoop() != CL1.L || R2->getLoop() != CL2.L ||
+          R1->getStepRecurrence(SE) != R2->getStepRecurrence(SE))
+        return "a memory dependence between the loops";
+      auto *Step = dyn_cast<SCEVConstant>(R1->getStepRecurrence(SE));
+      auto *Dist = dyn_cast<SCEVConstant>(
+          SE.getMinusSCEV(R2->getStart(), R1->getStart()));
+      if (!Step || !Dist || Step->getAPInt().isNullValue())
+        return "a memory dependence between the loops";
+      int64_t step = Step->getAPInt().getSExtValue();
+      int64_t dist = Dist->getAPInt().getSExtValue();
+      if (dist % step != 0 || dist / step > 0)
+        return "a memory dependence between the loops";
+    }
+  }
+  return nullptr;
+}
+
+// Makes the body of L2 run right after the body of L1 in each iteration,
+// under the header of L1. The values computed between the loops move in
+// front of L1.
+static void fuse(const CountedLoop &CL1, const CountedLoop &CL2,
+                 ArrayRef<BasicBlock*> Between) {
+  BasicBlock *Preheader1 = CL1.L->getLoopPreheader();
+  BasicBlock *Header1 = CL1.L->getHeader(), *Header2 = CL2.L->getHeader();
+  BasicBlock *Latch1 = CL1.L->getLoopLatch();
+  BasicBlock *Latch2 = CL2.L->getLoopLatch();
+  BasicBlock *Preheader2 = Between.back();
+  auto *Br2 = cast<BranchInst>(Header2->getTerminator());
+  BasicBlock *Body2 = Br2->getSuccessor(0), *Exit2 = Br2->getSuccessor(1);
+
+  for (BasicBlock *BB : Between)
+    while (BB->size() > 1)
+      BB->front().moveBefore(Preheader1->getTerminator());
+
+  CL2.IV->replaceAllUsesWith(CL1.IV);
+  for (PHINode &PN : Header1->phis())
+    PN.setIncomingBlock(PN.getBasicBlockIndex(Latch1), Latch2);
+  vector<PHINode*> Carried;
+  for (PHINode &PN : Header2->phis())
+    if (&PN != CL2.IV)
+      Carried.push_back(&PN);
+  for (PHINode *PN : Carried) {
+    PN->setIncomingBlock(PN->getBasicBlockIndex(Preheader2), Preheader1);
+    PN->moveBefore(Header1->getFirstNonPHI());
+  }
+  for (PHINode &PN : Exit2->phis())
+    PN.setIncomingBlock(PN.getBasicBlockIndex(Header2), Header1);
+
+  Latch1->getTerminator()->replaceUsesOfWith(Header1, Body2);
+  Latch2->getTerminator()->replaceUsesOfWith(Header2, Header1);
+  Header1->getTerminator()->replaceUsesOfWith(Between.front(), Exit2);
+  Br2->eraseFromParent();
+  CL2.Cmp->eraseFromParent();
+  new UnreachableInst(Header1->getContext(), Header2);
+
+  vector<BasicBlock*> Dead(Between.begin(), Between.end());
+  Dead.push_back(Header2);
+  DeleteDeadBlocks(Dead);
+  RecursivelyDeleteTriviallyDeadInstructions(CL2.Inc);
+}
+
+// Fuses adjacent loops over the same range. Each loop pays for its own
+// counter, compare and branches in every iteration, and the values both
+// bodies compute from the counter are computed once.
+PreservedAnalyses LoopFusion::run(Function &F, FunctionAnalysisManager &FAM) {
+  OptimizationRemarkEmitter ORE(&F);
+  bool changed = false, fused = true;
+  while (fused) {
+    fused = false;
+    LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+    AAResults &AA = FAM.getResult<AAManager>(F);
+    ScalarEvolution &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+    for (Loop *L1 : LI.getLoopsInPreorder()) {
+      vector<BasicBlock*> Between;
+      Loop *L2 = getNextLoop(L1, LI, Between);
+      CountedLoop CL1, CL2;
+      if (!L2 || !L1->getSubLoops().empty() || !L2->getSubLoops().empty() ||
+          !getCountedLoop(L1, L1, CL1, false) ||
+          !getCountedLoop(L2, L2, CL2, false) ||
+          CL1.Start != CL2.Start || CL1.Bound != CL2.Bound ||
+          CL1.Step != CL2.Step ||
+          CL1.Cmp->getPredicate() != CL2.Cmp->getPredicate() ||
+          Between.back() != L2->getLoopPreheader())
+        continue;
+
+      const char *Blocker = nullptr;
+      // L2 would see the values of L1 as they are in each iteration
+      // instead of the final ones.
+      for (BasicBlock *BB : L1->blocks())
+        for (Instruction &I : *BB)
+          for (User *U : I.users())
+            if (L2->contains(cast<Instruction>(U)) ||
+                is_contained(Between, cast<Instruction>(U)->getParent()))
+              Blocker = "the second loop uses values of the first";
+      BasicBlock *Body2 =
+          cast<BranchInst>(L2->getHeader()->getTerminator())->getSuccessor(0);
+      if (!Blocker && (!isa<BranchInst>(L1->getLoopLatch()->getTerminator()) ||
+                       isa<PHINode>(Body2->front())))
+        Blocker = "unsupported loop shape";
+      if (!Blocker)
+        Blocker = getFusionBlocker(CL1, CL2, AA, SE);
+      if (Blocker) {
+        ORE.emit([&]() {
+          return OptimizationRemarkMissed("loop-fusion", "NotFused",
+                                          L1->getStartLoc(), L1->getHeader())
+                 << L1->getHeader()->getName() << ": not fused with "
+                 << L2->getHeader()->getName() << ": " << Blocker;
+        });
+        continue;
+      }
+
+      ORE.emit([&]() {
+        return OptimizationRemark("loop-fusion", "Fused", L1->getStartLoc(),
+                                  L1->getHeader())
+               << L1->getHeader()->getName() << ": fused with "
+               << L2->getHeader()->getName();
+      });
+      fuse(CL1, CL2, Between);
+      FAM.invalidate(F, PreservedAnalyses::none());
+      changed = fused = true;
+      break;
+    }
+  }
+  if (!changed)
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
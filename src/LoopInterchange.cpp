@@ -0,0 +1,179 @@
+#include "LoopInterchange.h"
+#include "LoopNest.h"
+#include "SWPPCost.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include <algorithm>
+
+using namespace llvm;
+using namespace std;
+
+// Deepest nest whose orders are all tried (4! of them).
+#define MAX_NEST_DEPTH 4
+
+// Head travel of the nest in the given order. An access runs once per
+// iteration of the deepest loop whose counter it depends on, since LICM
+// hoists it out of the ones inside, and each run moves the head by its
+// stride in that loop.
+static double getTapeCost(ArrayRef<unsigned> Order,
+                          ArrayRef<CountedLoop> Levels,
+                          ArrayRef<NestAccess> Accesses) {
+  double cost = 0;
+  for (const NestAccess &A : Accesses) {
+    double iterations = 1, runs = 1, stride = 0;
+    for (unsigned Level : Order) {
+      const CountedLoop &CL = Levels[Level];
+      iterations *= getTripCount(CL);
+      auto It = A.LF.find(CL.IV);
+      if (It == A.LF.end() || It->second.C == 0)
+        continue;
+      runs = iterations;
+      stride = abs(It->second.C) * abs(CL.Step->getSExtValue()) *
+               (It->second.Sym ? EXPECTED_TRIPS : 1);
+    }
+    cost += runs * (COST_MEM + stride * COST_TRAVEL);
+  }
+  return cost;
+}
+
+static string getOrderName(ArrayRef<unsigned> Order,
+                           ArrayRef<CountedLoop> Levels) {
+  string Name = "(";
+  for (unsigned Level : Order) {
+    if (Name.size() > 1)
+      Name += ", ";
+    Name += Levels[Level].IV->getName().str();
+  }
+  return Name + ")";
+}
+
+// Makes the loop at each level run the range of Levels[Order[Level]]: the
+// counters trade starts, steps and bounds, and the body follows its
+// counter to the level it went to.
+static void reorderNest(ArrayRef<unsigned> Order,
+                        ArrayRef<CountedLoop> Levels) {
+  vector<vector<Use*>> BodyUses(Levels.size());
+  vector<ICmpInst::Predicate> Preds;
+  vector<bool> NSW, NUW;
+  for (unsigned Level = 0; Level < Levels.size(); ++Level) {
+    const CountedLoop &CL = Levels[Level];
+    for (Use &U : CL.IV->uses())
+      if (U.getUser() != CL.Cmp && U.getUser() != CL.Inc)
+        BodyUses[Level].push_back(&U);
+    Preds.push_back(CL.Cmp->getPredicate());
+    NSW.push_back(CL.Inc->hasNoSignedWrap());
+    NUW.push_back(CL.Inc->hasNoUnsignedWrap());
+  }
+
+  for (unsigned Level = 0; Level < Levels.size(); ++Level) {
+    const CountedLoop &CL = Levels[Level];
+    const CountedLoop &From = Levels[Order[Level]];
+    CL.IV->setIncomingValue(
+        CL.IV->getBasicBlockIndex(CL.L->getLoopPreheader()), From.Start);
+    CL.Inc->setOperand(1, From.Step);
+    CL.Inc->setHasNoSignedWrap(NSW[Order[Level]]);
+    CL.Inc->setHasNoUnsignedWrap(NUW[Order[Level]]);
+    CL.Cmp->setOperand(1, From.Bound);
+    CL.Cmp->setPredicate(Preds[Order[Level]]);
+    for (Use *U : BodyUses[Order[Level]])
+      U->set(CL.IV);
+  }
+}
+
+// Reorders perfect loop nests so that the inner loops walk memory with the
+// least head travel. SWPP has no cache, but each access moves the head
+// from the previous one, so a[j][i] in an inner j loop pays a row of
+// travel per access.
+PreservedAnalyses LoopInterchange::run(Function &F,
+                                       FunctionAnalysisManager &FAM) {
+  LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+  if (LI.empty())
+    return PreservedAnalyses::all();
+  AAResults &AA = FAM.getResult<AAManager>(F);
+  ScalarEvolution &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+  OptimizationRemarkEmitter ORE(&F);
+  const DataLayout &DL = F.getParent()->getDataLayout();
+
+  bool changed = false;
+  set<Loop*> visited;
+  for (Loop *Outermost : LI.getLoopsInPreorder()) {
+    if (visited.count(Outermost))
+      continue;
+    if (Outermost->getSubLoops().empty())
+      continue;
+    vector<CountedLoop> Levels = getPerfectNest(Outermost);
+    if (Levels.size() < 2 || Levels.size() > MAX_NEST_DEPTH) {
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed("loop-interchange", "NotPerfect",
+                                        Outermost->getStartLoc(),
+                                        Outermost->getHeader())
+               << Outermost->getHeader()->getName()
+               << ": not a perfect rectangular loop nest";
+      });
+      continue;
+    }
+    for (const CountedLoop &CL : Levels)
+      visited.insert(CL.L);
+
+    vector<NestAccess> Accesses;
+    vector<bool> Fixed(Levels.size(), false);
+    if (!getNestAccesses(Levels, DL, Accesses) ||
+        !getFixedLevels(Levels, Accesses, AA, SE, Fixed)) {
+      ORE.emit([&]() {
+        return OptimizationRemarkMissed("loop-interchange", "Dependence",
+                                        Outermost->getStartLoc(),
+                                        Outermost->getHeader())
+               << Outermost->getHeader()->getName()
+               << ": cannot reorder the loop body safely";
+      });
+      continue;
+    }
+
+    vector<unsigned> Order(Levels.size()), Best;
+    for (unsigned Level = 0; Level < Levels.size(); ++Level)
+      Order[Level] = Level;
+    vector<unsigned> Original = Order;
+    double bestCost = getTapeCost(Order, Levels, Accesses);
+    double originalCost = bestCost;
+    Best = Order;
+    while (next_permutation(Order.begin(), Order.end())) {
+      vector<unsigned> FixedOrder;
+      for (unsigned Level : Order)
+        if (Fixed[Level])
+          FixedOrder.push_back(Level);
+      if (!is_sorted(FixedOrder.begin(), FixedOrder.end()))
+        continue;
+      double cost = getTapeCost(Order, Levels, Accesses);
+      if (cost < bestCost) {
+        bestCost = cost;
+        Best = Order;
+      }
+    }
+
+    if (Best == Original) {
+      ORE.emit([&]() {
+        return OptimizationRemarkAnalysis("loop-interchange", "Kept",
+                                          Outermost->getStartLoc(),
+                                          Outermost->getHeader())
+               << Outermost->getHeader()->getName() << ": kept loop order "
+               << getOrderName(Best, Levels) << ", estimated cost "
+               << ore::NV("Cost", (unsigned)originalCost);
+      });
+      continue;
+    }
+    ORE.emit([&]() {
+      return OptimizationRemark("loop-interchange", "Interchanged",
+                                Outermost->getStartLoc(),
+                                Outermost->getHeader())
+             << Outermost->getHeader()->getName() << ": reordered loops "
+             << getOrderName(Original, Levels) << " as "
+             << getOrderName(Best, Levels) << ", estimated cost "
+             << ore::NV("Cost", (unsigned)originalCost) << " -> "
+             << ore::NV("NewCost", (unsigned)bestCost);
+    });
+    reorderNest(Best, Levels);
+    changed = true;
+  }
+  if (!changed)
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
@@ -0,0 +1,225 @@
+#include "LoopNest.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+
+using namespace llvm;
+using namespace std;
+
+bool getCountedLoop(Loop *L, Loop *Outermost, CountedLoop &CL,
+                    bool OnlyCounter) {
+  BasicBlock *Header = L->getHeader();
+  BasicBlock *Preheader = L->getLoopPreheader();
+  BasicBlock *Latch = L->getLoopLatch();
+  if (!Preheader || !Latch || L->getExitingBlock() != Header ||
+      (OnlyCounter && Header->size() != 3))
+    return false;
+  auto *Br = dyn_cast<BranchInst>(Header->getTerminator());
+  if (!Br || !Br->isConditional() || !L->contains(Br->getSuccessor(0)))
+    return false;
+  auto *Cmp = dyn_cast<ICmpInst>(Br->getCondition());
+  if (!Cmp || Cmp != Br->getPrevNode() || Cmp != Header->getFirstNonPHI() ||
+      !Cmp->hasOneUse())
+    return false;
+  auto *IV = dyn_cast<PHINode>(Cmp->getOperand(0));
+  if (!IV || IV->getParent() != Header)
+    return false;
+  auto *Inc = dyn_cast<BinaryOperator>(IV->getIncomingValueForBlock(Latch));
+  if (!Inc || Inc->getOpcode() != Instruction::Add ||
+      Inc->getOperand(0) != IV || (OnlyCounter && !Inc->hasOneUse()))
+    return false;
+  auto *Step = dyn_cast<ConstantInt>(Inc->getOperand(1));
+  Value *Start = IV->getIncomingValueForBlock(Preheader);
+  Value *Bound = Cmp->getOperand(1);
+  // In a nest, this keeps it rectangular; otherwise the inner ranges
+  // would change with the order.
+  if (!Step || Step->isZero() || !Outermost->isLoopInvariant(Start) ||
+      !Outermost->isLoopInvariant(Bound))
+    return false;
+  CL = {L, IV, Inc, Cmp, Start, Bound, Step};
+  return true;
+}
+
+double getTripCount(const CountedLoop &CL) {
+  auto *Start = dyn_cast<ConstantInt>(CL.Start);
+  auto *Bound = dyn_cast<ConstantInt>(CL.Bound);
+  if (!Start || !Bound)
+    return EXPECTED_TRIPS;
+  double trips = (double)(Bound->getSExtValue() - Start->getSExtValue()) /
+                 CL.Step->getSExtValue();
+  return max(1.0, trips);
+}
+
+vector<CountedLoop> getPerfectNest(Loop *Outermost) {
+  vector<CountedLoop> Levels;
+  for (Loop *L = Outermost;; L = L->getSubLoops().front()) {
+    CountedLoop CL;
+    if (!getCountedLoop(L, Outermost, CL) ||
+        CL.IV->getType() != Outermost->getHeader()->front().getType())
+      return {};
+    Levels.push_back(CL);
+    if (L->getSubLoops().empty())
+      break;
+    if (L->getSubLoops().size() != 1)
+      return {};
+    Loop *Inner = L->getSubLoops().front();
+    for (BasicBlock *BB : L->blocks()) {
+      if (BB == L->getHeader() || Inner->contains(BB))
+        continue;
+      for (Instruction &I : *BB)
+        if (&I != CL.Inc && !(isa<BranchInst>(I) &&
+                              cast<BranchInst>(I).isUnconditional()))
+          return {};
+    }
+  }
+  return Levels;
+}
+
+// Adds Scale * V to LF. Fails on anything that is not linear in the
+// counters of the nest.
+static bool addLinear(Value *V, Coef Scale, ArrayRef<CountedLoop> Levels,
+                      const DataLayout &DL, LinearForm &LF) {
+  Loop *Nest = Levels.front().L;
+  if (Nest->isLoopInvariant(V))
+    return true;
+  if (auto *PN = dyn_cast<PHINode>(V)) {
+    if (none_of(Levels, [&](const CountedLoop &CL) { return CL.IV == PN; }))
+      return false;
+    Coef &Cur = LF[PN];
+    if (Cur.C != 0 && Cur.Sym != Scale.Sym)
+      return false;
+    Cur.Sym = Scale.Sym;
+    Cur.C += Scale.C;
+    return true;
+  }
+  auto *I = cast<Instruction>(V);
+  switch (I->getOpcode()) {
+  case Instruction::ZExt:
+  case Instruction::SExt:
+  case Instruction::Trunc:
+  case Instruction::BitCast:
+    return addLinear(I->getOperand(0), Scale, Levels, DL, LF);
+  case Instruction::Add:
+    return addLinear(I->getOperand(0), Scale, Levels, DL, LF) &&
+           addLinear(I->getOperand(1), Scale, Levels, DL, LF);
+  case Instruction::Sub:
+    return addLinear(I->getOperand(0), Scale, Levels, DL, LF) &&
+           addLinear(I->getOperand(1), {Scale.Sym, -Scale.C}, Levels, DL, LF);
+  case Instruction::Mul:
+  case Instruction::Shl: {
+    Value *X = I->getOperand(0), *Y = I->getOperand(1);
+    if (I->getOpcode() == Instruction::Mul && Nest->isLoopInvariant(X))
+      swap(X, Y);
+    if (!Nest->isLoopInvariant(Y))
+      return false;
+    if (auto *K = dyn_cast<ConstantInt>(Y)) {
+      if (I->getOpcode() == Instruction::Shl && K->getZExtValue() >= 32)
+        return false;
+      int64_t k = I->getOpcode() == Instruction::Shl
+                      ? (int64_t)1 << K->getZExtValue() : K->getSExtValue();
+      return addLinear(X, {Scale.Sym, Scale.C * k}, Levels, DL, LF);
+    }
+    if (I->getOpcode() == Instruction::Shl || Scale.Sym)
+      return false;
+    return addLinear(X, {Y, Scale.C}, Levels, DL, LF);
+  }
+  case Instruction::GetElementPtr: {
+    auto *GEP = cast<GetElementPtrInst>(I);
+    if (!addLinear(GEP->getPointerOperand(), Scale, Levels, DL, LF))
+      return false;
+    for (auto GTI = gep_type_begin(GEP); GTI != gep_type_end(GEP); ++GTI) {
+      // Struct fields are constant offsets.
+      if (GTI.getStructTypeOrNull())
+        continue;
+      int64_t Size = DL.getTypeAllocSize(GTI.getIndexedType());
+      if (!addLinear(GTI.getOperand(), {Scale.Sym, Scale.C * Size}, Levels,
+                     DL, LF))
+        return false;
+    }
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+bool getNestAccesses(ArrayRef<CountedLoop> Levels, const DataLayout &DL,
+                     vector<NestAccess> &Accesses) {
+  Loop *Outermost = Levels.front().L;
+  for (BasicBlock *BB : Outermost->blocks()) {
+    for (Instruction &I : *BB) {
+      for (User *U : I.users())
+        if (!Outermost->contains(cast<Instruction>(U)))
+          return false;
+      if (isa<LoadInst>(I) || isa<StoreInst>(I)) {
+        auto *LI = dyn_cast<LoadInst>(&I);
+        auto *SI = dyn_cast<StoreInst>(&I);
+        NestAccess A{&I, {}};
+        if (!(LI ? LI->isSimple() : SI->isSimple()) ||
+            !addLinear(getLoadStorePointerOperand(&I), {nullptr, 1}, Levels,
+                       DL, A.LF))
+          return false;
+        Accesses.push_back(A);
+      } else if (I.mayReadOrWriteMemory() || I.mayHaveSideEffects()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Whether distinct values of the two counters always give distinct
+// addresses, as in a[i * n + j] with 0 <= j < n.
+static bool isInjective(const Coef &Big, const CountedLoop &Small,
+                        const Coef &SmallCoef) {
+  auto *Start = dyn_cast<ConstantInt>(Small.Start);
+  ICmpInst::Predicate Pred = Small.Cmp->getPredicate();
+  if (SmallCoef.Sym || !Start || !Start->isZero() || !Small.Step->isOne() ||
+      (Pred != ICmpInst::ICMP_ULT && Pred != ICmpInst::ICMP_SLT &&
+       Pred != ICmpInst::ICMP_NE))
+    return false;
+  if (Big.Sym)
+    return Big.Sym == Small.Bound && abs(Big.C) >= abs(SmallCoef.C);
+  auto *Bound = dyn_cast<ConstantInt>(Small.Bound);
+  return Bound && abs(Big.C) >= abs(SmallCoef.C) * Bound->getSExtValue();
+}
+
+bool getFixedLevels(ArrayRef<CountedLoop> Levels,
+                    ArrayRef<NestAccess> Accesses, AAResults &AA,
+                    ScalarEvolution &SE, vector<bool> &Fixed) {
+  for (const NestAccess &S : Accesses) {
+    if (!isa<StoreInst>(S.I))
+      continue;
+    // Alias analysis compares the accesses of one iteration only; asked
+    // about everything around the two pointers, it can only tell that
+    // they point into different objects, which holds for all iterations.
+    // Anything else on the object of a store must use the same address.
+    Value *Ptr = getLoadStorePointerOperand(S.I);
+    for (const NestAccess &A : Accesses) {
+      Value *APtr = getLoadStorePointerOperand(A.I);
+      if (AA.isNoAlias(MemoryLocation(Ptr, LocationSize::unknown()),
+                       MemoryLocation(APtr, LocationSize::unknown())))
+        continue;
+      if (SE.getSCEV(APtr) != SE.getSCEV(Ptr))
+        return false;
+    }
+
+    vector<unsigned> Used;
+    for (unsigned Level = 0; Level < Levels.size(); ++Level) {
+      auto It = S.LF.find(Levels[Level].IV);
+      if (It != S.LF.end() && It->second.C != 0)
+        Used.push_back(Level);
+      else
+        Fixed[Level] = true;
+    }
+    if (Used.size() > 2)
+      return false;
+    if (Used.size() == 2) {
+      const Coef &C0 = S.LF.at(Levels[Used[0]].IV);
+      const Coef &C1 = S.LF.at(Levels[Used[1]].IV);
+      if (!isInjective(C0, Levels[Used[1]], C1) &&
+          !isInjective(C1, Levels[Used[0]], C0))
+        return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,269 @@
+#include "LoopTiling.h"
+#include "LoopNest.h"
+#include "SWPPCost.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/IRBuilder.h"
+#include <functional>
+
+using namespace llvm;
+using namespace std;
+
+// Nests that run more iterations than this are not simulated.
+#define MAX_SIMULATED_ITERATIONS (1 << 16)
+// Tile sizes tried are the powers of two up to this.
+#define MAX_TILE_SIZE 64
+// What each iteration of a loop pays for the loop itself: the header
+// compare and branch, the increment and the back branch.
+#define LOOP_ITERATION_COST (COST_ICMP + COST_BR * 2 + COST_ADD)
+// The last compare and branch of each run of a loop.
+#define LOOP_ENTRY_COST (COST_ICMP + COST_BR)
+// Bounding each tile: add, two compares, and, select, and the branch of
+// the tile latch.
+#define TILE_SETUP_COST (COST_ADD + COST_ICMP * 2 + COST_LOGIC + \
+                         COST_SELECT + COST_BR)
+
+// Level is split into tiles of Size iterations. The loop over the tiles
+// goes to Position, outside the levels from there on; the loop within a
+// tile stays where Level was.
+struct Tiling {
+  unsigned Level, Position, Size;
+};
+
+// Runs the nest, tiled as T says (Size 0 for not at all), over the nominal
+// trip counts and adds up what the head travel, the accesses and the loop
+// control cost. Distinct base pointers are placed one after another.
+static double simulateTape(ArrayRef<CountedLoop> Levels,
+                           ArrayRef<NestAccess> Accesses,
+                           ArrayRef<const SCEV*> Bases, const Tiling &T) {
+  enum Kind { Whole, Tiles, Points };
+  vector<pair<unsigned, Kind>> Loops;
+  for (unsigned Level = 0; Level < Levels.size(); ++Level) {
+    if (T.Size && Level == T.Position)
+      Loops.push_back({T.Level, Tiles});
+    Loops.push_back({Level, T.Size && Level == T.Level ? Points : Whole});
+  }
+
+  vector<int64_t> trips;
+  for (const CountedLoop &CL : Levels)
+    trips.push_back((int64_t)getTripCount(CL));
+
+  // Per access: bytes moved per iteration of each level, and the position
+  // of the deepest loop it depends on. LICM takes it out of the others.
+  vector<vector<int64_t>> strides;
+  vector<int> depth;
+  map<const SCEV*, int64_t> span;
+  for (const NestAccess &A : Accesses) {
+    vector<int64_t> stride(Levels.size(), 0);
+    int64_t extent = 8;
+    for (unsigned Level = 0; Level < Levels.size(); ++Level) {
+      auto It = A.LF.find(Levels[Level].IV);
+      if (It == A.LF.end())
+        continue;
+      stride[Level] = It->second.C * Levels[Level].Step->getSExtValue() *
+                      (It->second.Sym ? EXPECTED_TRIPS : 1);
+      extent += abs(stride[Level]) * (trips[Level] - 1);
+    }
+    int deepest = -1;
+    for (unsigned Pos = 0; Pos < Loops.size(); ++Pos)
+      if (Loops[Pos].second != Tiles && stride[Loops[Pos].first])
+        deepest = Pos;
+    strides.push_back(stride);
+    depth.push_back(deepest);
+    const SCEV *Base = Bases[&A - Accesses.begin()];
+    span[Base] = max(span[Base], extent);
+  }
+  map<const SCEV*, int64_t> offset;
+  int64_t end = 0;
+  for (const SCEV *Base : Bases) {
+    if (offset.count(Base))
+      continue;
+    offset[Base] = end;
+    end += span[Base];
+  }
+
+  vector<int64_t> index(Levels.size(), 0), tile(Levels.size(), 0);
+  int64_t head = offset[Bases.front()];
+  double cost = 0;
+  function<void(unsigned)> run = [&](unsigned Pos) {
+    if (Pos == Loops.size())
+      return;
+    auto [Level, K] = Loops[Pos];
+    int64_t begin = K == Points ? tile[Level] : 0;
+    int64_t stop = K == Points ? min(begin + T.Size, trips[Level])
+                               : trips[Level];
+    int64_t step = K == Tiles ? T.Size : 1;
+    cost += LOOP_ENTRY_COST;
+    for (int64_t i = begin; i < stop; i += step) {
+      cost += LOOP_ITERATION_COST;
+      if (K == Tiles) {
+        tile[Level] = i;
+        cost += TILE_SETUP_COST;
+      } else {
+        index[Level] = i;
+      }
+      for (unsigned Idx = 0; Idx < Accesses.size(); ++Idx) {
+        if (depth[Idx] != (int)Pos)
+          continue;
+        int64_t addr = offset[Bases[Idx]];
+        for (unsigned L = 0; L < Levels.size(); ++L)
+          addr += strides[Idx][L] * index[L];
+        cost += COST_MEM + abs(addr - head) * COST_TRAVEL;
+        head = addr;
+      }
+      run(Pos + 1);
+    }
+  };
+  run(0);
+  return cost;
+}
+
+// Splits the level into tiles: a new loop at T.Position walks the tiles
+// and the level's own loop only runs the iterations of the current one.
+// The tile loop stops once a tile reaches the bound, so the tile end can
+// never wrap around.
+static void tileNest(ArrayRef<CountedLoop> Levels, const Tiling &T) {
+  const CountedLoop &Outer = Levels[T.Position], &CL = Levels[T.Level];
+  BasicBlock *Preheader = Outer.L->getLoopPreheader();
+  BasicBlock *Header = Outer.L->getHeader();
+  BasicBlock *Exit = cast<BranchInst>(Header->getTerminator())
+                         ->getSuccessor(1);
+  Function *F = Header->getParent();
+  LLVMContext &Ctx = F->getContext();
+  Type *Ty = CL.IV->getType();
+  bool isSigned = CL.Cmp->isSigned();
+
+  auto *TileHeader = BasicBlock::Create(Ctx, Header->getName() + ".tile",
+                                        F, Header);
+  auto *TileBody = BasicBlock::Create(Ctx, Header->getName() + ".tile.body",
+                                      F, Header);
+  auto *TileLatch = BasicBlock::Create(Ctx, Header->getName() + ".tile.latch",
+                                       F, Exit);
+  IRBuilder<> B(TileHeader);
+  PHINode *Tile = B.CreatePHI(Ty, 2, CL.IV->getName() + ".tile");
+  B.CreateCondBr(B.CreateICmp(CL.Cmp->getPredicate(), Tile, CL.Bound),
+                 TileBody, Exit);
+
+  B.SetInsertPoint(TileBody);
+  Value *End = B.CreateAdd(
+      Tile, ConstantInt::get(Ty, T.Size * CL.Step->getSExtValue()));
+  Value *More = B.CreateAnd(
+      B.CreateICmp(CL.Cmp->getPredicate(), End, CL.Bound),
+      B.CreateICmp(isSigned ? ICmpInst::ICMP_SLT : ICmpInst::ICMP_ULT, Tile,
+                   End));
+  Value *Limit = B.CreateSelect(More, End, CL.Bound);
+  B.CreateBr(Header);
+
+  B.SetInsertPoint(TileLatch);
+  B.CreateCondBr(More, TileHeader, Exit);
+  Tile->addIncoming(CL.Start, Preheader);
+  Tile->addIncoming(End, TileLatch);
+
+  Preheader->getTerminator()->replaceUsesOfWith(Header, TileHeader);
+  for (PHINode &PN : Header->phis())
+    PN.setIncomingBlock(PN.getBasicBlockIndex(Preheader), TileBody);
+  Header->getTerminator()->replaceUsesOfWith(Exit, TileLatch);
+
+  CL.IV->setIncomingValue(
+      CL.IV->getBasicBlockIndex(CL.L->getLoopPreheader()), Tile);
+  CL.Cmp->setOperand(1, Limit);
+}
+
+// Tiles perfect loop nests so that the accesses of consecutive iterations
+// stay close on the tape. The tile sizes come from simulating the head
+// over the nest rather than from a cache: SWPP charges for each byte the
+// head moves, so a tile pays off once the travel it saves exceeds the
+// control of the extra loop. Only -loop-tiling adds it to the pipeline.
+PreservedAnalyses LoopTiling::run(Function &F, FunctionAnalysisManager &FAM) {
+  LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+  if (LI.empty())
+    return PreservedAnalyses::all();
+  AAResults &AA = FAM.getResult<AAManager>(F);
+  ScalarEvolution &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+  OptimizationRemarkEmitter ORE(&F);
+  const DataLayout &DL = F.getParent()->getDataLayout();
+
+  bool changed = false;
+  set<Loop*> visited;
+  for (Loop *Outermost : LI.getLoopsInPreorder()) {
+    if (visited.count(Outermost) || Outermost->getSubLoops().empty())
+      continue;
+    vector<CountedLoop> Levels = getPerfectNest(Outermost);
+    if (Levels.size() < 2)
+      continue;
+    for (const CountedLoop &CL : Levels)
+      visited.insert(CL.L);
+
+    vector<NestAccess> Accesses;
+    vector<bool> Fixed(Levels.size(), false);
+    double iterations = 1;
+    for (const CountedLoop &CL : Levels)
+      iterations *= getTripCount(CL);
+    if (!getNestAccesses(Levels, DL, Accesses) || Accesses.empty() ||
+        !getFixedLevels(Levels, Accesses, AA, SE, Fixed) ||
+        iterations > MAX_SIMULATED_ITERATIONS)
+      continue;
+    vector<const SCEV*> Bases;
+    for (const NestAccess &A : Accesses)
+      Bases.push_back(
+          SE.getPointerBase(SE.getSCEV(getLoadStorePointerOperand(A.I))));
+
+    Tiling Best = {0, 0, 0};
+    double untiledCost = simulateTape(Levels, Accesses, Bases, Best);
+    double bestCost = untiledCost;
+    for (unsigned Level = 1; Level < Levels.size(); ++Level) {
+      const CountedLoop &CL = Levels[Level];
+      ICmpInst::Predicate Pred = CL.Cmp->getPredicate();
+      if ((Pred != ICmpInst::ICMP_ULT && Pred != ICmpInst::ICMP_SLT) ||
+          CL.Step->isNegative())
+        continue;
+      for (unsigned Position = 0; Position < Level; ++Position) {
+        // The tiles of a fixed level cannot go outside another one.
+        bool legal = !Fixed[Level] ||
+                     none_of(Fixed.begin() + Position, Fixed.begin() + Level,
+                             [](bool F) { return F; });
+        BasicBlock *Exit = cast<BranchInst>(
+            Levels[Position].L->getHeader()->getTerminator())
+                ->getSuccessor(1);
+        if (!legal || isa<PHINode>(Exit->front()))
+          continue;
+        for (unsigned Size = 2;
+             Size <= MAX_TILE_SIZE && Size < getTripCount(CL); Size *= 2) {
+          Tiling T = {Level, Position, Size};
+          double cost = simulateTape(Levels, Accesses, Bases, T);
+          if (cost < bestCost) {
+            bestCost = cost;
+            Best = T;
+          }
+        }
+      }
+    }
+
+    if (!Best.Size) {
+      ORE.emit([&]() {
+        return OptimizationRemarkAnalysis("loop-tiling", "Untiled",
+                                          Outermost->getStartLoc(),
+                                          Outermost->getHeader())
+               << Outermost->getHeader()->getName()
+               << ": no tiling pays off, estimated cost "
+               << ore::NV("Cost", (unsigned)untiledCost);
+      });
+      continue;
+    }
+    ORE.emit([&]() {
+      return OptimizationRemark("loop-tiling", "Tiled",
+                                Outermost->getStartLoc(),
+                                Outermost->getHeader())
+             << Outermost->getHeader()->getName() << ": tiled "
+             << Levels[Best.Level].IV->getName() << " by "
+             << ore::NV("Size", Best.Size) << " outside "
+             << Levels[Best.Position].IV->getName() << ", estimated cost "
+             << ore::NV("Cost", (unsigned)untiledCost) << " -> "
+             << ore::NV("NewCost", (unsigned)bestCost);
+    });
+    tileNest(Levels, Best);
+    changed = true;
+  }
+  if (!changed)
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
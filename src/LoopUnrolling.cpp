@@ -0,0 +1,219 @@
+#include "LoopUnrolling.h"
+#include "SWPPCost.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/LoopRotationUtils.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/UnrollLoop.h"
+
+using namespace llvm;
+using namespace std;
+
+// A loop is fully unrolled only if the result has at most this many
+// instructions.
+#define MAX_FULL_UNROLL_SIZE 128
+// Bounds on partial and runtime unrolling.
+#define MAX_UNROLL_SIZE 64
+#define MAX_UNROLL_COUNT 8
+// Computing the remainder of a runtime unrolled loop, roughly: sub, and,
+// icmp, br and the remainder loop's own preheader.
+#define RUNTIME_SETUP_COST (COST_ADD + COST_LOGIC + COST_ICMP + COST_BR * 3)
+// Loops whose header has more instructions than this are not rotated.
+#define MAX_ROTATE_HEADER_SIZE 16
+
+// What each iteration pays only for being a separate iteration: the header
+// phis, which depPhi turns into a store and a load, and the latch compare
+// and branch. An unrolled copy saves all of it.
+static double getIterationOverhead(Loop *L) {
+  auto phis = L->getHeader()->phis();
+  return COST_ICMP + COST_BR +
+         COST_MEM * 2 * distance(phis.begin(), phis.end());
+}
+
+static unsigned getLoopSize(Loop *L) {
+  unsigned size = 0;
+  for (BasicBlock *BB : L->blocks())
+    size += distance(BB->getFirstNonPHI()->getIterator(), BB->end());
+  return size;
+}
+
+unsigned getPartialUnrollCount(Loop *L) {
+  unsigned size = getLoopSize(L);
+  unsigned count = MAX_UNROLL_COUNT;
+  while (count > 1 && count * size > MAX_UNROLL_SIZE)
+    count /= 2;
+  return count;
+}
+
+// Unrolling copies the body, it does not interleave the copies, so each
+// copy needs about as many registers as the original. What must fit is
+// the original loop plus whatever the unroller keeps live around it.
+static bool fitsInRegisters(Loop *L, RegPressure &RP, unsigned extra) {
+  for (BasicBlock *BB : L->blocks())
+    if (RP.getMaxPressure(BB) + extra > REG_SIZE)
+      return false;
+  return true;
+}
+
+// Picks the unroll count for L running tripCount times (0 if unknown), a
+// multiple of tripMultiple; 0 means leave it alone. Runtime is set if the
+// count needs a remainder loop, which takes the latch to be the only exit.
+static unsigned getUnrollCount(Loop *L, unsigned tripCount,
+                               unsigned tripMultiple, bool latchExits,
+                               RegPressure &RP, bool &Runtime) {
+  Runtime = false;
+  unsigned size = getLoopSize(L);
+  double overhead = getIterationOverhead(L);
+
+  if (tripCount > 1 && tripCount * size <= MAX_FULL_UNROLL_SIZE &&
+      fitsInRegisters(L, RP, 0))
+    return tripCount;
+
+  unsigned count = getPartialUnrollCount(L);
+  if (tripCount > 0 && count >= tripCount)
+    count = tripCount / 2;
+  if (count < 2)
+    return 0;
+
+  // A count dividing the trip count needs no remainder.
+  for (unsigned c = count; c > 1; c /= 2)
+    if (tripMultiple % c == 0 && fitsInRegisters(L, RP, 0))
+      return c;
+
+  if (!latchExits || !fitsInRegisters(L, RP, RUNTIME_EXTRA_REGS))
+    return 0;
+  double trips = tripCount > 0 ? tripCount : EXPECTED_TRIPS;
+  double saved = overhead * trips * (count - 1) / count;
+  // the remainder loop runs count / 2 iterations on average
+  if (saved <= RUNTIME_SETUP_COST + overhead * count / 2)
+    return 0;
+  Runtime = true;
+  return count;
+}
+
+// Whether L tests its exit condition in the header and jumps back from an
+// unconditional latch, as while and for loops come out of clang.
+static bool isUnrotated(Loop *L) {
+  BasicBlock *Latch = L->getLoopLatch();
+  return Latch && L->isLoopExiting(L->getHeader()) &&
+         !L->isLoopExiting(Latch);
+}
+
+// Whether the unrotated L would be unrolled once rotated. The body of the
+// rotated loop runs as often as the latch of L jumps back, and its exit
+// test moves from the header to the latch.
+static bool wouldUnrollRotated(Loop *L, const SCEV *BTC, ScalarEvolution &SE,
+                               RegPressure &RP) {
+  if (isa<SCEVCouldNotCompute>(BTC))
+    return false;
+  unsigned tripCount = 0;
+  if (auto *C = dyn_cast<SCEVConstant>(BTC))
+    tripCount = C->getAPInt().getLimitedValue(UINT_MAX);
+  unsigned tripMultiple =
+      tripCount ? tripCount : 1u << min(SE.GetMinTrailingZeros(BTC), 31u);
+  bool Runtime;
+  return getUnrollCount(L, tripCount, tripMultiple,
+                        L->getExitingBlock() == L->getHeader(), RP, Runtime);
+}
+
+// What rotating L saves on its own each time the loop is entered: the back
+// branch of every iteration, less the copy of the header that tests for
+// the first iteration in front of the loop.
+static double getRotationGain(Loop *L, const SCEV *BTC) {
+  double trips = EXPECTED_TRIPS;
+  if (auto *C = dyn_cast<SCEVConstant>(BTC))
+    trips = C->getAPInt().getLimitedValue(UINT_MAX);
+  return trips * COST_BR - getSWPPCost(L->getHeader());
+}
+
+static bool unrollLoop(Loop *L, LoopInfo &LI, DominatorTree &DT,
+                       ScalarEvolution &SE, AssumptionCache &AC,
+                       const TargetTransformInfo &TTI,
+                       OptimizationRemarkEmitter &ORE) {
+  if (!L->getSubLoops().empty() || !L->getLoopLatch() || !L->isSafeToClone())
+    return false;
+
+  Function &F = *L->getHeader()->getParent();
+  bool changed = simplifyLoop(L, &DT, &LI, &SE, &AC, nullptr, true);
+  changed |= formLCSSARecursively(*L, DT, &LI, &SE);
+  if (!L->isLoopSimplifyForm())
+    return changed;
+  // Rotating moves the exit test to the latch, which saves the unconditional
+  // back branch of each iteration and is what the unroller needs to drop
+  // the tests between unrolled copies. A loop that is not going to be
+  // unrolled is rotated only if the branches saved pay for the copy of the
+  // header it puts in front of the loop.
+  if (isUnrotated(L)) {
+    RegPressure RP(F);
+    const SCEV *BTC = SE.getBackedgeTakenCount(L);
+    if (!wouldUnrollRotated(L, BTC, SE, RP) && getRotationGain(L, BTC) <= 0)
+      return changed;
+    SimplifyQuery SQ(F.getParent()->getDataLayout());
+    changed |= LoopRotation(L, &LI, &TTI, &AC, &DT, &SE, nullptr, SQ, true,
+                            MAX_ROTATE_HEADER_SIZE, false);
+  }
+  if (!L->isLoopExiting(L->getLoopLatch()))
+    return changed;
+
+  RegPressure RP(F);
+  bool Runtime;
+  unsigned count = getUnrollCount(L, SE.getSmallConstantTripCount(L),
+                                  SE.getSmallConstantTripMultiple(L),
+                                  L->getExitingBlock() == L->getLoopLatch(),
+                                  RP, Runtime);
+  if (count == 0)
+    return changed;
+
+  UnrollLoopOptions ULO;
+  ULO.Count = count;
+  ULO.TripCount = SE.getSmallConstantTripCount(L);
+  ULO.Force = true;
+  ULO.AllowRuntime = Runtime;
+  ULO.AllowExpensiveTripCount = false;
+  ULO.PreserveCondBr = false;
+  ULO.PreserveOnlyFirst = false;
+  ULO.TripMultiple = SE.getSmallConstantTripMultiple(L);
+  ULO.PeelCount = 0;
+  ULO.UnrollRemainder = false;
+  ULO.ForgetAllSCEV = false;
+  changed |= UnrollLoop(L, ULO, &LI, &SE, &DT, &AC, &ORE, true) !=
+             LoopUnrollResult::Unmodified;
+  return changed;
+}
+
+PreservedAnalyses LoopUnrolling::run(Function &F,
+                                     FunctionAnalysisManager &FAM) {
+  LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+  DominatorTree &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  ScalarEvolution &SE = FAM.getResult<ScalarEvolutionAnalysis>(F);
+  AssumptionCache &AC = FAM.getResult<AssumptionAnalysis>(F);
+  TargetTransformInfo &TTI = FAM.getResult<TargetIRAnalysis>(F);
+  OptimizationRemarkEmitter ORE(&F);
+
+  vector<Loop*> innermost;
+  for (Loop *L : LI.getLoopsInPreorder())
+    if (L->getSubLoops().empty())
+      innermost.push_back(L);
+
+  bool changed = false;
+  for (Loop *L : innermost)
+    changed |= unrollLoop(L, LI, DT, SE, AC, TTI, ORE);
+  if (!changed)
+    return PreservedAnalyses::all();
+
+  // Full unrolling leaves a chain of blocks.
+  vector<BasicBlock*> blocks;
+  for (BasicBlock &BB : F)
+    blocks.push_back(&BB);
+  for (BasicBlock *BB : blocks)
+    MergeBlockIntoPredecessor(BB);
+  return PreservedAnalyses::none();
+}
@@ -1,18 +1,17 @@
 #include "LessSimpleBackend.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/InstVisitor.h"
+#include <atomic>
 #include <cmath>
-#include <regex>
-#include <sstream>
+#include <thread>
 
 using namespace llvm;
 using namespace std;
 
 namespace {
 
-// Translates cast destination registers into real registers
-map<std::string, std::string> castDestReg{};
-
 string getAccessSizeInStr(Type *T) {
   return std::to_string(getAccessSize(T));
 }
@@ -54,127 +53,82 @@ void raiseErrorIf(bool cond, const string &msg) {
 set<unsigned> ValidIntBitwidths = { 1, 8, 16, 32, 64 };
 
 void checkRegisterType(Instruction *I) {
-  raiseErrorIf(!I->hasName(), "the instruction does not have a name", I);
   auto *T = I->getType();
 
   raiseErrorIf(!isa<IntegerType>(T) && !isa<PointerType>(T),
                 "unknown register type", I);
-
-  string name = I->getName().str();
-  unsigned bw = T->isIntegerTy() ? T->getIntegerBitWidth() : 64;
 }
 
 string getRegisterNameFromArgument(Argument *A) {
-  const string msg = "incorrect argument name";
-  raiseErrorIf(!A->hasName(), msg, A);
-
-  regex re("__arg([0-9]+)__");
-  cmatch m;
-  string name = A->getName().str();
-  regex_match(name.c_str(), m, re);
-  raiseErrorIf(m.empty() || m[0].length() != name.length(), msg, A);
-
-  int regid = stoi(m[1].str());
-  raiseErrorIf(regid <= 0 || 16 < regid, std::to_string(regid), A);
-
-  // Well, allow names like arg01...
+  unsigned regid = A->getArgNo() + 1;
+  raiseErrorIf(16 < regid, std::to_string(regid), A);
   return "arg" + std::to_string(regid);
 }
 
-bool shouldBeMappedToAssemblyRegister(Instruction *I) {
-  string name = I->getName().str();
-  regex re("^r([0-9]+)_.*");
-  cmatch m;
-  regex_match(name.c_str(), m, re);
-  return !m.empty();
-}
-
-string getRegisterNameFromInstruction(Instruction *I, std::string tempPrefix) {
-  const string msg = "incorrect instruction name";
-  raiseErrorIf(!I->hasName(), msg, I);
-
-  string name = I->getName().str();
-
-  bool is_temp = starts_with(name, tempPrefix);
-  if (is_temp) {
-    if (castDestReg.count(name) > 0) {
-        return castDestReg.at(name);
-    }
-    return name;
-  }
-
-  regex re("^r([0-9]+)_.*");
-  cmatch m;
-  regex_match(name.c_str(), m, re);
-  raiseErrorIf(m.empty() && !is_temp, msg, I);
-
-  int regid = stoi(m[1].str());
-  raiseErrorIf(regid <= 0 || 16 < regid, msg, I);
-
-  return "r" + std::to_string(regid);
-}
-
 class AssemblyEmitterImpl : public InstVisitor<AssemblyEmitterImpl> {
 public:
 // NOTE: declaration of members
-  vector<string> FnBody;
   string resetHeapName;
   string resetStackName;
   string spSubName;
   string spOffsetName;
   string regSwitchName;
-  string tempPrefix;
+  const RegAssignment &assignment;
   llvm::raw_ostream *fout;
 
 private:
   // For resolving bit_cast_ptr and offset
-  unordered_map<std::string, int> nameOffsetMap;
-  unordered_map<std::string, std::pair<std::string, unsigned int>> ptrResolver;
-  unordered_map<llvm::Value*, std::string> sextResolver;
-  unordered_map<llvm::Value*, std::pair<std::string, unsigned int>> GEPResolver;
-  map<llvm::Value*, std::vector<std::string>> postOpResolver;
-
-  // ----- Emit functions -----
-  void _emitAssemblyBody(const string &Cmd, const vector<string> &Ops,
-                         stringstream &ss) {
-    ss << Cmd;
-    for (auto &Op : Ops)
-      ss << " " << Op;
+  DenseMap<llvm::Value*, int> nameOffsetMap;
+  DenseMap<llvm::Value*, std::string> castDestReg;
+  DenseMap<llvm::Value*, std::pair<std::string, unsigned int>> ptrResolver;
+  DenseMap<llvm::Value*, std::string> sextResolver;
+  DenseMap<llvm::Value*, std::pair<std::string, unsigned int>> GEPResolver;
+
+  // The register the backend gave I, "" if it folded I into its users.
+  string getRegisterName(Instruction *I) {
+    if (assignment.isFolded(I))
+      return "";
+    unsigned regid = assignment.getReg(I);
+    raiseErrorIf(regid == 0 || 16 < regid, "no register for instruction", I);
+    return "r" + std::to_string(regid);
   }
 
-  void emitAssembly(const string &DestReg, const string &Cmd,
-                    const vector<string> &Ops) {
-    stringstream ss;
-    ss << DestReg << " = ";
-    _emitAssemblyBody(Cmd, Ops, ss);
-    FnBody.push_back(ss.str());
+  // ----- Emit functions -----
+  // Everything is written straight to fout, which buffers it.
+  void _emitAssemblyBody(StringRef Cmd, ArrayRef<StringRef> Ops) {
+    *fout << Cmd;
+    for (StringRef Op : Ops)
+      *fout << ' ' << Op;
+    *fout << '\n';
   }
 
-  void emitAssembly(const string &Cmd, const vector<string> &Ops) {
-    stringstream ss;
-    _emitAssemblyBody(Cmd, Ops, ss);
-    FnBody.push_back(ss.str());
+  void emitAssembly(StringRef DestReg, StringRef Cmd,
+                    ArrayRef<StringRef> Ops) {
+    *fout << "    " << DestReg << " = ";
+    _emitAssemblyBody(Cmd, Ops);
   }
 
-  void emitAssembly(const string &Cmd) {
-    FnBody.push_back(Cmd);
+  void emitAssembly(StringRef Cmd, ArrayRef<StringRef> Ops) {
+    *fout << "    ";
+    _emitAssemblyBody(Cmd, Ops);
   }
 
-  void emitCopy(const string &DestReg, const string &val) {
+  void emitCopy(StringRef DestReg, StringRef val) {
     if (DestReg != val)
       emitAssembly(DestReg, "mul", {val, "1", "64"});
   }
 
-  void emitBasicBlockStart(const string &name) {
-    FnBody.push_back(name + ":");
+  void emitBasicBlockStart(BasicBlock &BB) {
+    // The entry block directly follows the start line.
+    if (&BB != &BB.getParent()->getEntryBlock())
+      *fout << '\n';
+    *fout << "  " << BB.getName() << ":\n";
   }
 
   // If V is a register or constant, return its name.
   // If V is alloca, return its offset from stack.
   pair<string, int> getOperand(Value *V, bool shouldNotBeStackSlot = true) {
     if (auto *A = dyn_cast<Argument>(V)) {
-      // Its name should be __argN__.
-      // Extract & return the argN.
       auto *ATy = A->getType();
       raiseErrorIf(!((ATy->isIntegerTy()) || ATy->isPointerTy()),
                    "unknown argument type", A);
@@ -199,8 +153,8 @@ private:
           assert(false && "Unknown inttoptr form");
       }
       else if (CE->getOpcode() == Instruction::GetElementPtr) {
-        if (ptrResolver.count(CE->getName().str()) > 0) {
-          auto tmp = ptrResolver.at(CE->getName().str());
+        if (ptrResolver.count(CE) > 0) {
+          auto tmp = ptrResolver.lookup(CE);
           return { tmp.first, tmp.second };
         } else {
           raiseError("GEP not handled", CE);
@@ -214,35 +168,35 @@ private:
         // Trunc is just a wrapper for passing type cheking of IR.
         return getOperand(I->getOperand(0), shouldNotBeStackSlot);
       }
-      else if (shouldBeMappedToAssemblyRegister(I)) {
-        // Note that alloca can also have a register name.
-        //   __r1__ = alloca i32
+      else if (assignment.getReg(I)) {
+        // Note that alloca can also have a register.
+        //   r1: alloca i32
         // This will be lowered to:
         //   r1 = add sp, <offset>
         checkRegisterType(I);
-        return { getRegisterNameFromInstruction(I, tempPrefix), -1 };
+        return { getRegisterName(I), -1 };
       }
-      else if (nameOffsetMap.count(I->getName().str())) {
-        int offset = nameOffsetMap.at(I->getName().str());
+      else if (nameOffsetMap.count(I)) {
+        int offset = nameOffsetMap.lookup(I);
         return { "sp", offset };
       }
-      else if (castDestReg.count(I->getName().str())) {
-        return { castDestReg.at(I->getName().str()), -1 };
+      else if (castDestReg.count(I)) {
+        return { castDestReg.lookup(I), -1 };
       }
-      else if (ptrResolver.count(I->getName().str())) {
-        auto tmp = ptrResolver.at(I->getName().str());
+      else if (ptrResolver.count(I)) {
+        auto tmp = ptrResolver.lookup(I);
         return { tmp.first, tmp.second };
       }
       else if (sextResolver.count(I)) {
-        return { sextResolver.at(I), -1 };
+        return { sextResolver.lookup(I), -1 };
       }
       else if (GEPResolver.count(I)) {
-        auto tmp = GEPResolver.at(I);
+        auto tmp = GEPResolver.lookup(I);
         return { tmp.first, tmp.second };
       }
-      else if (starts_with(I->getName().str(), tempPrefix)) {
-      /* If this is an instruction start with temp and not resolved in
-      nameOffsetMap or castDestReg, then  */
+      else if (assignment.isFolded(I)) {
+      /* If this is a folded instruction and not resolved in nameOffsetMap
+      or castDestReg yet, then  */
         if(dyn_cast<CastInst>(I)){
           return getOperand(I->getOperand(0));
         }
@@ -282,29 +236,30 @@ void getSize(vector<unsigned> &indices, ArrayType *arr) {
 
 public:
 // NOTE: start of Instvisit implementation
-  AssemblyEmitterImpl(std::vector<std::string> dummyFunctionName):
+  AssemblyEmitterImpl(std::vector<std::string> dummyFunctionName,
+                      const RegAssignment &assignment,
+                      llvm::raw_ostream *fout):
     resetHeapName(dummyFunctionName[0]),
     resetStackName(dummyFunctionName[1]),
     spOffsetName(dummyFunctionName[2]),
     spSubName(dummyFunctionName[3]),
     regSwitchName(dummyFunctionName[4]),
-    tempPrefix(dummyFunctionName[5])
+    assignment(assignment),
+    fout(fout)
    {}
 
   void visitFunction(Function &F) {
     // CurrentStackFrame = StackFrame();
-    castDestReg = {};
-    nameOffsetMap = {};
-    ptrResolver = {};
-    sextResolver = {};
-    GEPResolver = {};
-    postOpResolver = {};
-    FnBody.clear();
+    castDestReg.clear();
+    nameOffsetMap.clear();
+    ptrResolver.clear();
+    sextResolver.clear();
+    GEPResolver.clear();
   }
 
   void visitBasicBlock(BasicBlock &BB) {
     raiseErrorIf(!BB.hasName(), "This basic block does not have name: ", &BB);
-    emitBasicBlockStart(BB.getName().str());
+    emitBasicBlockStart(BB);
   }
 
   // Unsupported instruction goes here.
@@ -318,15 +273,11 @@ public:
   // ---- Memory operations ----
   void visitLoadInst(LoadInst &LI) {
     auto [PtrOp, StackOffset] = getOperand(LI.getPointerOperand(), false);
-    string Dest = getRegisterNameFromInstruction(&LI, tempPrefix);
+    string Dest = getRegisterName(&LI);
     string sz = getAccessSizeInStr(LI.getType());
 
-    if (StackOffset != -1) {
-      if (starts_with(PtrOp, tempPrefix))
-        emitAssembly(Dest, "load", {sz, "sp", std::to_string(StackOffset)});
-      else
-        emitAssembly(Dest, "load", {sz, PtrOp, std::to_string(StackOffset)});
-    }
+    if (StackOffset != -1)
+      emitAssembly(Dest, "load", {sz, PtrOp, std::to_string(StackOffset)});
     else
       emitAssembly(Dest, "load", {sz, PtrOp, "0"});
   }
@@ -336,12 +287,8 @@ public:
     auto [PtrOp, StackOffset] = getOperand(SI.getPointerOperand(), false);
     string sz = getAccessSizeInStr(SI.getValueOperand()->getType());
 
-    if (StackOffset != -1) {
-      if (starts_with(PtrOp, tempPrefix))
-        emitAssembly("store", {sz, ValOp, "sp", std::to_string(StackOffset)});
-      else
-        emitAssembly("store", {sz, ValOp, PtrOp, std::to_string(StackOffset)});
-    }
+    if (StackOffset != -1)
+      emitAssembly("store", {sz, ValOp, PtrOp, std::to_string(StackOffset)});
     else
       emitAssembly("store", {sz, ValOp, PtrOp, "0"});
   }
@@ -350,7 +297,7 @@ public:
   void visitBinaryOperator(BinaryOperator &BO) {
     auto [Op1, unused_1] = getOperand(BO.getOperand(0));
     auto [Op2, unused_2] = getOperand(BO.getOperand(1));
-    string DestReg = getRegisterNameFromInstruction(&BO, tempPrefix); // iN -> i64
+    string DestReg = getRegisterName(&BO); // iN -> i64
     string Cmd;
     string sz = std::to_string(BO.getType()->getIntegerBitWidth());
 
@@ -376,7 +323,7 @@ public:
   void visitICmpInst(ICmpInst &II) {
     auto [Op1, unused_1] = getOperand(II.getOperand(0));
     auto [Op2, unused_2] = getOperand(II.getOperand(1));
-    string DestReg = getRegisterNameFromInstruction(&II, tempPrefix); // i1 -> i64
+    string DestReg = getRegisterName(&II); // i1 -> i64
     string pred = ICmpInst::getPredicateName(II.getPredicate()).str();
     auto *OpTy = II.getOperand(0)->getType();
     string sz = std::to_string(
@@ -388,7 +335,7 @@ public:
     auto [Op1, unused_1] = getOperand(SI.getOperand(0));
     auto [Op2, unused_2] = getOperand(SI.getOperand(1));
     auto [Op3, unused_3] = getOperand(SI.getOperand(2));
-    string DestReg = getRegisterNameFromInstruction(&SI, tempPrefix);
+    string DestReg = getRegisterName(&SI);
     emitAssembly(DestReg, "select", {Op1, Op2, Op3});
   }
   void visitGetElementPtrInst(GetElementPtrInst &GEPI) {
@@ -404,22 +351,22 @@ public:
 
     auto [Ptr, _] = getOperand(GEPI.getOperand(0)); // Pointer Operand
 
-    string DestReg = getRegisterNameFromInstruction(&GEPI, tempPrefix);
+    string DestReg = getRegisterName(&GEPI);
 
     if (PtrTy->getPointerElementType()->isIntegerTy()) {
       auto tmp = PtrTy->getPointerElementType()->getIntegerBitWidth();
       unsigned elementByte = tmp == 1 ? tmp : tmp / 8;
       auto [Of, _] = getOperand(GEPI.getOperand(1));
 
-      if (starts_with(DestReg, tempPrefix)) { // All constants
-        GEPResolver.emplace(&GEPI,
+      if (DestReg.empty()) { // All constants
+        GEPResolver.try_emplace(&GEPI,
           std::pair<std::string, unsigned>{Ptr, stoi(Of)*elementByte});
         return;
       }
       else if (starts_with(DestReg, "r")) { // Register
         emitAssembly(DestReg, "mul", {Of, std::to_string(elementByte), "64"});
         emitAssembly(DestReg, "add", {Ptr, DestReg, "64"});
-        GEPResolver.emplace(&GEPI,
+        GEPResolver.try_emplace(&GEPI,
           std::pair<std::string, unsigned>{DestReg, -1});
         return;
       }
@@ -431,16 +378,16 @@ public:
     else if (PtrTy->getPointerElementType()->isPointerTy()) {
       raiseErrorIf(GEPI.getNumIndices() != 1, "Too many indices", &GEPI);
       auto [Of, unused_2] = getOperand(GEPI.getOperand(1));
-      string DestReg = getRegisterNameFromInstruction(&GEPI, tempPrefix);
+      string DestReg = getRegisterName(&GEPI);
 
-      if (starts_with(DestReg, tempPrefix)) {
-        GEPResolver.emplace(&GEPI,
+      if (DestReg.empty()) {
+        GEPResolver.try_emplace(&GEPI,
          std::pair<std::string, unsigned>{Ptr, stoi(Of)*8});
       }
       else if (starts_with(DestReg, "r")) { // Register
         emitAssembly(DestReg, "mul", {Of, "8", "64"});
         emitAssembly(DestReg, "add", {Ptr, DestReg, "64"});
-        GEPResolver.emplace(&GEPI,
+        GEPResolver.try_emplace(&GEPI,
           std::pair<std::string, unsigned>{DestReg, -1});
         return;
       }
@@ -454,7 +401,7 @@ public:
       getSize(size, dyn_cast<ArrayType>(PtrTy->getPointerElementType()));
       unsigned elementByte = size.back();
 
-      if (starts_with(DestReg, tempPrefix)) { // All constants
+      if (DestReg.empty()) { // All constants
         unsigned offset = 0;
         vector<unsigned> indices;
 
@@ -473,7 +420,7 @@ public:
           offset *= size[j];
         }
 
-        GEPResolver.emplace(&GEPI,
+        GEPResolver.try_emplace(&GEPI,
                             std::pair<std::string, unsigned>{Ptr, offset});
       }
 
@@ -520,7 +467,7 @@ public:
                     { DestReg, std::to_string(size[k]), "64"});
         }
         emitAssembly(DestReg, "add", {DestReg, Ptr, "64"});
-        GEPResolver.emplace(&GEPI,
+        GEPResolver.try_emplace(&GEPI,
                             std::pair<std::string, unsigned>{DestReg, -1});
       }
       else {
@@ -536,15 +483,15 @@ public:
   // ---- Casts ----
   void visitZExtInst(ZExtInst &ZI) {
     // This test should pass.
-    auto DestReg = getRegisterNameFromInstruction(&ZI, tempPrefix);
+    auto DestReg = getRegisterName(&ZI);
     auto [Op1, offset] = getOperand(ZI.getOperand(0));
-    if (starts_with(DestReg, tempPrefix)) { // start with temp, penetrate through
+    if (DestReg.empty()) { // folded, penetrate through
       if (offset != -1) {
-        nameOffsetMap.emplace(ZI.getName().str(), offset);
+        nameOffsetMap.try_emplace(&ZI, offset);
       } else {
-        castDestReg.emplace(ZI.getName().str(), Op1);
+        castDestReg.try_emplace(&ZI, Op1);
       }
-    } else { // not start with temp
+    } else { // has a register
       uint64_t Mask = (1llu << (ZI.getSrcTy()->getIntegerBitWidth())) - 1;
       emitAssembly(DestReg, "and", {Op1, std::to_string(Mask), "64"});
     }
@@ -552,11 +499,16 @@ public:
 
   void visitSExtInst(SExtInst &SI) {
     // Handle this in getOperand
-    string DestReg = getRegisterNameFromInstruction(&SI, tempPrefix);
-    auto [SrcReg, _] = getOperand(SI.getOperand(0));
-
-    raiseErrorIf(starts_with(DestReg, tempPrefix),
-      "Unresolved register name: start with tempPrefix", &SI);
+    string DestReg = getRegisterName(&SI);
+    auto [SrcReg, offset] = getOperand(SI.getOperand(0));
+
+    if (DestReg.empty()) {
+      // The backend proved the source is already sign-extended in its
+      // register, so resolve it like a temp zext.
+      raiseErrorIf(offset != -1, "sext of a stack offset", &SI);
+      castDestReg.try_emplace(&SI, SrcReg);
+      return;
+    }
 
     raiseErrorIf(((!SI.getSrcTy()->isIntegerTy())||
                   (!SI.getDestTy()->isIntegerTy())),
@@ -571,18 +523,17 @@ public:
     emitAssembly(DestReg, "mul", {SrcReg, facToMul, std::to_string(to)});
     // emitAssembly(DestReg, "shl", {SrcReg, bitToShift, std::to_string(to)});
     emitAssembly(DestReg, "ashr", {DestReg, bitToShift, std::to_string(to)});
-    sextResolver.emplace(&SI, DestReg);
+    sextResolver.try_emplace(&SI, DestReg);
   }
 
   void visitTruncInst(TruncInst &TI) {
     // This test should pass.
-    if (auto *I = dyn_cast<Instruction>(TI.getOperand(0))) {
-      (void)getRegisterNameFromInstruction(I, tempPrefix);
+    if (isa<Instruction>(TI.getOperand(0))) {
       auto [Op1, offset] = getOperand(TI.getOperand(0));
       if (offset != -1) {
-        nameOffsetMap.emplace(TI.getName().str(), offset);
+        nameOffsetMap.try_emplace(&TI, offset);
       } else {
-        castDestReg.emplace(TI.getName().str(), Op1);
+        castDestReg.try_emplace(&TI, Op1);
       }
       return;
     }
@@ -592,26 +543,26 @@ public:
   void visitBitCastInst(BitCastInst &BCI) {
     auto [Op1, offset] = getOperand(BCI.getOperand(0));
     if (offset != -1) {
-      nameOffsetMap.emplace(BCI.getName().str(), offset);
+      nameOffsetMap.try_emplace(&BCI, offset);
     } else {
-      castDestReg.emplace(BCI.getName().str(), Op1);
+      castDestReg.try_emplace(&BCI, Op1);
     }
   }
 
   void visitPtrToIntInst(PtrToIntInst &PI) {
     auto [Op1, offset] = getOperand(PI.getOperand(0));
     if (offset != -1) {
-      nameOffsetMap.emplace(PI.getName().str(), offset);
+      nameOffsetMap.try_emplace(&PI, offset);
     } else {
-      castDestReg.emplace(PI.getName().str(), Op1);
+      castDestReg.try_emplace(&PI, Op1);
     }
   }
   void visitIntToPtrInst(IntToPtrInst &II) {
     auto [Op1, offset] = getOperand(II.getOperand(0));
     if (offset != -1) {
-      nameOffsetMap.emplace(II.getName().str(), offset);
+      nameOffsetMap.try_emplace(&II, offset);
     } else {
-      castDestReg.emplace(II.getName().str(), Op1);
+      castDestReg.try_emplace(&II, Op1);
     }
   }
 
@@ -619,30 +570,24 @@ public:
   // TODO: handle dummyFunction swith register
   // handle dummy function here!
   void visitCallInst(CallInst &CI) {
-    string FnName = CI.getCalledFunction()->getName().str();
-    vector<string> Args;
+    StringRef FnName = CI.getCalledFunction()->getName();
     bool MallocOrFree = true;
     if (FnName == resetStackName) {
-      Args.emplace_back("stack");
-      emitAssembly("reset", Args);
+      emitAssembly("reset", {"stack"});
       return;
     }
     if (FnName == resetHeapName) {
-      Args.emplace_back("heap");
-      emitAssembly("reset", Args);
+      emitAssembly("reset", {"heap"});
       return;
     }
     // handle spOffset here!
     if (FnName == spOffsetName) {
-      string DestReg = getRegisterNameFromInstruction(&CI, tempPrefix);
+      string DestReg = getRegisterName(&CI);
       string offset = getOperand(CI.getArgOperand(0)).first;
-      if (starts_with(DestReg, tempPrefix)) {
-        nameOffsetMap.emplace(DestReg, stoi(offset));
+      if (DestReg.empty()) {
+        nameOffsetMap.try_emplace(&CI, stoi(offset));
       } else {
-        Args.emplace_back("sp");
-        Args.emplace_back(offset);
-        Args.emplace_back("64");
-        emitAssembly(DestReg, "add", Args);
+        emitAssembly(DestReg, "add", {"sp", offset, "64"});
       }
       // Do not emit assembly
       return;
@@ -653,10 +598,7 @@ public:
       if (!stoi(frameSize)) {
         return;
       } else {
-        Args.emplace_back("sp");
-        Args.emplace_back(frameSize);
-        Args.emplace_back("64");
-        emitAssembly("sp", "sub", Args);
+        emitAssembly("sp", "sub", {"sp", frameSize, "64"});
         return;
       }
     }
@@ -665,22 +607,18 @@ public:
       return;
     }
 
+    // The operands own their strings, Args only refers to them.
+    SmallVector<string, 8> Operands;
+    for (auto I = CI.arg_begin(), E = CI.arg_end(); I != E; ++I)
+      Operands.push_back(getOperand(*I).first);
+    SmallVector<StringRef, 8> Args;
     if (FnName != "malloc" && FnName != "free") {
       MallocOrFree = false;
-      Args.emplace_back(FnName);
-    }
-
-    unsigned Idx = 0;
-    for (auto I = CI.arg_begin(), E = CI.arg_end(); I != E; ++I) {
-      string name = getOperand(*I).first;
-      if (castDestReg.count(name) > 0) {
-          name = castDestReg.at(name);
-      }
-      Args.emplace_back(name);
-      ++Idx;
+      Args.push_back(FnName);
     }
-    if (CI.hasName()) {
-      string DestReg = getRegisterNameFromInstruction(&CI, tempPrefix);
+    Args.append(Operands.begin(), Operands.end());
+    if (!CI.getType()->isVoidTy()) {
+      string DestReg = getRegisterName(&CI);
       emitAssembly(DestReg, MallocOrFree ? FnName : "call", Args);
     } else {
       emitAssembly(MallocOrFree ? FnName : "call", Args);
@@ -697,62 +635,99 @@ public:
   }
   void visitBranchInst(BranchInst &BI) {
     if (BI.isUnconditional()) {
-      emitAssembly("br", {(string)BI.getSuccessor(0)->getName()});
+      emitAssembly("br", {BI.getSuccessor(0)->getName()});
     } else {
-      string msg = "Branch condition should be icmp ne";
+      // br takes the first target if the register is not zero; the backend
+      // only branches on values that are clean above their bit width.
       auto *BCond = BI.getCondition();
-      raiseErrorIf(!isa<ICmpInst>(BCond), msg, BCond);
-
-      auto *II = dyn_cast<ICmpInst>(BCond);
-
-      auto Cond = getRegisterNameFromInstruction(II, tempPrefix);
-      emitAssembly("br", { Cond, (string)BI.getSuccessor(0)->getName(),
-                                 (string)BI.getSuccessor(1)->getName()});
+      raiseErrorIf(!BCond->getType()->isIntegerTy(),
+                   "Branch condition should be an integer", BCond);
+      raiseErrorIf(isa<Constant>(BCond),
+                   "Branch on a constant, the backend folds those", BCond);
+
+      auto [Cond, offset] = getOperand(BCond);
+      raiseErrorIf(offset != -1, "Branch on a stack offset", BCond);
+      emitAssembly("br", { Cond, BI.getSuccessor(0)->getName(),
+                                 BI.getSuccessor(1)->getName()});
     }
   }
   void visitSwitchInst(SwitchInst &SI) {
     auto [Cond, _] = getOperand(SI.getCondition());
-    vector<string> Args;
-    Args.emplace_back(Cond);
+    SmallVector<string, 8> CaseValues;
+    for (SwitchInst::CaseIt I = SI.case_begin(), E = SI.case_end();
+         I != E; ++I)
+      CaseValues.push_back(to_string(*I->getCaseValue()));
+    SmallVector<StringRef, 16> Args;
+    Args.push_back(Cond);
+    unsigned Idx = 0;
     for (SwitchInst::CaseIt I = SI.case_begin(), E = SI.case_end();
          I != E; ++I) {
-      Args.push_back(to_string(*I->getCaseValue()));
-      Args.push_back(I->getCaseSuccessor()->getName().str());
+      Args.push_back(CaseValues[Idx++]);
+      Args.push_back(I->getCaseSuccessor()->getName());
     }
-    Args.push_back(SI.getDefaultDest()->getName().str());
+    Args.push_back(SI.getDefaultDest()->getName());
     emitAssembly("switch", Args);
   }
 };
 
 };
 
-void NewAssemblyEmitter::run(Module *DepromotedM) {
-  AssemblyEmitterImpl Em(dummyFunctionName);
-  unsigned TotalStackUsage = 0;
-  for (auto &F : *DepromotedM) {
-    if (F.isDeclaration())
-      continue;
-
-    Em.visit(F);
-    *fout << "\n";
-    *fout << "; Function " << F.getName() << "\n";
-    *fout << "start " << F.getName() << " " << F.arg_size() << ":\n";
-
-    assert(Em.FnBody.size() > 0);
-
-    *fout << "  " << Em.FnBody[0] << "\n";
-
-    for (unsigned i = 1; i < Em.FnBody.size(); ++i) {
-      assert(Em.FnBody[i].size() > 0);
-      if (Em.FnBody[i][0] == '.')
-        // Basic block
-        *fout << "\n  " << Em.FnBody[i] << "\n";
-
-      else
-        // Instruction
-        *fout << "    " << Em.FnBody[i] << "\n";
+static void emitFunction(AssemblyEmitterImpl &Em, Function &F) {
+  // The start line only needs the argument count, so the body can follow
+  // it as it is emitted.
+  raw_ostream &fout = *Em.fout;
+  fout << "\n";
+  fout << "; Function " << F.getName() << "\n";
+  fout << "start " << F.getName() << " " << F.arg_size() << ":\n";
+  Em.visit(F);
+  fout << "end " << F.getName() << "\n";
+}
+
+string NewAssemblyEmitter::emit(Function &F) {
+  string Body;
+  raw_string_ostream OS(Body);
+  AssemblyEmitterImpl Em(dummyFunctionName, assignment, &OS);
+  emitFunction(Em, F);
+  OS.flush();
+  return Body;
+}
+
+vector<string> NewAssemblyEmitter::emit(ArrayRef<Function*> Functions) {
+  // Each thread takes the next function nobody has taken yet, so a few
+  // large functions do not hold up the rest.
+  vector<string> Bodies(Functions.size());
+  atomic<size_t> Next(0);
+  auto Work = [&]() {
+    AssemblyEmitterImpl Em(dummyFunctionName, assignment, nullptr);
+    for (size_t Idx = Next++; Idx < Functions.size(); Idx = Next++) {
+      raw_string_ostream OS(Bodies[Idx]);
+      Em.fout = &OS;
+      emitFunction(Em, *Functions[Idx]);
+      OS.flush();
     }
+  };
+  unsigned NumThreads = min<size_t>(jobs, Functions.size());
+  vector<thread> Threads;
+  for (unsigned Idx = 1; Idx < NumThreads; ++Idx)
+    Threads.emplace_back(Work);
+  Work();
+  for (thread &T : Threads)
+    T.join();
+  return Bodies;
+}
 
-    *fout << "end " << F.getName() << "\n";
+void NewAssemblyEmitter::run(Module *DepromotedM) {
+  vector<Function*> Functions;
+  for (auto &F : *DepromotedM)
+    if (!F.isDeclaration())
+      Functions.push_back(&F);
+
+  if (min<size_t>(jobs, Functions.size()) <= 1) {
+    AssemblyEmitterImpl Em(dummyFunctionName, assignment, fout);
+    for (Function *F : Functions)
+      emitFunction(Em, *F);
+    return;
   }
+  for (string &Body : emit(Functions))
+    *fout << Body;
 }
@@ -0,0 +1,116 @@
+#include "RegPressureLICM.h"
+#include "LoopUnrolling.h"
+#include "SWPPCost.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include <cmath>
+
+using namespace llvm;
+using namespace std;
+
+// What runtime unrolling adds to the pressure of an innermost loop: the
+// RUNTIME_EXTRA_REGS it keeps live, and about as many again where the
+// temporaries of one copy overlap those of the next.
+#define RUNTIME_UNROLL_PRESSURE (RUNTIME_EXTRA_REGS * 2)
+
+// Whether nothing in L may write to what LI reads.
+static bool isLoadUnclobbered(LoadInst *LI, Loop &L, AAResults &AA) {
+  MemoryLocation Loc = MemoryLocation::get(LI);
+  for (BasicBlock *BB : L.blocks())
+    for (Instruction &I : *BB)
+      if (I.mayWriteToMemory() && isModSet(AA.getModRefInfo(&I, Loc)))
+        return false;
+  return true;
+}
+
+// Values LICM can hoist out of L that then stay live through the whole
+// loop: invariant computations still used by something in the loop. Loads
+// count if their address is invariant and nothing in the loop may store
+// there; whether they are also safe to hoist is left to LICM, so this is an
+// upper bound.
+static set<Instruction*> findHoistedLiveValues(Loop &L, AAResults &AA) {
+  set<Instruction*> hoisted;
+  auto isInvariant = [&](Value *V) {
+    auto *I = dyn_cast<Instruction>(V);
+    return !I || !L.contains(I) || hoisted.count(I);
+  };
+  bool updated = true;
+  while (updated) {
+    updated = false;
+    for (BasicBlock *BB : L.blocks()) {
+      for (Instruction &I : *BB) {
+        if (hoisted.count(&I) || isa<PHINode>(I) || I.isTerminator() ||
+            !needsOwnRegister(&I) || !all_of(I.operands(), isInvariant))
+          continue;
+        auto *LI = dyn_cast<LoadInst>(&I);
+        if (I.mayReadOrWriteMemory() &&
+            !(LI && LI->isSimple() && isLoadUnclobbered(LI, L, AA)))
+          continue;
+        if (I.mayHaveSideEffects())
+          continue;
+        hoisted.insert(&I);
+        updated = true;
+      }
+    }
+  }
+
+  set<Instruction*> live;
+  for (Instruction *I : hoisted)
+    if (any_of(I->users(), [&](User *U) {
+          auto *UI = cast<Instruction>(U);
+          return L.contains(UI) && !hoisted.count(UI);
+        }))
+      live.insert(I);
+  return live;
+}
+
+// How often BB runs per iteration of L.
+static double getFreqIn(Loop &L, BasicBlock *BB, LoopInfo &LI) {
+  return pow(EXPECTED_TRIPS, LI.getLoopDepth(BB) - L.getLoopDepth());
+}
+
+// LICM with a register budget. Every hoisted value that is still used in
+// the loop takes a register for the whole loop; if the loop already needs
+// most of the REG_SIZE registers, hoisting would only turn recomputation
+// into spills, so the loop is left alone.
+//
+// LoopUnrolling runs later and may runtime unroll the innermost loops,
+// which raises their pressure by RUNTIME_UNROLL_PRESSURE. Where that
+// reaches REG_SIZE the backend already spills, about once per unrolled
+// iteration, so hoisting into such a loop must save more than that. Loops
+// with a constant trip count are unrolled without a remainder loop, if at
+// all, and keep the plain budget.
+PreservedAnalyses RegPressureLICM::run(Loop &L, LoopAnalysisManager &LAM,
+                                       LoopStandardAnalysisResults &AR,
+                                       LPMUpdater &U) {
+  RegPressure RP(*L.getHeader()->getParent());
+  set<Instruction*> hoisted = findHoistedLiveValues(L, AR.AA);
+  double saved = 0;
+  for (Instruction *I : hoisted)
+    saved += getSWPPCost(I) * getFreqIn(L, I->getParent(), AR.LI);
+
+  double spilled = 0;
+  for (BasicBlock *BB : L.blocks()) {
+    unsigned pressure = RP.getMaxPressure(BB);
+    if (pressure + hoisted.size() > REG_SIZE)
+      return PreservedAnalyses::all();
+    Loop *Inner = AR.LI.getLoopFor(BB);
+    unsigned count = getPartialUnrollCount(Inner);
+    if (!Inner->getSubLoops().empty() || count < 2 ||
+        AR.SE.getSmallConstantTripCount(Inner))
+      continue;
+    // a value from outside Inner used in it is live all through it already
+    unsigned added = count_if(hoisted, [&](Instruction *I) {
+      return Inner->contains(I) || none_of(I->users(), [&](User *U) {
+               return Inner->contains(cast<Instruction>(U));
+             });
+    });
+    if (added && pressure + added + RUNTIME_UNROLL_PRESSURE >= REG_SIZE)
+      spilled = max(spilled, SPILL_COST * getFreqIn(L, BB, AR.LI) / count);
+  }
+  if (spilled > 0 && saved <= spilled)
+    return PreservedAnalyses::all();
+  return LICMPass().run(L, LAM, AR, U);
+}
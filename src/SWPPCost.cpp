@@ -0,0 +1,216 @@
+#include "SWPPCost.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Instructions.h"
+
+using namespace llvm;
+using namespace std;
+
+double getSWPPCost(const Instruction *I) {
+  switch (I->getOpcode()) {
+  case Instruction::Mul:
+  case Instruction::UDiv:
+  case Instruction::SDiv:
+  case Instruction::URem:
+  case Instruction::SRem:
+    return COST_MUL;
+  case Instruction::Shl:
+  case Instruction::LShr:
+  case Instruction::AShr:
+  case Instruction::And:
+  case Instruction::Or:
+  case Instruction::Xor:
+  case Instruction::ZExt:
+    return COST_LOGIC;
+  case Instruction::Add:
+  case Instruction::Sub:
+    return COST_ADD;
+  case Instruction::SExt:
+    return COST_MUL + COST_LOGIC;
+  case Instruction::ICmp:
+    return COST_ICMP;
+  case Instruction::Select:
+    return COST_SELECT;
+  case Instruction::GetElementPtr:
+    // one mul + add per variable index
+    return (I->getNumOperands() - 1) * (COST_MUL + COST_ADD);
+  case Instruction::Load:
+  case Instruction::Store:
+    return COST_MEM;
+  case Instruction::PHI:
+    // depPhi turns a phi into a stack slot, each edge stores into it
+    return COST_MEM * 2;
+  case Instruction::Br:
+    return COST_BR;
+  case Instruction::Switch:
+    return COST_SWITCH;
+  case Instruction::Ret:
+    return COST_RET;
+  case Instruction::Call: {
+    auto *CI = cast<CallInst>(I);
+    if (CI->getCalledFunction() &&
+        CI->getCalledFunction()->isIntrinsic())
+      return 0;
+    return COST_CALL + COST_CALL_ARG * CI->arg_size();
+  }
+  default:
+    return 0;
+  }
+}
+
+double getSWPPCost(const BasicBlock *BB) {
+  double cost = 0;
+  for (const Instruction &I : *BB)
+    cost += getSWPPCost(&I);
+  return cost;
+}
+
+double getSpillCost(unsigned pressure) {
+  return pressure > REG_SIZE ? (pressure - REG_SIZE) * SPILL_COST : 0;
+}
+
+bool needsOwnRegister(const Value *V) {
+  auto *I = dyn_cast<Instruction>(V);
+  if (!I || I->getType()->isVoidTy() || isa<AllocaInst>(I))
+    return false;
+  if (isa<TruncInst>(I) || isa<BitCastInst>(I) ||
+      isa<PtrToIntInst>(I) || isa<IntToPtrInst>(I))
+    return false;
+  return true;
+}
+
+bool canBeSelected(const Value *V) {
+  if (!V->getType()->isPointerTy())
+    return true;
+  return isa<Argument>(V) || isa<LoadInst>(V) || isa<CallInst>(V);
+}
+
+// Free casts are transparent, a use of one is a use of its source.
+const Value *getRegSource(const Value *V) {
+  while (auto *I = dyn_cast<Instruction>(V)) {
+    if (needsOwnRegister(I) || isa<AllocaInst>(I) || I->getType()->isVoidTy())
+      break;
+    V = I->getOperand(0);
+  }
+  return V;
+}
+
+RegPressure::RegPressure(Function &F) {
+  map<const BasicBlock*, set<const Value*>> uses, defs;
+  for (BasicBlock &BB : F) {
+    auto &U = uses[&BB];
+    auto &D = defs[&BB];
+    for (Instruction &I : BB) {
+      if (!isa<PHINode>(I)) {
+        for (Value *Op : I.operands()) {
+          const Value *Src = getRegSource(Op);
+          if (needsOwnRegister(Src) && !D.count(Src))
+            U.insert(Src);
+        }
+      }
+      if (needsOwnRegister(&I))
+        D.insert(&I);
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (auto It = F.getBasicBlockList().rbegin(),
+              E = F.getBasicBlockList().rend(); It != E; ++It) {
+      BasicBlock *BB = &*It;
+      set<const Value*> out;
+      for (BasicBlock *Succ : successors(BB)) {
+        for (const Value *V : liveIn[Succ])
+          out.insert(V);
+        for (PHINode &PN : Succ->phis()) {
+          const Value *Src =
+            getRegSource(PN.getIncomingValueForBlock(BB));
+          if (needsOwnRegister(Src))
+            out.insert(Src);
+        }
+      }
+      set<const Value*> in = uses[BB];
+      for (const Value *V : out)
+        if (!defs[BB].count(V))
+          in.insert(V);
+      if (out != liveOut[BB] || in != liveIn[BB]) {
+        liveOut[BB] = move(out);
+        liveIn[BB] = move(in);
+        changed = true;
+      }
+    }
+  }
+}
+
+unsigned RegPressure::getLiveInCount(const BasicBlock *BB) {
+  return liveIn[BB].size();
+}
+
+unsigned RegPressure::getLiveOutCount(const BasicBlock *BB) {
+  return liveOut[BB].size();
+}
+
+bool RegPressure::isLiveOut(const Value *V, const BasicBlock *BB) {
+  return liveOut[BB].count(getRegSource(V));
+}
+
+// Walks BB backwards from the values live out of it. Only the values
+// Counted accepts take a register.
+template <typename Pred>
+static unsigned walkPressure(const BasicBlock *BB,
+                             const set<const Value*> &liveOut,
+                             Pred Counted) {
+  set<const Value*> live;
+  for (const Value *V : liveOut)
+    if (Counted(V))
+      live.insert(V);
+  unsigned maxPressure = live.size();
+  for (auto It = BB->rbegin(), E = BB->rend(); It != E; ++It) {
+    const Instruction &I = *It;
+    live.erase(&I);
+    if (!isa<PHINode>(I)) {
+      for (const Value *Op : I.operands()) {
+        const Value *Src = getRegSource(Op);
+        if (needsOwnRegister(Src) && Counted(Src))
+          live.insert(Src);
+      }
+    }
+    maxPressure = max(maxPressure, (unsigned)live.size());
+  }
+  return maxPressure;
+}
+
+unsigned RegPressure::getMaxPressure(const BasicBlock *BB) {
+  return walkPressure(BB, liveOut[BB], [](const Value *) { return true; });
+}
+
+unsigned RegPressure::getMaxPressure(const BasicBlock *BB,
+                                     const set<const BasicBlock*> &Region) {
+  return walkPressure(BB, liveOut[BB], [&](const Value *V) {
+    return Region.count(cast<Instruction>(V)->getParent()) != 0;
+  });
+}
+
+unsigned RegPressure::getLiveAcross(const Instruction *I) {
+  const BasicBlock *BB = I->getParent();
+  set<const Value*> live = liveOut[BB];
+  for (auto It = BB->rbegin(); &*It != I; ++It) {
+    live.erase(&*It);
+    if (!isa<PHINode>(*It)) {
+      for (const Value *Op : It->operands()) {
+        const Value *Src = getRegSource(Op);
+        if (needsOwnRegister(Src))
+          live.insert(Src);
+      }
+    }
+  }
+  live.erase(I);
+  return live.size();
+}
+
+unsigned RegPressure::getMaxPressure() {
+  unsigned maxPressure = 0;
+  for (auto &[BB, _] : liveIn)
+    maxPressure = max(maxPressure, getMaxPressure(BB));
+  return maxPressure;
+}
@@ -0,0 +1,120 @@
+#include "SWPPInlineAdvisor.h"
+#include "SWPPCost.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstIterator.h"
+#include <cmath>
+
+using namespace llvm;
+using namespace std;
+
+// Largest callee inlined at a call site outside loops; each loop around the
+// call site allows that many more instructions.
+#define MAX_INLINE_SIZE 256
+// What the callee pays to set up and drop its frame.
+#define FRAME_COST (COST_ADD * 2)
+
+// Whether F and G call each other, which the inliner has its own rules for.
+static bool isRecursive(Function &F, Function &G) {
+  if (&F == &G)
+    return true;
+  for (Instruction &I : instructions(G))
+    if (auto *CB = dyn_cast<CallBase>(&I))
+      if (CB->getCalledFunction() == &F)
+        return true;
+  return false;
+}
+
+// What the body of Callee spills each time it runs if extra more values
+// stay live through all of it. Spilled values are reloaded at the end of
+// every block that evicts them, so this adds up over the loop iterations.
+static double getExtraSpillCost(Function &Callee, LoopInfo &LI,
+                                unsigned extra) {
+  if (!extra)
+    return 0;
+  RegPressure RP(Callee);
+  double cost = 0;
+  for (BasicBlock &BB : Callee) {
+    unsigned pressure = RP.getMaxPressure(&BB);
+    cost += pow(EXPECTED_TRIPS, LI.getLoopDepth(&BB)) *
+            (getSpillCost(pressure + extra) - getSpillCost(pressure));
+  }
+  return cost;
+}
+
+static unsigned getSize(Function &F) {
+  unsigned size = 0;
+  for (BasicBlock &BB : F)
+    size += BB.size();
+  return size;
+}
+
+// Decides each call of F for the inliner that runs next: the call site is
+// marked alwaysinline or noinline, which the inliner follows instead of
+// its own thresholds. Those are tuned for x86 code size; on SWPP code size
+// costs nothing and a call costs a fixed amount per argument, but the
+// inlined body has to share the registers with whatever the caller keeps
+// across the call, while a callee starts with all of them free.
+PreservedAnalyses SWPPInlineAdvisor::run(Function &F,
+                                         FunctionAnalysisManager &FAM) {
+  vector<CallBase*> Calls;
+  for (Instruction &I : instructions(F)) {
+    auto *CB = dyn_cast<CallBase>(&I);
+    if (!CB)
+      continue;
+    Function *Callee = CB->getCalledFunction();
+    if (!Callee || Callee->isDeclaration() || CB->isNoInline() ||
+        CB->hasFnAttr(Attribute::AlwaysInline) ||
+        Callee->hasFnAttribute(Attribute::NoInline) ||
+        isRecursive(F, *Callee))
+      continue;
+    Calls.push_back(CB);
+  }
+  if (Calls.empty())
+    return PreservedAnalyses::all();
+
+  LoopInfo &LI = FAM.getResult<LoopAnalysis>(F);
+  OptimizationRemarkEmitter ORE(&F);
+  RegPressure RP(F);
+  for (CallBase *CB : Calls) {
+    Function *Callee = CB->getCalledFunction();
+    unsigned depth = LI.getLoopDepth(CB->getParent());
+    double freq = pow(EXPECTED_TRIPS, depth);
+
+    // Once inlined, the body shares the registers with the values the
+    // caller keeps across the call, and with the arguments, which the
+    // callee would have found in argN.
+    unsigned extra = RP.getLiveAcross(CB);
+    for (Value *Arg : CB->args())
+      extra += needsOwnRegister(getRegSource(Arg));
+    DominatorTree CalleeDT(*Callee);
+    LoopInfo CalleeLI(CalleeDT);
+    double spillCost = getExtraSpillCost(*Callee, CalleeLI, extra);
+    double saved = COST_CALL + CB->arg_size() * COST_CALL_ARG + COST_RET +
+                   FRAME_COST;
+    double gain = freq * (saved - spillCost);
+    unsigned size = getSize(*Callee);
+
+    // A callee with loops costs far more than its call, and how its loops
+    // fare among the caller's values is beyond this estimate. Unless it
+    // would spill, that call is left to the inliner's own threshold.
+    const char *Advice;
+    if (gain <= 0 || size > MAX_INLINE_SIZE * (1 + depth)) {
+      Advice = "keep call";
+      CB->setIsNoInline();
+    } else if (CalleeLI.empty()) {
+      Advice = "inline";
+      CB->addAttribute(AttributeList::FunctionIndex, Attribute::AlwaysInline);
+    } else {
+      Advice = "left to the inliner";
+    }
+    ORE.emit([&]() {
+      OptimizationRemarkAnalysis R("swpp-inline", "Advice", CB);
+      R << Callee->getName() << ": " << Advice << ", estimated gain "
+        << ore::NV("Gain", (int)gain) << " with " << ore::NV("Extra", extra)
+        << " more live values, callee size " << ore::NV("Size", size);
+      return R;
+    });
+  }
+  return PreservedAnalyses::none();
+}
@@ -0,0 +1,310 @@
+#include "SwitchOptimization.h"
+#include "SWPPCost.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/IR/ConstantRange.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include <map>
+
+using namespace llvm;
+using namespace std;
+
+// A range check is turned into switch cases only if it covers at most this
+// many values.
+#define MAX_RANGE_CASES 8
+
+// The emitter compares the whole 64-bit register against the case values,
+// while icmp only looks at the low bits. Only switch on values whose upper
+// bits LessSimpleBackend keeps zero.
+static bool isCleanInRegister(Value *V) {
+  if (V->getType()->getIntegerBitWidth() == 64)
+    return true;
+  return isa<BinaryOperator>(V) || isa<LoadInst>(V) || isa<CmpInst>(V) ||
+         isa<PHINode>(V);
+}
+
+// One block of an icmp/br chain: if X is in Vals go to Dest, else go on
+// to Next.
+struct ChainLink {
+  BasicBlock *BB;
+  Value *X;
+  vector<ConstantInt*> Vals;
+  BasicBlock *Dest;
+  BasicBlock *Next;
+};
+
+static bool getChainLink(BasicBlock *BB, ChainLink &Link) {
+  auto *BI = dyn_cast<BranchInst>(BB->getTerminator());
+  if (!BI || BI->isUnconditional())
+    return false;
+  auto *II = dyn_cast<ICmpInst>(BI->getCondition());
+  if (!II || !II->hasOneUse() || !II->getOperand(0)->getType()->isIntegerTy())
+    return false;
+  Value *X = II->getOperand(0);
+  auto *C = dyn_cast<ConstantInt>(II->getOperand(1));
+  ICmpInst::Predicate Pred = II->getPredicate();
+  if (!C) {
+    X = II->getOperand(1);
+    C = dyn_cast<ConstantInt>(II->getOperand(0));
+    Pred = II->getSwappedPredicate();
+  }
+  if (!C || !isCleanInRegister(X) ||
+      BI->getSuccessor(0) == BI->getSuccessor(1))
+    return false;
+
+  ConstantRange R = ConstantRange::makeExactICmpRegion(Pred, C->getValue());
+  Link.BB = BB;
+  Link.X = X;
+  Link.Dest = BI->getSuccessor(0);
+  Link.Next = BI->getSuccessor(1);
+  if (R.isSizeLargerThan(MAX_RANGE_CASES)) {
+    R = R.inverse();
+    swap(Link.Dest, Link.Next);
+    if (R.isSizeLargerThan(MAX_RANGE_CASES))
+      return false;
+  }
+  Link.Vals.clear();
+  for (APInt V = R.getLower(); V != R.getUpper(); ++V)
+    Link.Vals.push_back(ConstantInt::get(BB->getContext(), V));
+  return !Link.Vals.empty();
+}
+
+// Blocks after the first one must do nothing but the compare.
+static bool isInnerLink(BasicBlock *BB) {
+  return BB->size() == 2 && BB->getSinglePredecessor() != nullptr;
+}
+
+// Whether redirecting the edge From->Dest to come from Head keeps the phis
+// of Dest consistent with the other edges Head will have into Dest.
+static bool phisAgree(BasicBlock *Dest, BasicBlock *From,
+                      map<BasicBlock*, BasicBlock*> &firstFrom) {
+  if (!firstFrom.count(Dest))
+    return true;
+  for (PHINode &PN : Dest->phis())
+    if (PN.getIncomingValueForBlock(From) !=
+        PN.getIncomingValueForBlock(firstFrom[Dest]))
+      return false;
+  return true;
+}
+
+// Collapses a chain of compares of one value against constants into a
+// switch. On SWPP a switch costs as much as one branch, whatever the number
+// of cases.
+static bool formSwitch(BasicBlock *Head) {
+  ChainLink Link;
+  if (!getChainLink(Head, Link))
+    return false;
+  // Let the first block of the chain do the work.
+  if (BasicBlock *Pred = Head->getSinglePredecessor()) {
+    ChainLink PredLink;
+    if (isInnerLink(Head) && getChainLink(Pred, PredLink) &&
+        PredLink.X == Link.X && PredLink.Next == Head)
+      return false;
+  }
+
+  Value *X = Link.X;
+  vector<ChainLink> chain;
+  map<BasicBlock*, BasicBlock*> firstFrom;
+  set<BasicBlock*> chainBlocks;
+  while (true) {
+    if (!phisAgree(Link.Dest, Link.BB, firstFrom) ||
+        chainBlocks.count(Link.Dest))
+      break;
+    chain.push_back(Link);
+    chainBlocks.insert(Link.BB);
+    firstFrom.emplace(Link.Dest, Link.BB);
+    BasicBlock *Next = Link.Next;
+    ChainLink NextLink;
+    if (chainBlocks.count(Next) || !isInnerLink(Next) ||
+        !getChainLink(Next, NextLink) || NextLink.X != X)
+      break;
+    Link = NextLink;
+  }
+  BasicBlock *Default = chain.back().Next;
+  if (chain.size() < 2 || chainBlocks.count(Default) ||
+      !phisAgree(Default, chain.back().BB, firstFrom))
+    return false;
+  firstFrom.emplace(Default, chain.back().BB);
+
+  // Reaching the k-th compare costs the k-1 compares in front of it.
+  double chainCost = 0;
+  for (unsigned i = 0; i < chain.size(); ++i)
+    chainCost += (COST_ICMP + COST_BR) * (chain.size() - i) / chain.size();
+  if (COST_SWITCH >= chainCost)
+    return false;
+
+  // Later compares of an already seen value are dead.
+  vector<pair<ConstantInt*, BasicBlock*>> cases;
+  set<uint64_t> seen;
+  MapVector<BasicBlock*, unsigned> edgeCount;
+  for (ChainLink &L : chain)
+    for (ConstantInt *C : L.Vals)
+      if (seen.insert(C->getZExtValue()).second) {
+        cases.push_back({C, L.Dest});
+        edgeCount[L.Dest]++;
+      }
+  edgeCount[Default]++;
+
+  for (auto &[Dest, count] : edgeCount) {
+    for (PHINode &PN : Dest->phis()) {
+      Value *V = PN.getIncomingValueForBlock(firstFrom[Dest]);
+      while (PN.getBasicBlockIndex(Head) >= 0)
+        PN.removeIncomingValue(Head, false);
+      for (unsigned i = 0; i < count; ++i)
+        PN.addIncoming(V, Head);
+    }
+  }
+
+  Instruction *OldTerm = Head->getTerminator();
+  Value *OldCond = cast<BranchInst>(OldTerm)->getCondition();
+  SwitchInst *SI = SwitchInst::Create(X, Default, cases.size(), OldTerm);
+  for (auto &[C, Dest] : cases)
+    SI->addCase(C, Dest);
+  OldTerm->eraseFromParent();
+  RecursivelyDeleteTriviallyDeadInstructions(OldCond);
+  for (unsigned i = 1; i < chain.size(); ++i)
+    DeleteDeadBlock(chain[i].BB);
+  return true;
+}
+
+// Lowers a switch whose targets only pick values for the phis of one
+// merging block into compares and selects. Contiguous cases that pick the
+// same values share one range check.
+static bool lowerSwitchToSelect(BasicBlock *BB) {
+  auto *SI = dyn_cast<SwitchInst>(BB->getTerminator());
+  if (!SI || SI->getNumCases() == 0)
+    return false;
+
+  BasicBlock *Tail = nullptr;
+  set<BasicBlock*> arms;
+  for (BasicBlock *Succ : successors(BB)) {
+    BasicBlock *Target = Succ;
+    if (Succ->size() == 1 && Succ->getSingleSuccessor() &&
+        Succ->getUniquePredecessor() == BB) {
+      Target = Succ->getSingleSuccessor();
+      arms.insert(Succ);
+    }
+    if (Tail && Tail != Target)
+      return false;
+    Tail = Target;
+  }
+  if (Tail == BB || arms.count(Tail))
+    return false;
+
+  // Values each phi of Tail gets along each edge of the switch.
+  auto getValues = [&](BasicBlock *Succ) {
+    vector<Value*> vals;
+    for (PHINode &PN : Tail->phis())
+      vals.push_back(PN.getIncomingValueForBlock(Succ == Tail ? BB : Succ));
+    return vals;
+  };
+  vector<Value*> defaultVals = getValues(SI->getDefaultDest());
+  MapVector<vector<Value*>, vector<APInt>, map<vector<Value*>, unsigned>>
+    groups;
+  for (auto Case : SI->cases()) {
+    vector<Value*> vals = getValues(Case.getCaseSuccessor());
+    for (Value *V : vals)
+      if (!canBeSelected(V))
+        return false;
+    groups[vals].push_back(Case.getCaseValue()->getValue());
+  }
+  for (Value *V : defaultVals)
+    if (!canBeSelected(V))
+      return false;
+
+  // Split each group into runs of consecutive case values.
+  vector<pair<vector<Value*>, pair<APInt, APInt>>> runs;
+  for (auto &[vals, caseVals] : groups) {
+    if (vals == defaultVals)
+      continue;
+    std::sort(caseVals.begin(), caseVals.end(),
+         [](const APInt &a, const APInt &b) { return a.ult(b); });
+    APInt lo = caseVals[0], hi = caseVals[0];
+    for (unsigned i = 1; i <= caseVals.size(); ++i) {
+      if (i < caseVals.size() && caseVals[i] == hi + 1) {
+        hi = caseVals[i];
+        continue;
+      }
+      runs.push_back({vals, {lo, hi}});
+      if (i < caseVals.size())
+        lo = hi = caseVals[i];
+    }
+  }
+
+  unsigned phiCount = defaultVals.size();
+  bool mergesTail = true;
+  for (BasicBlock *Pred : predecessors(Tail))
+    if (Pred != BB && !arms.count(Pred))
+      mergesTail = false;
+
+  double selectCost = mergesTail ? 0 : COST_BR;
+  for (auto &[vals, range] : runs) {
+    selectCost += COST_ICMP;
+    if (range.first != range.second && !range.first.isNullValue())
+      selectCost += COST_ADD;
+    for (unsigned i = 0; i < phiCount; ++i)
+      if (vals[i] != defaultVals[i])
+        selectCost += COST_SELECT;
+  }
+  unsigned armEdges = 0;
+  for (BasicBlock *Succ : successors(BB))
+    armEdges += arms.count(Succ);
+  double switchCost = COST_SWITCH +
+    (double)armEdges / SI->getNumSuccessors() * COST_BR +
+    (mergesTail ? phiCount * COST_MEM * 2 : 0);
+  if (selectCost >= switchCost)
+    return false;
+
+  IRBuilder<> Builder(SI);
+  Value *X = SI->getCondition();
+  vector<Value*> newVals = defaultVals;
+  for (auto &[vals, range] : runs) {
+    auto &[lo, hi] = range;
+    Value *Cond;
+    if (lo == hi) {
+      Cond = Builder.CreateICmpEQ(X, ConstantInt::get(X->getType(), lo));
+    } else {
+      Value *Off = X;
+      if (!lo.isNullValue())
+        Off = Builder.CreateAdd(X, ConstantInt::get(X->getType(), -lo));
+      Cond = Builder.CreateICmpULE(Off,
+                                   ConstantInt::get(X->getType(), hi - lo));
+    }
+    for (unsigned i = 0; i < phiCount; ++i)
+      if (vals[i] != defaultVals[i])
+        newVals[i] = Builder.CreateSelect(Cond, vals[i], newVals[i]);
+  }
+
+  unsigned idx = 0;
+  for (PHINode &PN : Tail->phis()) {
+    while (PN.getBasicBlockIndex(BB) >= 0)
+      PN.removeIncomingValue(BB, false);
+    PN.addIncoming(newVals[idx++], BB);
+  }
+  BranchInst::Create(Tail, SI);
+  SI->eraseFromParent();
+  for (BasicBlock *Arm : arms)
+    DeleteDeadBlock(Arm);
+  MergeBlockIntoPredecessor(Tail);
+  return true;
+}
+
+PreservedAnalyses SwitchOptimization::run(Function &F,
+                                          FunctionAnalysisManager &FAM) {
+  bool changed = false;
+  bool updated = true;
+  while (updated) {
+    updated = false;
+    for (BasicBlock &BB : F) {
+      if (formSwitch(&BB) || lowerSwitchToSelect(&BB)) {
+        updated = changed = true;
+        break;
+      }
+    }
+  }
+  if (!changed)
+    return PreservedAnalyses::all();
+  return PreservedAnalyses::none();
+}
@@ -0,0 +1,26 @@
+#include "TailRecursionElim.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+
+using namespace llvm;
+using namespace std;
+
+// Turns tail recursion into a loop, with LLVM's TailCallElimPass. That
+// pass also introduces an accumulator when the recursive call feeds an
+// associative and commutative operation, as in return x + f(y).
+//
+// Functions that call themselves more than once, like tree walks, keep
+// their calls: only the last one becomes a loop, every other call still
+// enters the function, and LessSimpleBackend keeps the new loop's header
+// phis on the stack. That costs more than the call and ret it saves.
+PreservedAnalyses TailRecursionElim::run(Function &F,
+                                         FunctionAnalysisManager &FAM) {
+  unsigned selfCalls = 0;
+  for (Instruction &I : instructions(F))
+    if (auto *CI = dyn_cast<CallInst>(&I))
+      selfCalls += CI->getCalledFunction() == &F;
+  if (selfCalls != 1)
+    return PreservedAnalyses::all();
+  return TailCallElimPass().run(F, FAM);
+}
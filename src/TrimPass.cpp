@@ -18,21 +18,26 @@ using namespace llvm;
 using namespace std;
 using namespace llvm::PatternMatch;
 
-vector <Function *> functions;
-set <Function *> used;
-
-void DFS(Function *F) {
-    used.insert(F);
-    for (auto &BB : *F)  
-        for (auto &I : BB)
-            if (auto *CB = dyn_cast<CallInst>(&I))
-                if (used.count(CB->getCalledFunction()) == 0) 
-                    DFS(CB->getCalledFunction());
-                    
-
+set<Function *> getReachableFunctions(
+    Function &Main, function_ref<void(Function &)> BeforeScan) {
+    set<Function *> used = {&Main};
+    vector<Function *> worklist = {&Main};
+    while (!worklist.empty()) {
+        Function *F = worklist.back();
+        worklist.pop_back();
+        BeforeScan(*F);
+        for (auto &BB : *F)
+            for (auto &I : BB)
+                if (auto *CB = dyn_cast<CallInst>(&I))
+                    if (Function *Callee = CB->getCalledFunction())
+                        if (used.insert(Callee).second)
+                            worklist.push_back(Callee);
+    }
+    return used;
 }
 
 PreservedAnalyses TrimPass::run(Module &M, ModuleAnalysisManager &MAM) {
+    vector<Function *> functions;
     Function *main = nullptr;
 
     for (Function &F : M.getFunctionList()) {
@@ -42,7 +47,7 @@ PreservedAnalyses TrimPass::run(Module &M, ModuleAnalysisManager &MAM) {
         functions.push_back(&F);
     }
     assert(main != nullptr);
-    DFS(main);
+    set<Function *> used = getReachableFunctions(*main, [](Function &) {});
 
     for (int i = 0; i < functions.size(); ++i) {
         if (used.count(functions[i]) == 0) {
@@ -1,9 +1,11 @@
 #include "SimpleBackend.h"
 
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/SourceMgr.h"
@@ -13,15 +15,36 @@
 /*****************************************************************************/
 #include "llvm/Transforms/IPO/DeadArgumentElimination.h"
 #include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/IPO/SCCP.h"
 #include "llvm/Transforms/Scalar/GVN.h"
 #include "ArithmeticOptimization.h"
 #include "llvm/Transforms/Scalar/DCE.h"
 #include "llvm/Transforms/IPO/GlobalOpt.h"
 #include "Alloca2reg.h"
+#include "LoopInterchange.h"
+#include "LoopTiling.h"
+#include "LoopFusion.h"
+#include "GlobalPromotion.h"
+#include "IdiomRecognition.h"
+#include "IfConversion.h"
+#include "SwitchOptimization.h"
+#include "LoopUnrolling.h"
+#include "RegPressureLICM.h"
+#include "llvm/Transforms/Scalar/EarlyCSE.h"
 #include "LessSimpleBackend.h"
 #include "TrimPass.h"
+#include "TailRecursionElim.h"
+#include "SWPPInlineAdvisor.h"
+#include "FunctionOutlining.h"
+#include "FunctionSpecialization.h"
+#include "CompilationCache.h"
+#include "CompileStats.h"
 /*****************************************************************************/
+#include <atomic>
+#include <set>
 #include <string>
+#include <thread>
 
 using namespace std;
 using namespace llvm;
@@ -29,60 +52,92 @@ using namespace llvm;
 static cl::OptionCategory optCategory("SWPP Compiler options");
 
 static cl::opt<string> optInput(
-    cl::Positional, cl::desc("<input bitcode file>"), cl::Required,
+    cl::Positional, cl::desc("<input bitcode file>"),
     cl::value_desc("filename"), cl::cat(optCategory));
 
 static cl::opt<string> optOutput(
-    "o", cl::desc("output assembly file"), cl::cat(optCategory), cl::Required,
+    "o", cl::desc("output assembly file"), cl::cat(optCategory),
     cl::init("a.s"));
 
 static cl::opt<bool> optPrintDepromotedModule(
     "print-depromoted-module", cl::desc("print depromoted module"),
     cl::cat(optCategory), cl::init(false));
 
-static llvm::ExitOnError ExitOnErr;
+static cl::opt<bool> optPrintSpillStats(
+    "print-spill-stats",
+    cl::desc("print the spills, reloads, register switches, resets, phi "
+             "copies and frame size of each function and loop to stderr"),
+    cl::cat(optCategory), cl::init(false));
+
+static cl::opt<unsigned> optJobs(
+    "j", cl::desc("threads allocating registers and emitting assembly for "
+                  "the functions, or with -batch, modules compiled at once"),
+    cl::cat(optCategory), cl::init(1));
+
+static cl::opt<string> optBatch(
+    "batch", cl::desc("compile the modules a manifest lists, one "
+                      "\"<input> <output>\" pair per line"),
+    cl::value_desc("manifest"), cl::cat(optCategory));
+
+static cl::opt<string> optCacheDir(
+    "cache-dir", cl::desc("keep the assembly of modules and functions in "
+                          "this directory and reuse it for the same input"),
+    cl::value_desc("directory"), cl::cat(optCategory));
+
+static cl::opt<bool> optLoopTiling(
+    "loop-tiling", cl::desc("tile loop nests by the simulated head travel"),
+    cl::cat(optCategory), cl::init(false));
+
+static cl::opt<bool> optTimeReport(
+    "time-report", cl::desc("print the time each pass and backend phase "
+                            "took to stderr"),
+    cl::cat(optCategory), cl::init(false));
+
+static cl::opt<string> optStatsJSON(
+    "stats-json-file", cl::desc("write the time and peak RSS growth of each pass "
+                           "and backend phase, for each function, as JSON"),
+    cl::value_desc("filename"), cl::cat(optCategory));
 
 
 // adapted from llvm-dis.cpp
 static unique_ptr<Module> openInputFile(LLVMContext &Context,
-                                        string InputFilename) {
-  auto MB = ExitOnErr(errorOrToExpected(MemoryBuffer::getFile(InputFilename)));
+                                        unique_ptr<MemoryBuffer> MB) {
+  string Name = MB->getBufferIdentifier().str();
   SMDiagnostic Diag;
   auto M = getLazyIRModule(move(MB), Diag, Context, true);
   if (!M) {
     Diag.print("", errs(), false);
     return 0;
   }
-  ExitOnErr(M->materializeAll());
+  // Only the functions main calls are read from bitcode, and only those
+  // are optimized; TrimPass would delete the others anyway. Text IR is
+  // read whole, but dead functions still drop out here.
+  Error Err = Error::success();
+  if (Function *Main = M->getFunction("main")) {
+    set<Function *> Reached = getReachableFunctions(*Main, [&](Function &F) {
+      Err = joinErrors(move(Err), F.materialize());
+    });
+    for (Function &F : *M)
+      if (!Reached.count(&F) && !F.isDeclaration()) {
+        F.deleteBody();
+        F.setComdat(nullptr);
+      }
+  }
+  Err = joinErrors(move(Err), M->materializeAll());
+  if (Err) {
+    logAllUnhandledErrors(move(Err), errs(), Name + ": ");
+    return 0;
+  }
   return M;
 }
 
-int main(int argc, char **argv) {
-  sys::PrintStackTraceOnErrorSignal(argv[0]);
-  PrettyStackTraceProgram X(argc, argv);
-  EnableDebugBuffering = true;
-
-  cl::ParseCommandLineOptions(argc, argv);
-
-  LLVMContext Context;
-  // Read the module
-  auto M = openInputFile(Context, optInput);
-  if (!M)
-    return 1;
-
-  LoopAnalysisManager LAM;
-  FunctionAnalysisManager FAM;
-  CGSCCAnalysisManager CGAM;
-  ModuleAnalysisManager MAM;
-  PassBuilder PB;
-
-  // Register all the basic analyses with the managers.
-  PB.registerModuleAnalyses(MAM);
-  PB.registerCGSCCAnalyses(CGAM);
-  PB.registerFunctionAnalyses(FAM);
-  PB.registerLoopAnalyses(LAM);
-  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
-
+// The passes that compile a module to OutputFile. The backend keeps the
+// output file and what it learns about the module, so every module gets a
+// pipeline of its own. Failed is set if the backend cannot finish.
+static ModulePassManager buildPipeline(const string &OutputFile,
+                                       unsigned Jobs,
+                                       const CompilationCache *Cache,
+                                       CompileStats *Stats, bool *Failed) {
   // Function-level pass
   FunctionPassManager FPM;
   // If you want to add a function-level pass, add FPM.addPass(MyPass()) here.
@@ -90,21 +145,316 @@ int main(int argc, char **argv) {
   FPM.addPass(ArithmeticOptimization());
   FPM.addPass(DCEPass());
   FPM.addPass(Alloca2reg());
+  FPM.addPass(LoopInterchange());
+  // The tiling model follows the head from access to access, but the
+  // backend keeps loop counters on the stack and resets the head on each
+  // way back to the heap; measured, tiles only cost more. Off until the
+  // counters stay in registers.
+  if (optLoopTiling)
+    FPM.addPass(LoopTiling());
+  FPM.addPass(LoopFusion());
+  FPM.addPass(GlobalPromotion());
+  FPM.addPass(IdiomRecognition());
+  LoopPassManager LPM;
+  LPM.addPass(RegPressureLICM());
+  FPM.addPass(createFunctionToLoopPassAdaptor(std::move(LPM)));
+  FPM.addPass(EarlyCSEPass());
+  FPM.addPass(SwitchOptimization());
+  FPM.addPass(IfConversion());
+  FPM.addPass(LoopUnrolling());
+  FPM.addPass(DCEPass());
 
   // CGSCC-level pass
   CGSCCPassManager CGPM;
+  // Recursion turned into loops before inlining, so that callers inline
+  // the loops and every level stops paying for a call and a ret. The
+  // advisor then decides each call site for the inliner.
+  FunctionPassManager PreInlineFPM;
+  PreInlineFPM.addPass(TailRecursionElim());
+  PreInlineFPM.addPass(SWPPInlineAdvisor());
+  CGPM.addPass(createCGSCCToFunctionPassAdaptor(std::move(PreInlineFPM)));
   CGPM.addPass(InlinerPass());
 
   ModulePassManager MPM;
+  // The program is all in this module, so only main has to keep its
+  // signature; that lets constants flow into the other functions.
+  MPM.addPass(InternalizePass([](const GlobalValue &GV) {
+    return GV.getName() == "main";
+  }));
+  MPM.addPass(IPSCCPPass());
+  MPM.addPass(FunctionSpecialization());
   MPM.addPass(createModuleToPostOrderCGSCCPassAdaptor(std::move(CGPM)));
   MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
   // If you want to add your module-level pass, add MPM.addPass(MyPass2()) here.
+  MPM.addPass(FunctionOutlining());
   MPM.addPass(DeadArgumentEliminationPass());
   MPM.addPass(GlobalOptPass());
   //MPM.addPass(SimpleBackend(optOutput, optPrintDepromotedModule));
   MPM.addPass(TrimPass());
-  MPM.addPass(LessSimpleBackend(optOutput, optPrintDepromotedModule));
-  MPM.run(*M, MAM);
+  MPM.addPass(LessSimpleBackend(OutputFile, optPrintDepromotedModule,
+                                optPrintSpillStats, Jobs, Cache, Stats,
+                                Failed));
+  return MPM;
+}
+
+static bool writeOutput(const string &OutputFile, StringRef Text) {
+  if (OutputFile == "-") {
+    outs() << Text;
+    return true;
+  }
+  error_code EC;
+  raw_fd_ostream OS(OutputFile, EC);
+  if (EC) {
+    errs() << "Cannot open file: " << OutputFile << "\n";
+    return false;
+  }
+  OS << Text;
+  return true;
+}
+
+// Compiles modules one after another in a context of its own, with the
+// analyses registered once.
+class Compiler {
+  const CompilationCache *Cache;
+  // Null unless the passes are timed.
+  unique_ptr<CompileStats> Stats;
+  LLVMContext Context;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassInstrumentationCallbacks PIC;
+  PassBuilder PB;
+
+  void takeRecords(vector<CompileStats::Record> *Records) {
+    if (Stats) {
+      *Records = Stats->getRecords();
+      Stats->clear();
+    }
+  }
+
+public:
+  Compiler(const CompilationCache *Cache, bool CollectStats) :
+      Cache(Cache), PB(nullptr, PipelineTuningOptions(), None, &PIC) {
+    if (CollectStats) {
+      Stats = make_unique<CompileStats>();
+      Stats->registerCallbacks(PIC);
+    }
+    // Register all the basic analyses with the managers.
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  }
+
+  // Records gets what the passes and phases took, if they are timed.
+  bool compile(const string &InputFile, const string &OutputFile,
+               unsigned Jobs, vector<CompileStats::Record> *Records) {
+    auto MBOrErr = MemoryBuffer::getFile(InputFile);
+    if (!MBOrErr) {
+      errs() << InputFile << ": " << MBOrErr.getError().message() << "\n";
+      return false;
+    }
+    // The same module compiled by the same build with the same options
+    // gives the same assembly. Printing the depromoted module or the
+    // spill stats needs the module compiled.
+    string Key;
+    if (Cache && !optPrintDepromotedModule && !optPrintSpillStats) {
+      Key = Cache->getKey("module", {(*MBOrErr)->getBuffer()});
+      string Text;
+      bool Hit, Written = false;
+      {
+        // Timed as a phase of its own, so that a module that ran no passes
+        // still shows up in the report.
+        CompileStats::Timer T(Stats.get(), "backend", "cachedModule",
+                              InputFile);
+        Hit = Cache->lookup(Key, Text);
+        if (Hit)
+          Written = writeOutput(OutputFile, Text);
+      }
+      if (Hit) {
+        takeRecords(Records);
+        return Written;
+      }
+      if (Stats)
+        Stats->clear();
+    }
+
+    // Read the module
+    auto M = openInputFile(Context, move(*MBOrErr));
+    if (!M)
+      return false;
+    bool Failed = false;
+    ModulePassManager MPM = buildPipeline(OutputFile, Jobs, Cache,
+                                          Stats.get(), &Failed);
+    MPM.run(*M, MAM);
+    // The results cached so far belong to a module about to go away.
+    LAM.clear();
+    FAM.clear();
+    CGAM.clear();
+    MAM.clear();
+
+    takeRecords(Records);
+    if (Failed)
+      return false;
+    if (!Key.empty() && OutputFile != "-")
+      if (auto Output = MemoryBuffer::getFile(OutputFile))
+        Cache->store(Key, (*Output)->getBuffer());
+    return true;
+  }
+};
+
+// Reads the "<input> <output>" pairs of a manifest. Empty lines and lines
+// starting with # are skipped.
+static bool readManifest(const string &ManifestFile,
+                         vector<pair<string, string>> &Jobs) {
+  auto MBOrErr = MemoryBuffer::getFile(ManifestFile);
+  if (!MBOrErr) {
+    errs() << ManifestFile << ": " << MBOrErr.getError().message() << "\n";
+    return false;
+  }
+  SmallVector<StringRef, 0> Lines;
+  (*MBOrErr)->getBuffer().split(Lines, '\n');
+  for (unsigned Idx = 0; Idx < Lines.size(); ++Idx) {
+    StringRef Line = Lines[Idx].trim();
+    if (Line.empty() || Line.startswith("#"))
+      continue;
+    SmallVector<StringRef, 2> Fields;
+    SplitString(Line, Fields);
+    if (Fields.size() != 2) {
+      errs() << ManifestFile << ":" << Idx + 1
+             << ": expected \"<input> <output>\"\n";
+      return false;
+    }
+    Jobs.push_back({Fields[0].str(), Fields[1].str()});
+  }
+  return true;
+}
+
+static bool isTimed() {
+  return optTimeReport || !optStatsJSON.empty();
+}
+
+// Prints and writes what the modules recorded, as the options ask.
+static bool reportStats(const ModuleStats &Stats) {
+  if (optTimeReport)
+    printTimeReport(errs(), Stats);
+  if (optStatsJSON.empty())
+    return true;
+  string JSON = formatv("{0:2}", toJSON(Stats)).str() + "\n";
+  return writeOutput(optStatsJSON, JSON);
+}
+
+// Modules compiled at once would write to stdout and stderr together, so
+// with more than one job nothing but errors may go there.
+static bool checkBatchOutputs(const vector<pair<string, string>> &Jobs) {
+  if (optJobs <= 1)
+    return true;
+  if (optPrintDepromotedModule || optPrintSpillStats) {
+    errs() << "-print-depromoted-module and -print-spill-stats cannot be "
+              "used with -batch and -j above 1\n";
+    return false;
+  }
+  for (auto &[Input, Output] : Jobs)
+    if (Output == "-") {
+      errs() << optBatch << ": " << Input << " is written to stdout, which "
+             << "cannot be shared with -j above 1\n";
+      return false;
+    }
+  return true;
+}
+
+// Compiles the modules of the manifest on optJobs threads, each taking the
+// next module nobody has taken yet. Returns how many failed.
+static unsigned compileBatch(const vector<pair<string, string>> &Jobs,
+                             const CompilationCache *Cache,
+                             ModuleStats &Stats) {
+  atomic<size_t> Next(0);
+  atomic<unsigned> Failed(0);
+  Stats.resize(Jobs.size());
+  auto Work = [&]() {
+    Compiler C(Cache, isTimed());
+    for (size_t Idx = Next++; Idx < Jobs.size(); Idx = Next++) {
+      Stats[Idx].first = Jobs[Idx].first;
+      if (!C.compile(Jobs[Idx].first, Jobs[Idx].second, 1,
+                     &Stats[Idx].second))
+        Failed++;
+    }
+  };
+  unsigned NumThreads = min<size_t>(optJobs, Jobs.size());
+  vector<thread> Threads;
+  for (unsigned Idx = 1; Idx < NumThreads; ++Idx)
+    Threads.emplace_back(Work);
+  Work();
+  for (thread &T : Threads)
+    T.join();
+  return Failed;
+}
+
+// The options that can change the assembly, for the cache keys: all of
+// the command line but the input, where the output goes, how many threads
+// write it, the cache and the stats. Each option is spelled -name=value
+// whether or not it came in one argument, and the options are sorted, so
+// neither the spelling nor the order matters.
+static string getOutputOptions(int argc, char **argv) {
+  static const set<StringRef> Ignored = {
+      "o", "j", "batch", "cache-dir", "time-report", "stats-json-file"};
+  StringMap<cl::Option*> &Registered = cl::getRegisteredOptions();
+  vector<string> Options;
+  for (int Idx = 1; Idx < argc; ++Idx) {
+    StringRef Arg = argv[Idx];
+    if (!Arg.startswith("-") || Arg == "-")
+      continue;
+    StringRef Name = Arg.ltrim('-').split('=').first;
+    string Option = "-" + Arg.ltrim('-').str();
+    auto It = Registered.find(Name);
+    if (Arg.find('=') == StringRef::npos && It != Registered.end() &&
+        It->second->getValueExpectedFlag() == cl::ValueRequired &&
+        Idx + 1 < argc)
+      Option += "=" + string(argv[++Idx]);
+    if (!Ignored.count(Name))
+      Options.push_back(Option);
+  }
+  llvm::sort(Options);
+  string Joined;
+  for (const string &Option : Options)
+    Joined += Option + '\n';
+  return Joined;
+}
+
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal(argv[0]);
+  PrettyStackTraceProgram X(argc, argv);
+  EnableDebugBuffering = true;
+
+  cl::ParseCommandLineOptions(argc, argv);
+
+  unique_ptr<CompilationCache> Cache;
+  if (!optCacheDir.empty()) {
+    static int Symbol;
+    Cache = make_unique<CompilationCache>(optCacheDir,
+                                          getBuildID(argv[0], &Symbol),
+                                          getOutputOptions(argc, argv));
+  }
 
-  return 0;
+  ModuleStats Stats;
+  if (!optBatch.empty()) {
+    vector<pair<string, string>> Jobs;
+    if (!readManifest(optBatch, Jobs))
+      return 1;
+    if (!checkBatchOutputs(Jobs))
+      return 1;
+    unsigned Failed = compileBatch(Jobs, Cache.get(), Stats);
+    return reportStats(Stats) && !Failed ? 0 : 1;
+  }
+  if (optInput.empty()) {
+    errs() << argv[0] << ": no input file, and no -batch manifest\n";
+    return 1;
+  }
+  Compiler C(Cache.get(), isTimed());
+  Stats.push_back({optInput, {}});
+  if (!C.compile(optInput, optOutput, optJobs, &Stats[0].second))
+    return 1;
+  return reportStats(Stats) ? 0 : 1;
 }
@@ -1,11 +1,18 @@
 #include "llvm/AsmParser/Parser.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/IRBuilder.h"
-#include "llvm/IR/Module.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/SourceMgr.h"
 #include "gtest/gtest.h"
-#include "LessSimpleBackend.h"
+#include "CompilationCache.h"
+#include "LessSimpleBackend.h"
+#include "LoopTiling.h"
+#include <chrono>
 
 using namespace llvm;
 using namespace std;
@@ -27,9 +34,10 @@ TEST(TestDemo, CheckMain) {
   raw_string_ostream os(str);
 
   std::vector<std::string> dummyFunctionName = {
-    "resetStack", "resetHeap", "spOffset", "spSub", "regSwitch", "temp_p_"
+    "resetStack", "resetHeap", "spOffset", "spSub", "regSwitch"
   };
-  NewAssemblyEmitter(&os, dummyFunctionName).run(M.get());
+  RegAssignment assignment;
+  NewAssemblyEmitter(&os, dummyFunctionName, assignment).run(M.get());
 
   str = os.str();
   // These strings should exist in the assembly!
@@ -37,6 +45,362 @@ TEST(TestDemo, CheckMain) {
   EXPECT_NE(str.find("end main"), string::npos);
 }
 
+TEST(LessSimpleBackend, FoldsConstantBranches) {
+  // Branches on undef and on constants have no register to test: they
+  // become plain jumps, and the blocks they no longer reach are dropped.
+  LLVMContext Context;
+  SMDiagnostic Err;
+  unique_ptr<Module> M = parseAssemblyString(R"(
+define i64 @main(i64 %x) {
+entry:
+  %a = add i64 %x, 1
+  br i1 undef, label %left, label %right
+left:
+  %p = phi i64 [ %a, %entry ], [ 7, %right ]
+  br i1 false, label %dead, label %exit
+right:
+  br label %left
+dead:
+  %d = mul i64 %p, 3
+  ret i64 %d
+exit:
+  ret i64 %p
+}
+)", Err, Context);
+  ASSERT_TRUE(M);
+
+  SmallString<128> Path;
+  ASSERT_FALSE(sys::fs::createTemporaryFile("sf-backend", "s", Path));
+  ModuleAnalysisManager MAM;
+  LessSimpleBackend(Path.str().str(), false).run(*M, MAM);
+  auto MBOrErr = MemoryBuffer::getFile(Path);
+  ASSERT_TRUE(bool(MBOrErr));
+  string str = (*MBOrErr)->getBuffer().str();
+  sys::fs::remove(Path);
+
+  EXPECT_NE(str.find("end main"), string::npos);
+  EXPECT_EQ(str.find(".right:"), string::npos);
+  EXPECT_EQ(str.find(".dead:"), string::npos);
+  EXPECT_EQ(str.find("mul"), string::npos);
+}
+
+// A module of NumFunctions functions, each a loop that loads more values
+// than there are registers and keeps them all until it adds them up, so
+// every function spills and reloads.
+static string buildSpillingModule(unsigned NumFunctions) {
+  const unsigned NumLoads = 20;
+  string IR = "define i64 @main() {\nentry:\n  ret i64 0\n}\n";
+  for (unsigned FIdx = 0; FIdx < NumFunctions; ++FIdx) {
+    IR += "define i64 @f" + to_string(FIdx) + "(i64* %p, i64 %n) {\n"
+          "entry:\n  br label %loop\nloop:\n"
+          "  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]\n"
+          "  %acc = phi i64 [ 0, %entry ], [ %s0, %loop ]\n";
+    for (unsigned Idx = 0; Idx < NumLoads; ++Idx) {
+      string N = to_string(Idx);
+      IR += "  %a" + N + " = getelementptr i64, i64* %p, i64 " +
+            to_string(Idx * (FIdx + 1)) + "\n  %v" + N +
+            " = load i64, i64* %a" + N + "\n";
+    }
+    IR += "  %s" + to_string(NumLoads) + " = add i64 %acc, %i\n";
+    for (unsigned Idx = NumLoads; Idx-- > 0;)
+      IR += "  %s" + to_string(Idx) + " = add i64 %s" + to_string(Idx + 1) +
+            ", %v" + to_string(Idx) + "\n";
+    IR += "  %i.next = add i64 %i, 1\n"
+          "  %c = icmp slt i64 %i.next, %n\n"
+          "  br i1 %c, label %loop, label %exit\n"
+          "exit:\n  ret i64 %s0\n}\n";
+  }
+  return IR;
+}
+
+static string runBackend(StringRef IR, unsigned Jobs) {
+  LLVMContext Context;
+  SMDiagnostic Err;
+  unique_ptr<Module> M = parseAssemblyString(IR, Err, Context);
+  if (!M)
+    return "";
+  SmallString<128> Path;
+  if (sys::fs::createTemporaryFile("sf-backend", "s", Path))
+    return "";
+  ModuleAnalysisManager MAM;
+  LessSimpleBackend(Path.str().str(), false, false, Jobs).run(*M, MAM);
+  auto MBOrErr = MemoryBuffer::getFile(Path);
+  string str = MBOrErr ? (*MBOrErr)->getBuffer().str() : "";
+  sys::fs::remove(Path);
+  return str;
+}
+
+TEST(LessSimpleBackend, JobsWriteSameText) {
+  // Registers are allocated for the functions on threads, each function
+  // with its own registers and frame, and the text stays the same.
+  string IR = buildSpillingModule(8);
+  string Serial = runBackend(IR, 1);
+  EXPECT_NE(Serial.find("end f7"), string::npos);
+  EXPECT_NE(Serial.find("store 8"), string::npos);
+  EXPECT_EQ(runBackend(IR, 4), Serial);
+}
+
+// A module of NumFunctions functions, each a chain of NumBlocks blocks of
+// about BlockSize instructions, with registers already assigned as the
+// backend leaves them. NumInsts is set to the instructions it holds.
+static unique_ptr<Module> buildEmitterModule(
+    LLVMContext &Context, RegAssignment &assignment, unsigned NumFunctions,
+    unsigned NumBlocks, unsigned BlockSize, unsigned &NumInsts) {
+  unique_ptr<Module> M(new Module("EmitterBench", Context));
+  auto *I64Ty = Type::getInt64Ty(Context);
+  auto *I64PtrTy = Type::getInt64PtrTy(Context);
+  auto *TestFTy = FunctionType::get(I64Ty, {I64Ty, I64Ty}, false);
+  Constant *Heap = ConstantExpr::getIntToPtr(
+      ConstantInt::get(I64Ty, 20480), I64PtrTy);
+  NumInsts = 0;
+  for (unsigned FIdx = 0; FIdx < NumFunctions; ++FIdx) {
+    Function *TestF = Function::Create(TestFTy, Function::ExternalLinkage,
+                                       "f" + to_string(FIdx), *M);
+    Value *Acc = TestF->getArg(0);
+    BasicBlock *BB = BasicBlock::Create(Context, ".entry", TestF);
+    for (unsigned BIdx = 0; BIdx < NumBlocks; ++BIdx) {
+      IRBuilder<> Builder(BB);
+      for (unsigned Idx = 0; Idx < BlockSize; Idx += 2) {
+        auto *Load = Builder.CreateLoad(Heap, "");
+        Value *Other = Idx % 4 ? (Value*)Load : TestF->getArg(1);
+        Acc = Builder.CreateAdd(Acc, Other);
+        assignment.setReg(Load, Idx % 15 + 1);
+        assignment.setReg(Acc, (Idx + 1) % 15 + 1);
+      }
+      Builder.CreateStore(Acc, Heap);
+      auto *Cond = Builder.CreateICmpEQ(Acc, ConstantInt::get(I64Ty, 0));
+      assignment.setReg(Cond, 16);
+      BasicBlock *Next = BasicBlock::Create(Context, ".bb", TestF);
+      Builder.CreateCondBr(Cond, Next, Next);
+      NumInsts += BlockSize + 3;
+      BB = Next;
+    }
+    IRBuilder<>(BB).CreateRet(Acc);
+  }
+  return M;
+}
+
+static string emitModule(Module &M, const RegAssignment &assignment,
+                         unsigned Jobs) {
+  std::vector<std::string> dummyFunctionName = {
+    "resetStack", "resetHeap", "spOffset", "spSub", "regSwitch"
+  };
+  string str;
+  raw_string_ostream os(str);
+  NewAssemblyEmitter(&os, dummyFunctionName, assignment, Jobs).run(&M);
+  os.flush();
+  return str;
+}
+
+TEST(NewAssemblyEmitter, JobsWriteSameText) {
+  // One job streams the functions out as it goes; more emit them on
+  // threads and must still write the same text.
+  LLVMContext Context;
+  RegAssignment assignment;
+  unsigned NumInsts;
+  auto M = buildEmitterModule(Context, assignment, 8, 3, 10, NumInsts);
+  string Serial = emitModule(*M, assignment, 1);
+  EXPECT_NE(Serial.find("end f7"), string::npos);
+  EXPECT_EQ(emitModule(*M, assignment, 4), Serial);
+}
+
+TEST(EmitterBench, DISABLED_LargeModule) {
+  // Reports how fast a large module is emitted. Run it with
+  // --gtest_also_run_disabled_tests --gtest_filter=EmitterBench.* to
+  // compare changes to the emitter.
+  const unsigned NumFunctions = 100, NumBlocks = 20, BlockSize = 50;
+  LLVMContext Context;
+  RegAssignment assignment;
+  unsigned NumInsts;
+  auto M = buildEmitterModule(Context, assignment, NumFunctions, NumBlocks,
+                              BlockSize, NumInsts);
+  for (unsigned Jobs : {1, 4}) {
+    auto Start = chrono::steady_clock::now();
+    string str = emitModule(*M, assignment, Jobs);
+    chrono::duration<double> Elapsed = chrono::steady_clock::now() - Start;
+
+    outs() << "Emitted " << NumInsts << " instructions, " << str.size()
+           << " bytes in " << format("%.3f", Elapsed.count()) << " s ("
+           << format("%.2f", NumInsts / Elapsed.count() / 1e6)
+           << " M instructions/s) with " << Jobs << " jobs\n";
+  }
+}
+
+// Parses IR and runs LoopTiling on its main, which is returned.
+static Function *runLoopTiling(LLVMContext &Context, StringRef IR,
+                               unique_ptr<Module> &M) {
+  SMDiagnostic Err;
+  M = parseAssemblyString(IR, Err, Context);
+  if (!M)
+    return nullptr;
+  PassBuilder PB;
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  Function *Main = M->getFunction("main");
+  LoopTiling().run(*Main, FAM);
+  return Main;
+}
+
+static BasicBlock *getBlock(Function *F, StringRef Name) {
+  for (BasicBlock &BB : *F)
+    if (BB.getName() == Name)
+      return &BB;
+  return nullptr;
+}
+
+TEST(LoopTiling, TilesNest) {
+  // a[m][i] for m inside i crosses a row of 10000 elements every
+  // iteration; tiles of two m outside i keep the head within two rows.
+  // The inner loop runs to the tile end, or to the bound in the last tile.
+  LLVMContext Context;
+  unique_ptr<Module> M;
+  Function *Main = runLoopTiling(Context, R"(
+declare i8* @malloc(i64)
+declare void @write(i64)
+define i64 @main() {
+entry:
+  %p = call i8* @malloc(i64 1280000)
+  %a = bitcast i8* %p to i64*
+  br label %for.cond
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc.i, %for.inc.i ]
+  %cmp.i = icmp ult i64 %i, 8
+  br i1 %cmp.i, label %for.body, label %for.end
+for.body:
+  br label %for.cond1
+for.cond1:
+  %m = phi i64 [ 0, %for.body ], [ %inc.m, %for.body1 ]
+  %cmp.m = icmp ult i64 %m, 15
+  br i1 %cmp.m, label %for.body1, label %for.inc.i
+for.body1:
+  %row = mul i64 %m, 10000
+  %idx = add i64 %row, %i
+  %ptr = getelementptr inbounds i64, i64* %a, i64 %idx
+  %v = load i64, i64* %ptr
+  %v1 = add i64 %v, 1
+  store i64 %v1, i64* %ptr
+  %inc.m = add i64 %m, 1
+  br label %for.cond1
+for.inc.i:
+  %inc.i = add i64 %i, 1
+  br label %for.cond
+for.end:
+  %last = getelementptr inbounds i64, i64* %a, i64 140007
+  %r = load i64, i64* %last
+  call void @write(i64 %r)
+  ret i64 0
+}
+)", M);
+  ASSERT_TRUE(Main);
+  EXPECT_FALSE(verifyFunction(*Main, &errs()));
+  ASSERT_TRUE(getBlock(Main, "for.cond.tile"));
+  ASSERT_TRUE(getBlock(Main, "for.cond.tile.latch"));
+  BasicBlock *TileBody = getBlock(Main, "for.cond.tile.body");
+  ASSERT_TRUE(TileBody);
+  SelectInst *Limit = nullptr;
+  for (Instruction &I : *TileBody)
+    if (auto *SI = dyn_cast<SelectInst>(&I))
+      Limit = SI;
+  ASSERT_TRUE(Limit);
+  auto *Bound = dyn_cast<ConstantInt>(Limit->getFalseValue());
+  ASSERT_TRUE(Bound);
+  EXPECT_EQ(Bound->getZExtValue(), 15u);
+  auto *Cmp = cast<ICmpInst>(getBlock(Main, "for.cond1")->getTerminator()
+                                 ->getOperand(0));
+  EXPECT_EQ(Cmp->getOperand(1), Limit);
+}
+
+TEST(LoopTiling, RefusesCarriedDependence) {
+  // Each element of a adds one to the element of the previous row one
+  // column further along. Tiling j by 2 outside i would save head travel,
+  // but the last iteration of each tile would then read an element that
+  // the next tile has yet to write.
+  LLVMContext Context;
+  unique_ptr<Module> M;
+  Function *Main = runLoopTiling(Context, R"(
+declare i8* @malloc(i64)
+declare void @write(i64)
+define i64 @main() {
+entry:
+  %p = call i8* @malloc(i64 400000)
+  %a = bitcast i8* %p to i64*
+  br label %for.cond
+for.cond:
+  %i = phi i64 [ 0, %entry ], [ %inc.i, %for.inc.i ]
+  %cmp.i = icmp ult i64 %i, 4
+  br i1 %cmp.i, label %for.body, label %for.end
+for.body:
+  br label %for.cond1
+for.cond1:
+  %j = phi i64 [ 0, %for.body ], [ %inc.j, %for.body3 ]
+  %cmp.j = icmp ult i64 %j, 64
+  br i1 %cmp.j, label %for.body3, label %for.inc.i
+for.body3:
+  %row = mul i64 %i, 10000
+  %aidx0 = sub i64 40000, %row
+  %aidx = sub i64 %aidx0, %j
+  %pidx = add i64 %aidx, 9999
+  %pptr = getelementptr inbounds i64, i64* %a, i64 %pidx
+  %pv = load i64, i64* %pptr
+  %v1 = add i64 %pv, 1
+  %aptr = getelementptr inbounds i64, i64* %a, i64 %aidx
+  store i64 %v1, i64* %aptr
+  %inc.j = add i64 %j, 1
+  br label %for.cond1
+for.inc.i:
+  %inc.i = add i64 %i, 1
+  br label %for.cond
+for.end:
+  %last = getelementptr inbounds i64, i64* %a, i64 10000
+  %v = load i64, i64* %last
+  call void @write(i64 %v)
+  ret i64 0
+}
+)", M);
+  ASSERT_TRUE(Main);
+  EXPECT_FALSE(getBlock(Main, "for.cond.tile"));
+}
+
+TEST(CompilationCache, StoreAndLookup) {
+  SmallString<128> Dir;
+  ASSERT_FALSE(sys::fs::createUniqueDirectory("sf-cache", Dir));
+  CompilationCache Cache(Dir.str().str(), "build", "");
+  string Key = Cache.getKey("module", {"ab", "c"});
+  // Parts are kept apart, and other builds and kinds get other keys.
+  EXPECT_NE(Key, Cache.getKey("module", {"a", "bc"}));
+  EXPECT_NE(Key, Cache.getKey("function", {"ab", "c"}));
+  EXPECT_NE(Key, CompilationCache(Dir.str().str(), "other build", "")
+                     .getKey("module", {"ab", "c"}));
+
+  string Text;
+  EXPECT_FALSE(Cache.lookup(Key, Text));
+  Cache.store(Key, "start main 0:\nend main\n");
+  ASSERT_TRUE(Cache.lookup(Key, Text));
+  EXPECT_EQ(Text, "start main 0:\nend main\n");
+  sys::fs::remove_directories(Dir);
+}
+
+TEST(CompilationCache, OptionsChangeKeys) {
+  // Modules and functions compiled with other options are not found, and
+  // the options count the same wherever the cache is.
+  string Options = "-inline-threshold=0\n";
+  CompilationCache Plain("sf-cache", "build", "");
+  CompilationCache Tuned("sf-cache", "build", Options);
+  EXPECT_NE(Plain.getKey("module", {"ab"}), Tuned.getKey("module", {"ab"}));
+  EXPECT_NE(Plain.getKey("function", {"ab"}),
+            Tuned.getKey("function", {"ab"}));
+  EXPECT_EQ(Tuned.getKey("function", {"ab"}),
+            CompilationCache("other-cache", "build", Options)
+                .getKey("function", {"ab"}));
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();